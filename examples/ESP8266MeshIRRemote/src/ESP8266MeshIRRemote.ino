@@ -21,7 +21,7 @@
  *  esp8266 can only supply 12mA on its GPIO pin.
  * 
  *  Known commands:
- *  NOTE: The maximum length of topic + payload is ~1156 bytes
+ *  NOTE: Messages longer than ~1156 bytes (topic + payload) are fragmented by the mesh, up to MESH_FRAG_MAX (8192) bytes
  *  <topic>/send : code=<pronto code>                                           : send specified code one time
  *  <topic>/send : repeat=5,code=<pronto code>                                  : send specified code 5 times
  *  <topic>/send : repeat=5,code=<pronto code1>,repeat=3,pronto=<pronto code2>  : send code1 5 times followed by sending code2 3 times
@@ -93,6 +93,7 @@ unsigned int hlw8012_getVoltage();
 ESP8266MQTTMesh mesh = ESP8266MQTTMesh::Builder(networks, mqtt_server)
                      .setVersion(FIRMWARE_VER, FIRMWARE_ID)
                      .setMeshPassword(mesh_password)
+                     .setOfflineStore(&SPIFFS)
                      .build();
 
 bool relayState = false;
@@ -111,6 +112,7 @@ void setup() {
     pinMode(BUTTON,     INPUT);
     Serial.begin(115200);
     delay(5000);
+    SPIFFS.begin();
     mesh.setCallback(callback);
     mesh.begin();
 #if HAS_DS18B20
@@ -125,7 +127,6 @@ Serial.println("HLW8012 start");
     hlw8012.setResistors(HLW8012_CURRENT_R, HLW8012_VOLTAGE_R_UP, HLW8012_VOLTAGE_R_DOWN);
 #endif
 Serial.println("HLW8012 end");
-    //mesh.setup will initialize the filesystem
     if (SPIFFS.exists("/config")) {
         read_config();
     }
@@ -202,9 +203,7 @@ void loop() {
     } else if (now - lastSend > heartbeat) {
         needToSend = true;
     }
-    if (! mesh.connected()) {
-        return;
-    }
+    //Readings taken while disconnected are kept in the offline store and sent once connected again
     if (needToSend) {
         lastSend = now;
         String data = build_json();
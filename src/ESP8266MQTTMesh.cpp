@@ -17,9 +17,10 @@
 
 #include "ESP8266MQTTMesh.h"
 
-#define MESH_API_VER "001"
+#define MESH_API_VER "002"
 
 #include "Base64.h"
+#include "MeshLZ.h"
 
 #include <limits.h>
 #include <string>
@@ -40,6 +41,17 @@ enum {
     NETWORK_MESH_NODE  = -1,
 };
 
+//OUI of the vendor specific element advertising a node (Espressif's)
+static uint8_t mesh_oui[3] = {0x18, 0xFE, 0x34};
+#ifdef ESP32
+//Survives a software reset (including OTA and Restart), like the ESP8266's RTC user memory
+RTC_NOINIT_ATTR static mesh_parent_cache_t rtc_parent_cache;
+#endif
+#define MESH_PARENT_FILE "/mesh_parent"
+
+//Receives the elements seen while scanning.  The SDK callback has no user argument
+static ESP8266MQTTMesh *beaconMesh = NULL;
+
 //Define GATEWAY_ID to the value of ESP.getChipId() in order to prevent only a specific node from connecting via MQTT
 #ifdef GATEWAY_ID
     #define IS_GATEWAY (_chipID == GATEWAY_ID)
@@ -57,6 +69,11 @@ enum {
     Serial.println(msg);
     //Serial.println(String("[") + __FUNCTION__ + String("] ") + msg);
 
+//Used on the message path, where building String temporaries would cost heap allocations for every message
+#define dbgPrintf(lvl, fmt, ...)           \
+    if (((lvl) & (EMMDBG_LEVEL)) == (lvl)) \
+    Serial.printf(fmt "\n", ##__VA_ARGS__);
+
 size_t mesh_strlcat(char* dst, const char* src, size_t len)
 {
     size_t slen = strlen(dst);
@@ -70,6 +87,10 @@ ESP8266MQTTMesh::ESP8266MQTTMesh(const wifi_conn *networks,
                     const char *mqtt_username, const char *mqtt_password,
                     const char *firmware_ver, int firmware_id,
                     const char *mesh_ssid, const char *_mesh_password, int mesh_port,
+                    uint16_t coalesce_ms, uint16_t coalesce_bytes, bool compress,
+                    uint8_t rx_buffers, uint16_t rx_buffer_size,
+                    fs::FS *store_fs, uint32_t store_size, uint8_t store_policy,
+                    uint32_t backoff_base_ms, uint32_t backoff_cap_ms,
 #if ASYNC_TCP_SSL_ENABLED
                     bool mqtt_secure, const uint8_t *mqtt_fingerprint, ssl_cert_t mesh_secure,
 #endif
@@ -84,6 +105,16 @@ ESP8266MQTTMesh::ESP8266MQTTMesh(const wifi_conn *networks,
         mqtt_password(mqtt_password),
         mqtt_port(mqtt_port),
         mesh_port(mesh_port),
+        coalesce_ms(coalesce_ms),
+        coalesce_bytes(coalesce_bytes),
+        compress(compress),
+        rx_pool_count(rx_buffers > MESH_RX_POOL_MAX ? MESH_RX_POOL_MAX : rx_buffers),
+        rx_pool_size(rx_buffer_size > MQTT_MAX_PACKET_SIZE ? MQTT_MAX_PACKET_SIZE : rx_buffer_size),
+        store_fs(store_fs),
+        store_size(store_size),
+        store_policy(store_policy),
+        backoff_base_ms(backoff_base_ms ? backoff_base_ms : 1),
+        backoff_cap_ms(backoff_cap_ms < backoff_base_ms ? backoff_base_ms : backoff_cap_ms),
 #if ASYNC_TCP_SSL_ENABLED
         mqtt_secure(mqtt_secure),
         mqtt_fingerprint(mqtt_fingerprint),
@@ -100,6 +131,8 @@ ESP8266MQTTMesh::ESP8266MQTTMesh(const wifi_conn *networks,
         mesh_bssid_key = lfsr(mesh_bssid_key, mesh_password[i]);
     }
     espClient[0] = new AsyncClient();
+    //Start somewhere random, so messages sent after a reboot don't look like copies of earlier ones
+    origin_seq = random(0x10000);
     String tmp = String(_chipID, HEX);
     tmp.toUpperCase();
     while (tmp.length() < 6)
@@ -123,6 +156,22 @@ void ESP8266MQTTMesh::setCallback(std::function<void(const char *topic, const ch
     callback = _callback;
 }
 
+void ESP8266MQTTMesh::setDeliveryCallback(std::function<void(uint16_t msgId, uint32_t latency)> _callback) {
+    deliveryCallback = _callback;
+}
+
+void ESP8266MQTTMesh::setStreamCallback(std::function<void(const char *topic, const char *payload, size_t len, size_t index, size_t total)> _callback) {
+    streamCallback = _callback;
+}
+
+void ESP8266MQTTMesh::setParentCostCallback(std::function<int32_t(const mesh_parent_info_t &candidate)> _callback) {
+    parentCost = _callback;
+}
+
+void ESP8266MQTTMesh::setTxWatermarkCallback(std::function<void(int link, bool congested)> _callback) {
+    txWatermarkCallback = _callback;
+}
+
 void ESP8266MQTTMesh::begin() {
     int len = strlen(inTopic);
     if (len > 16) {
@@ -151,6 +200,16 @@ void ESP8266MQTTMesh::begin() {
     //dbgPrintln(EMMDBG_MSG, "Port: " + String(mesh_port));
 
     dbgPrintln(EMMDBG_MSG, "Starting Firmware " + String(firmware_id, HEX) + " : " + String(firmware_ver));
+    if (compress && ! zbuf) {
+        zbuf = new uint8_t[MQTT_MAX_PACKET_SIZE];
+    }
+    if (rx_pool_count && ! rx_pool) {
+        //One block for all buffers, so leasing them never fragments the heap
+        rx_pool = new char[rx_pool_count * rx_pool_size];
+    }
+    if (store_fs && ! store_batch) {
+        store_init();
+    }
 #if HAS_OTA
     dbgPrintln(EMMDBG_MSG, "OTA Start: 0x" + String(freeSpaceStart, HEX) + " OTA End: 0x" + String(freeSpaceEnd, HEX));
 #endif
@@ -181,19 +240,21 @@ void ESP8266MQTTMesh::begin() {
     WiFi.mode(WIFI_STA);
 
     this->connectWiFiEvents();
+    beaconMesh = this;
+    wifi_register_user_ie_manufacturer_recv_cb(beacon_seen_static);
 
     espClient[0]->setNoDelay(true);
-    espClient[0]->onConnect(   [this](void * arg, AsyncClient *c)                           { this->onConnect(c);         }, this);
-    espClient[0]->onDisconnect([this](void * arg, AsyncClient *c)                           { this->onDisconnect(c);      }, this);
-    espClient[0]->onError(     [this](void * arg, AsyncClient *c, int8_t error)             { this->onError(c, error);    }, this);
-    espClient[0]->onAck(       [this](void * arg, AsyncClient *c, size_t len, uint32_t time){ this->onAck(c, len, time);  }, this);
-    espClient[0]->onTimeout(   [this](void * arg, AsyncClient *c, uint32_t time)            { this->onTimeout(c, time);   }, this);
-    espClient[0]->onData(      [this](void * arg, AsyncClient *c, void* data, size_t len)   { this->onData(c, data, len); }, this);
-
-    espServer.onClient(     [this](void * arg, AsyncClient *c){ this->onClient(c);  }, this);
+    espClient[0]->onConnect(   [this](void * /*arg*/, AsyncClient *c)                           { this->onConnect(c);         }, this);
+    espClient[0]->onDisconnect([this](void * /*arg*/, AsyncClient *c)                           { this->onDisconnect(c);      }, this);
+    espClient[0]->onError(     [this](void * /*arg*/, AsyncClient *c, int8_t error)             { this->onError(c, error);    }, this);
+    espClient[0]->onAck(       [this](void * /*arg*/, AsyncClient *c, size_t len, uint32_t time){ this->onAck(c, len, time);  }, this);
+    espClient[0]->onTimeout(   [this](void * /*arg*/, AsyncClient *c, uint32_t time)            { this->onTimeout(c, time);   }, this);
+    espClient[0]->onData(      [this](void * /*arg*/, AsyncClient *c, void* data, size_t len)   { this->onData(0, c, data, len); }, this);
+
+    espServer.onClient(     [this](void * /*arg*/, AsyncClient *c){ this->onClient(c);  }, this);
     espServer.setNoDelay(true);
 #if ASYNC_TCP_SSL_ENABLED
-    espServer.onSslFileRequest([this](void * arg, const char *filename, uint8_t **buf) -> int { return this->onSslFileRequest(filename, buf); }, this);
+    espServer.onSslFileRequest([this](void * /*arg*/, const char *filename, uint8_t **buf) -> int { return this->onSslFileRequest(filename, buf); }, this);
     if (mesh_secure.cert) {
         dbgPrintln(EMMDBG_WIFI, "Starting secure server");
         espServer.beginSecure("cert","key",NULL);
@@ -229,6 +290,12 @@ void ESP8266MQTTMesh::begin() {
     dbgPrintln(EMMDBG_WIFI_EXTRA, WiFi.status());
     dbgPrintln(EMMDBG_MSG_EXTRA, "Setup Complete");
     ap_ptr = NULL;
+    offline_start = conn_state_start = millis();
+    //Neighbours usually lose their parent at the same moment, so their retries must not follow the same sequence
+    backoff_seed = _chipID * 2654435761u;
+    if (! backoff_seed) {
+        backoff_seed = 1;
+    }
     connect();
 }
 
@@ -254,6 +321,14 @@ void staticWiFiEventHandler(system_event_id_t event, system_event_info_t info)
 void ESP8266MQTTMesh::WiFiEventHandler(arduino_event_id_t event, arduino_event_info_t info)
 {
     switch(event) {
+    case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+    {
+        struct WiFiEventStationModeConnected e;
+        memcpy(e.bssid, info.wifi_sta_connected.bssid, 6);
+        e.channel = info.wifi_sta_connected.channel;
+        this->onWifiAssociated(e);
+        break;
+    }
     case ARDUINO_EVENT_WIFI_STA_GOT_IP:
     {
         struct WiFiEventStationModeGotIP e;
@@ -289,6 +364,14 @@ void ESP8266MQTTMesh::WiFiEventHandler(arduino_event_id_t event, arduino_event_i
 void ESP8266MQTTMesh::WiFiEventHandler(system_event_id_t event, system_event_info_t info)
 {
     switch(event) {
+    case SYSTEM_EVENT_STA_CONNECTED:
+    {
+        struct WiFiEventStationModeConnected e;
+        memcpy(e.bssid, info.connected.bssid, 6);
+        e.channel = info.connected.channel;
+        this->onWifiAssociated(e);
+        break;
+    }
     case SYSTEM_EVENT_STA_GOT_IP:
     {
         struct WiFiEventStationModeGotIP e;
@@ -330,6 +413,8 @@ void ESP8266MQTTMesh::connectWiFiEvents()
 #else //USE_WIFI_ONEVENT
 void ESP8266MQTTMesh::connectWiFiEvents()
 {
+    wifiAssocHandler =
+        WiFi.onStationModeConnected(        [this] (const WiFiEventStationModeConnected& e) {            this->onWifiAssociated(e); });
     wifiConnectHandler =
         WiFi.onStationModeGotIP(            [this] (const WiFiEventStationModeGotIP& e) {                this->onWifiConnect(e);    }); 
     wifiDisconnectHandler =
@@ -380,6 +465,82 @@ bool ESP8266MQTTMesh::verify_bssid(uint8_t *bssid) {
     return res == wanted;
 }
 
+int32_t ESP8266MQTTMesh::defaultParentCost(const mesh_parent_info_t &candidate) {
+    //Every hop adds latency, so a node only goes through another one if that gets it a much better link
+    uint8_t depth = candidate.is_ap ? 0 : (candidate.advertised && candidate.depth ? candidate.depth : MESH_DEPTH_UNKNOWN);
+    int32_t cost = (depth + 1) * MESH_COST_HOP;
+    int8_t link = candidate.rssi;
+    if (candidate.path_rssi && candidate.path_rssi < link) {
+        link = candidate.path_rssi;
+    }
+    if (link < MESH_COST_RSSI_GOOD) {
+        cost += (MESH_COST_RSSI_GOOD - link) * 2;
+    }
+    if (! candidate.is_ap && candidate.advertised && ! candidate.free_slots) {
+        cost += MESH_COST_FULL;
+    }
+    return cost;
+}
+
+void ESP8266MQTTMesh::advertise() {
+    //Tell nodes looking for a parent how far we are from the access point and whether we have room for them
+    if (! AP_ready) {
+        return;
+    }
+    mesh_beacon_ie_t ie;
+    ie.type = MESH_IE_TYPE;
+    ie.depth = mesh_depth;
+    ie.free_slots = 0;
+    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+        if (! espClient[i]) {
+            ie.free_slots++;
+        }
+    }
+    ie.path_rssi = path_rssi;
+    ie.subnet = ap_subnet;
+    wifi_set_user_ie(true, mesh_oui, USER_IE_BEACON, (uint8_t *)&ie, sizeof(ie));
+    wifi_set_user_ie(true, mesh_oui, USER_IE_PROBE_RESP, (uint8_t *)&ie, sizeof(ie));
+}
+
+void ESP8266MQTTMesh::beacon_seen_static(user_ie_type /*type*/, const uint8_t sa[6], const uint8_t m_oui[3], uint8_t *ie, uint8_t ie_len, int32_t /*rssi*/) {
+    if (beaconMesh && memcmp(m_oui, mesh_oui, sizeof(mesh_oui)) == 0) {
+        beaconMesh->beacon_seen(sa, ie, ie_len);
+    }
+}
+
+void ESP8266MQTTMesh::beacon_seen(const uint8_t *bssid, const uint8_t *ie, uint8_t len) {
+    //Some SDK versions pass the whole element, including its ID, length and OUI
+    if (len >= 5 && ie[0] == 0xDD && memcmp(ie + 2, mesh_oui, sizeof(mesh_oui)) == 0) {
+        ie += 5;
+        len -= 5;
+    }
+    if (len < MESH_BEACON_IE_MIN || ie[0] != MESH_IE_TYPE || ! (scanning || bgScanning)) {
+        return;
+    }
+    mesh_beacon_t *b = NULL;
+    for (int i = 0; i < MESH_BEACON_COUNT && ! b; i++) {
+        if (memcmp(beacons[i].bssid, bssid, 6) == 0) {
+            b = &beacons[i];
+        }
+    }
+    if (! b) {
+        b = &beacons[beacons_next];
+        beacons_next = (beacons_next + 1) % MESH_BEACON_COUNT;
+        memcpy(b->bssid, bssid, 6);
+    }
+    memset(&b->ie, 0, sizeof(mesh_beacon_ie_t));
+    memcpy(&b->ie, ie, len < sizeof(mesh_beacon_ie_t) ? len : sizeof(mesh_beacon_ie_t));
+}
+
+const mesh_beacon_ie_t *ESP8266MQTTMesh::beacon_find(const uint8_t *bssid) {
+    for (int i = 0; i < MESH_BEACON_COUNT; i++) {
+        if (beacons[i].ie.type == MESH_IE_TYPE && memcmp(beacons[i].bssid, bssid, 6) == 0) {
+            return &beacons[i].ie;
+        }
+    }
+    return NULL;
+}
+
 bool ESP8266MQTTMesh::connected() {
     delay(0); // let the Interrupts execute
     return wifiConnected() && ((meshConnect && espClient[0] && espClient[0]->connected() && p2pConnected) || mqttClient.connected());
@@ -388,13 +549,27 @@ bool ESP8266MQTTMesh::connected() {
 void ESP8266MQTTMesh::scan() {
     //Need to rescan
     if (! scanning) {
-        ap_ptr = NULL;
+        bgScanning = false;
         WiFi.disconnect();
         WiFi.mode(WIFI_STA);
-        dbgPrintln(EMMDBG_WIFI, "Scanning for networks");
-        WiFi.scanDelete();
-        WiFi.scanNetworks(true,true);
+        ap_clear();
+        //Only advertisements received during this scan are used
+        memset(beacons, 0, sizeof(beacons));
+        beacons_next = 0;
         scanning = true;
+        scan_start = millis();
+        scan_seen = 0;
+        //The whole mesh shares one channel, so only the channels parents were found on are scanned, unless that
+        //keeps finding nothing
+        if (scan_misses >= MESH_SCAN_MISSES) {
+            scan_channels = 0;
+        }
+        scan_pending = scan_channels;
+        stats.scans++;
+        if (! scan_pending) {
+            stats.scans_full++;
+        }
+        scan_next();
     }
 
     //scanComplete returns <0 while scanning is in progress
@@ -404,79 +579,516 @@ void ESP8266MQTTMesh::scan() {
     }
     dbgPrintln(EMMDBG_WIFI, "Found: " + String(numberOfNetworksFound));
 
+    for(int i = 0; i < numberOfNetworksFound; i++) {
+        ap_t found;
+        mesh_parent_info_t info;
+        if (! scan_result(i, &found, &info)) {
+            continue;
+        }
+        ap_update(&found, &info);
+        if (found.channel < 16) {
+            scan_seen |= 1 << found.channel;
+        }
+    }
+    if (scan_pending) {
+        scan_next();
+        return;
+    }
     scanning = false;
+    stats.scan_ms = millis() - scan_start;
+    if (scan_seen) {
+        scan_misses = 0;
+        scan_channels |= scan_seen;
+    } else if (scan_channels) {
+        scan_misses++;
+    }
+    dbgPrintln(EMMDBG_TIMING, "Scan took " + String(stats.scan_ms) + "ms");
+    ap_sort();
+    ap_ptr = ap_count && aps[0].seen ? &aps[0] : NULL;
+}
+
+bool ESP8266MQTTMesh::scan_result(int i, ap_t *found, mesh_parent_info_t *info) {
+    //Whether scan result i is a possible parent, and if so what it would cost
+    int network_idx = NETWORK_MESH_NODE;
+    int rssi = WiFi.RSSI(i);
+    dbgPrintln(EMMDBG_WIFI, "Found SSID: '" + WiFi.SSID(i) + "' BSSID '" + WiFi.BSSIDstr(i) + "'" + " RSSI: " + String(rssi));
+    if (IS_GATEWAY) { //Always true except if configured that only a specific Node is allowed to connect to the real Acess Point
+        network_idx = match_networks(WiFi.SSID(i).c_str(), WiFi.BSSIDstr(i).c_str());
+    }
+    if(network_idx == NETWORK_MESH_NODE) {
+        if (WiFi.SSID(i).length()) { //Mesh Nodes have no SSID, so here are only "real" Acess Points, which did not matched the AP List
+            dbgPrintln(EMMDBG_WIFI_EXTRA, "Did not match SSID list");
+            return false;
+        } else { //Here the Mesh Nodes are handled
+            if (! verify_bssid(WiFi.BSSID(i))) { //Check if the Node is a Mesh Node, if not just ignore this Signal
+                dbgPrintln(EMMDBG_WIFI_EXTRA, "Failed to match BSSID");
+                return false;
+            }
+        }
+    }//else Connection is a direct Access Point which matched the Access Point Credential List
+    found->ssid_idx = network_idx;
+    found->rssi = rssi;
+    found->channel = WiFi.channel(i);
+    memcpy(found->bssid, WiFi.BSSID(i), 6);
+
+    memset(info, 0, sizeof(*info));
+    info->rssi = rssi;
+    info->is_ap = network_idx != NETWORK_MESH_NODE;
+    const mesh_beacon_ie_t *ie = info->is_ap ? NULL : beacon_find(found->bssid);
+    if (ie) {
+        info->advertised = true;
+        info->depth = ie->depth;
+        info->free_slots = ie->free_slots;
+        info->path_rssi = ie->path_rssi;
+        info->subnet = ie->subnet;
+    }
+    found->failures = 0;
+    found->seen = true;
+    found->cost = parent_cost(*info);
+    dbgPrintln(EMMDBG_WIFI_EXTRA, "Depth: " + String(info->depth) + " Free: " + String(info->free_slots) + " Cost: " + String(found->cost));
+    return true;
+}
 
-    //Initialize AP to be empty, and all unused APs on the unused list
-    if (ap_unused == NULL) {
-        ap_unused = ap;
+void ESP8266MQTTMesh::scan_next() {
+    uint8_t channel = 0;
+    for (int c = 1; c < 16 && ! channel; c++) {
+        if (scan_pending & (1 << c)) {
+            channel = c;
+        }
+    }
+    scan_pending &= ~(1 << channel);
+    if (channel) {
+        dbgPrintln(EMMDBG_WIFI, "Scanning for networks on channel " + String(channel));
     } else {
-        for(ap_ptr = ap_unused; ap_ptr->next != NULL; ap_ptr = ap_ptr->next)
-        {}
-        ap_ptr->next = ap;
+        dbgPrintln(EMMDBG_WIFI, "Scanning for networks");
     }
-    ap = NULL;
+    scan_channel(channel);
+}
 
-    for(int i = 0; i < numberOfNetworksFound; i++) {
-        int network_idx = NETWORK_MESH_NODE;
-        int rssi = WiFi.RSSI(i);
-        dbgPrintln(EMMDBG_WIFI, "Found SSID: '" + WiFi.SSID(i) + "' BSSID '" + WiFi.BSSIDstr(i) + "'" + " RSSI: " + String(rssi));
-        if (IS_GATEWAY) { //Always true except if configured that only a specific Node is allowed to connect to the real Acess Point
-            network_idx = match_networks(WiFi.SSID(i).c_str(), WiFi.BSSIDstr(i).c_str());
-        }
-        if(network_idx == NETWORK_MESH_NODE) {
-            if (WiFi.SSID(i).length()) { //Mesh Nodes have no SSID, so here are only "real" Acess Points, which did not matched the AP List
-                dbgPrintln(EMMDBG_WIFI_EXTRA, "Did not match SSID list");
+void ESP8266MQTTMesh::scan_channel(uint8_t channel) {
+    WiFi.scanDelete();
+#ifdef ESP32
+    WiFi.scanNetworks(true, true, false, MESH_SCAN_CHANNEL_MS, channel);
+#else
+    WiFi.scanNetworks(true, true, channel);
+#endif
+}
+
+void ESP8266MQTTMesh::bg_scan_schedule(uint32_t delay_ms) {
+    bgScanning = false;
+    bgTimer.once_ms(delay_ms, bg_scan_static, this);
+}
+
+void ESP8266MQTTMesh::bg_scan() {
+    //Look for a better parent while connected.  Only our own channel is scanned, so the radio never leaves it and
+    //our children don't notice
+    if (switching) {
+        return;
+    }
+    if (! meshConnect || ! connected() || scanning || mesh_depth < 2) {
+        //Only nodes behind another node look for a shorter way to the access point
+        bg_scan_schedule(MESH_BG_SCAN_MS);
+        return;
+    }
+    if (! bgScanning) {
+        memset(beacons, 0, sizeof(beacons));
+        beacons_next = 0;
+        bgScanning = true;
+        dbgPrintln(EMMDBG_WIFI_EXTRA, "Background scan on channel " + String(WiFi.channel()));
+        scan_channel(WiFi.channel());
+        bgTimer.once_ms(MESH_BG_SCAN_POLL_MS, bg_scan_static, this);
+        return;
+    }
+    int numberOfNetworksFound = WiFi.scanComplete();
+    if (numberOfNetworksFound < 0) {
+        bgTimer.once_ms(MESH_BG_SCAN_POLL_MS, bg_scan_static, this);
+        return;
+    }
+    bgScanning = false;
+    uint32_t self = _chipID & 0x00FFFFFF; //As in our BSSID
+    //What the current parent costs now.  Assume what we know if its beacon was missed
+    mesh_parent_info_t info = {};
+    info.rssi = WiFi.RSSI();
+    info.advertised = true;
+    info.depth = mesh_depth - 1;
+    info.free_slots = 1;
+    info.path_rssi = path_rssi;
+    int32_t current = parent_cost(info);
+    ap_t best;
+    best.cost = INT32_MAX;
+    for (int i = 0; i < numberOfNetworksFound; i++) {
+        ap_t found;
+        if (! scan_result(i, &found, &info)) {
+            continue;
+        }
+        if (ap_ptr && memcmp(found.bssid, ap_ptr->bssid, 6) == 0) {
+            current = found.cost;
+            continue;
+        }
+        uint32_t id = (found.bssid[3] << 16) | (found.bssid[4] << 8) | found.bssid[5];
+        if (! info.is_ap) {
+            //A node at our depth or deeper may be behind us.  Our AP keeps its subnet, so the new parent's must differ
+            if (! info.advertised || ! info.depth || info.depth >= mesh_depth || ! info.subnet || info.subnet == ap_subnet) {
                 continue;
-            } else { //Here the Mesh Nodes are handled
-                if (! verify_bssid(WiFi.BSSID(i))) { //Check if the Node is a Mesh Node, if not just ignore this Signal
-                    dbgPrintln(EMMDBG_WIFI_EXTRA, "Failed to match BSSID");
-                    continue;
-                }
             }
-        }//else Connection is a direct Access Point which matched the Access Point Credential List
-        ap_t *next_ap;
-        if (ap_unused == NULL) {
-            next_ap = new ap_t;
-        } else {
-            next_ap =ap_unused;
-            ap_unused = ap_unused->next;
-        }
-        //Assign next_ap
-        next_ap->ssid_idx = network_idx;
-        next_ap->rssi = rssi;
-        memcpy(next_ap->bssid, WiFi.BSSID(i), 6);
-
-        //sort by RSSI
-        ap_t *ap_last = NULL;
-        for(ap_ptr = ap; ap_ptr != NULL; ap_last = ap_ptr, ap_ptr = ap_ptr->next) {
-            if(network_idx != NETWORK_MESH_NODE) {
-                //Tested Signal is Wifi AP
-                if ((ap_ptr->ssid_idx == NETWORK_MESH_NODE && //Current Signal is Mesh Node
-                     (rssi >= -77 || rssi >= ap_ptr->rssi))|| //and Signal under Test to direct AP have to be quite decent or at least better then current one
-                     (ap_ptr->ssid_idx != NETWORK_MESH_NODE && rssi >= ap_ptr->rssi))//or both are Ap Points, but tested one have stronger Signal
-                {
-                    break;
-                }
-            } else {
-                //Tested Signal is mesh node
-                if ((ap_ptr->ssid_idx == NETWORK_MESH_NODE || //if Actual Node is Mesh Node
-                    (ap_ptr->ssid_idx != NETWORK_MESH_NODE && ap_ptr->rssi <= -77)) && //or is AP, but with weak Signal
-                      rssi >= ap_ptr->rssi) //and in either Way have better Connection then actuall one
-                {
-                    break;
+            bool behind = false;
+            for (int r = 0; r < MESH_ROUTE_COUNT; r++) {
+                if (routes[r].link && (routes[r].id & 0x00FFFFFF) == id) {
+                    behind = true;
                 }
             }
+            if (behind || id == self) {
+                continue;
+            }
         }
-        //Insert next_ap before ap_ptr (i.e. at last_ap)
-        next_ap->next = ap_ptr;
-        if (ap_last) {
-            ap_last->next = next_ap;
-        } else {
-            //ap was empty, so create it
-            ap = next_ap;
+        if (found.cost < best.cost) {
+            best = found;
+        }
+    }
+    WiFi.scanDelete();
+    if (best.cost != INT32_MAX
+        && (best.cost + MESH_SWITCH_HYSTERESIS < current || (WiFi.RSSI() < MESH_SWITCH_RSSI && best.cost < current))) {
+        switch_parent(&best);
+        return;
+    }
+    bg_scan_schedule(MESH_BG_SCAN_MS);
+}
+
+void ESP8266MQTTMesh::switch_parent(const ap_t *next) {
+    //Make before break: our AP and the links to our children stay up while we move to the new parent
+    dbgPrintln(EMMDBG_WIFI, "Switching to parent " + mac_str((uint8_t *)next->bssid) + " cost " + String(next->cost));
+    switching = true;
+    stats.parent_switches++;
+    ap_clear();
+    ap_ptr = ap_use(next);
+    char _mesh_ssid[32];
+    const char *ssid;
+    const char *password;
+    if (ap_ptr->ssid_idx == NETWORK_MESH_NODE) {
+        ssid = build_mesh_ssid(_mesh_ssid, ap_ptr->bssid);
+        password = mesh_password;
+    } else {
+        ssid = networks[ap_ptr->ssid_idx].ssid;
+        password = networks[ap_ptr->ssid_idx].password;
+    }
+    p2pConnected = false;
+    espClient[0]->close(true);
+    //Nothing the old parent granted or announced applies to the new one
+    uplink_reset();
+    meshConnect = ap_ptr->ssid_idx == NETWORK_MESH_NODE;
+    WiFi.begin(ssid, password, ap_ptr->channel, ap_ptr->bssid);
+    alreaddyDisconnected = false;
+    bgTimer.once_ms(MESH_SWITCH_TIMEOUT_MS, switch_timeout_static, this);
+}
+
+void ESP8266MQTTMesh::switch_timeout() {
+    if (! switching) {
+        return;
+    }
+    //The new parent did not work out.  Fall back to a regular reconnect, which takes our subtree down
+    dbgPrintln(EMMDBG_WIFI, "Switching parent timed out");
+    switching = false;
+    p2pConnected = false;
+    shutdown_AP();
+    ap_ptr = NULL;
+    conn_state_set(MESH_STATE_SCANNING);
+    WiFi.disconnect();
+    schedule_connect(backoff(&backoff_wifi));
+}
+
+void ESP8266MQTTMesh::switch_done() {
+    //Online again, through a new parent or the old one
+    if (switching) {
+        dbgPrintln(EMMDBG_WIFI, "Switched parent");
+        switching = false;
+        if (AP_ready && WiFi.gatewayIP()[1] == ap_subnet) {
+            //An access point we could not ask for its subnet uses ours.  Our children have to reconnect to the rebuilt AP
+            dbgPrintln(EMMDBG_WIFI, "New parent uses the subnet of our AP, restarting it");
+            shutdown_AP();
+        }
+        //Our old parent sends a LEAVE for our subtree, so tell the new path about it
+        route_announce();
+    }
+    bg_scan_schedule(MESH_BG_SCAN_MS);
+}
+
+void ESP8266MQTTMesh::conn_state_set(uint8_t state) {
+    uint32_t now = millis();
+    if (conn_state < MESH_CONN_STAGES) {
+        conn_ms[conn_state] += now - conn_state_start;
+    } else if (state != MESH_STATE_ONLINE) {
+        //Going offline, time the way back from here
+        offline_start = now;
+        memset(conn_ms, 0, sizeof(conn_ms));
+    }
+    if (state != MESH_STATE_LINK) {
+        link_retries = 0;
+        linkRetryPending = false;
+    }
+    conn_state = state;
+    conn_state_start = now;
+    connTimer.detach();
+    if (state == MESH_STATE_ASSOCIATING) {
+        connTimer.once_ms(MESH_ASSOC_TIMEOUT_MS, conn_timeout_static, this);
+    } else if (state == MESH_STATE_DHCP) {
+        connTimer.once_ms(MESH_DHCP_TIMEOUT_MS, conn_timeout_static, this);
+    }
+    //MESH_STATE_LINK is timed by link_connect().  A broker which is down is retried by onMqttDisconnect() for as
+    //long as it takes, since neither another parent nor a reboot would bring it back
+}
+
+void ESP8266MQTTMesh::conn_timeout() {
+    if (switching) {
+        //switch_timeout() decides whether the new parent worked out
+        return;
+    }
+    dbgPrintln(EMMDBG_WIFI, "Connection state " + String(conn_state) + " timed out after " + String(millis() - conn_state_start) + "ms");
+    stats.conn_timeouts++;
+    if (conn_state == MESH_STATE_LINK && link_retries < MESH_LINK_RETRIES) {
+        link_retry();
+        return;
+    }
+    conn_fail();
+}
+
+void ESP8266MQTTMesh::conn_fail() {
+    //The current parent did not work out, move on to the next one
+    if (MESH_OFFLINE_REBOOT_MS && millis() - offline_start > MESH_OFFLINE_REBOOT_MS) {
+        dbgPrintln(EMMDBG_WIFI, "Could not get online for " + String(millis() - offline_start) + "ms, restarting");
+        die();
+    }
+    //Leave MESH_STATE_LINK first, so that closing the connection is not taken for a reason to retry it
+    conn_state_set(MESH_STATE_SCANNING);
+    p2pConnected = false;
+    if (meshConnect && espClient[0]) {
+        espClient[0]->close(true);
+    }
+    if (! alreaddyDisconnected) {
+        //onWifiDisconnect() is not to count this failure again
+        alreaddyDisconnected = true;
+        ap_next();
+    }
+    WiFi.disconnect();
+    schedule_connect(backoff(&backoff_wifi));
+}
+
+void ESP8266MQTTMesh::conn_online() {
+    if (conn_state == MESH_STATE_ONLINE) {
+        //Back after switching parents
+        return;
+    }
+    conn_state_set(MESH_STATE_ONLINE);
+    backoff_wifi = 0;
+    stats.online_ms = millis() - offline_start;
+    char msg[96];
+    snprintf(msg, sizeof(msg), "scan:%u,assoc:%u,dhcp:%u,link:%u,total:%u",
+             (unsigned)conn_ms[MESH_STATE_SCANNING], (unsigned)conn_ms[MESH_STATE_ASSOCIATING],
+             (unsigned)conn_ms[MESH_STATE_DHCP], (unsigned)conn_ms[MESH_STATE_LINK], (unsigned)stats.online_ms);
+    dbgPrintln(EMMDBG_TIMING, "Online after " + String(msg));
+    publish("info/connect_ms", msg, MSG_TYPE_RETAIN_QOS_0);
+}
+
+void ESP8266MQTTMesh::link_connect() {
+    //Connect to the parent node, which is our gateway
+    linkRetryPending = false;
+    dbgPrintln(EMMDBG_WIFI, "Connecting to mesh: " + WiFi.gatewayIP().toString() + " on port: " + String(mesh_port));
+    rx_reset(0);
+#if ASYNC_TCP_SSL_ENABLED
+    espClient[0]->connect(WiFi.gatewayIP(), mesh_port, mesh_secure.cert ? true : false);
+#else
+    espClient[0]->connect(WiFi.gatewayIP(), mesh_port);
+#endif
+    connTimer.once_ms(MESH_LINK_TIMEOUT_MS, conn_timeout_static, this);
+}
+
+void ESP8266MQTTMesh::link_retry() {
+    //Usually a busy parent, or one which has not noticed that our last connection is gone.  Try again without giving
+    //up the association
+    uint32_t wait = backoff(&link_retries);
+    linkRetryPending = true;
+    dbgPrintln(EMMDBG_WIFI, "Retrying connection to parent node in " + String(wait) + "ms");
+    p2pConnected = false;
+    espClient[0]->close(true);
+    connTimer.once_ms(wait, link_connect_static, this);
+}
+
+int32_t ESP8266MQTTMesh::parent_cost(const mesh_parent_info_t &info) {
+    return parentCost ? parentCost(info) : defaultParentCost(info);
+}
+
+ap_t *ESP8266MQTTMesh::ap_slot(const uint8_t *bssid) {
+    //The entry for bssid, else a free one, else the one least worth keeping: not found by the current scan, or
+    //the most expensive
+    ap_t *worst = NULL;
+    for (int i = 0; i < ap_count; i++) {
+        if (memcmp(aps[i].bssid, bssid, 6) == 0) {
+            return &aps[i];
+        }
+        if (! worst || (worst->seen && ! aps[i].seen) || (worst->seen == aps[i].seen && aps[i].cost > worst->cost)) {
+            worst = &aps[i];
+        }
+    }
+    if (ap_count < MESH_AP_COUNT) {
+        return &aps[ap_count++];
+    }
+    return worst;
+}
+
+void ESP8266MQTTMesh::ap_update(const ap_t *found, mesh_parent_info_t *info) {
+    ap_t *e = ap_slot(found->bssid);
+    uint8_t failures = 0;
+    if (memcmp(e->bssid, found->bssid, 6) == 0) {
+        //Seen before.  A signal which was only briefly good counts for less, and so does a parent which failed us
+        failures = e->failures;
+        info->rssi = (info->rssi + e->rssi) / 2;
+    }
+    int32_t cost = parent_cost(*info) + failures * MESH_COST_FAIL;
+    if (failures == 0 && e->seen && memcmp(e->bssid, found->bssid, 6) != 0 && e->cost <= cost) {
+        //All entries are in use by cheaper candidates from this scan
+        return;
+    }
+    *e = *found;
+    e->rssi = info->rssi;
+    e->failures = failures;
+    e->cost = cost;
+    e->seen = true;
+}
+
+ap_t *ESP8266MQTTMesh::ap_use(const ap_t *found) {
+    //Makes found the only candidate of the current scan, keeping its history
+    ap_t *e = ap_slot(found->bssid);
+    uint8_t failures = memcmp(e->bssid, found->bssid, 6) == 0 ? e->failures : 0;
+    *e = *found;
+    e->failures = failures;
+    e->seen = true;
+    return e;
+}
+
+void ESP8266MQTTMesh::ap_sort() {
+    //Insertion sort, the table is small.  Candidates found by the latest scan go first, cheapest first
+    for (int i = 1; i < ap_count; i++) {
+        ap_t e = aps[i];
+        int j = i - 1;
+        while (j >= 0 && (e.seen > aps[j].seen || (e.seen == aps[j].seen && e.cost < aps[j].cost))) {
+            aps[j + 1] = aps[j];
+            j--;
+        }
+        aps[j + 1] = e;
+    }
+}
+
+void ESP8266MQTTMesh::ap_next() {
+    //Move on to the next candidate after a failure
+    if (! ap_ptr) {
+        return;
+    }
+    if (ap_ptr->failures < UINT8_MAX) {
+        ap_ptr->failures++;
+    }
+    for (ap_t *p = ap_ptr + 1; p < aps + ap_count; p++) {
+        if (p->seen) {
+            ap_ptr = p;
+            return;
+        }
+    }
+    ap_ptr = NULL;
+}
+
+void ESP8266MQTTMesh::ap_clear() {
+    //Forget which candidates were found, but not their history
+    for (int i = 0; i < ap_count; i++) {
+        aps[i].seen = false;
+    }
+    ap_ptr = NULL;
+}
+
+bool ESP8266MQTTMesh::parent_cache_load(mesh_parent_cache_t *cache) {
+#ifdef ESP32
+    memcpy(cache, &rtc_parent_cache, sizeof(*cache));
+#else
+    if (! ESP.rtcUserMemoryRead(MESH_RTC_OFFSET, (uint32_t *)cache, sizeof(*cache))) {
+        cache->magic = 0;
+    }
+#endif
+    if (cache->magic != (MESH_PARENT_MAGIC ^ mesh_bssid_key) && store_fs && store_fs->exists(MESH_PARENT_FILE)) {
+        //RTC memory does not survive a power loss
+        File f = store_fs->open(MESH_PARENT_FILE, "r");
+        if (! f || f.read((uint8_t *)cache, sizeof(*cache)) != sizeof(*cache)) {
+            cache->magic = 0;
+        }
+        f.close();
+    }
+    if (cache->magic != (MESH_PARENT_MAGIC ^ mesh_bssid_key) || cache->channel < 1 || cache->channel > 14) {
+        return false;
+    }
+    if (cache->ssid_idx == NETWORK_MESH_NODE) {
+        return verify_bssid(cache->bssid);
+    }
+    //The network list may have changed with a firmware update
+    for (int idx = 0; networks[idx].ssid != NULL; idx++) {
+        if (idx == cache->ssid_idx) {
+            return IS_GATEWAY;
+        }
+    }
+    return false;
+}
+
+void ESP8266MQTTMesh::parent_cache_save() {
+    //Called once we are online, so the parent is known to work
+    parentCacheTried = false;
+    if (! ap_ptr) {
+        return;
+    }
+    if (WiFi.channel() > 0 && WiFi.channel() < 16) {
+        scan_channels |= 1 << WiFi.channel();
+    }
+    ap_ptr->failures = 0;
+    mesh_parent_cache_t cache = {};
+    cache.magic = MESH_PARENT_MAGIC ^ mesh_bssid_key;
+    memcpy(cache.bssid, ap_ptr->bssid, 6);
+    cache.channel = WiFi.channel();
+    cache.rssi = WiFi.RSSI();
+    cache.ssid_idx = ap_ptr->ssid_idx;
+#ifdef ESP32
+    memcpy(&rtc_parent_cache, &cache, sizeof(cache));
+#else
+    ESP.rtcUserMemoryWrite(MESH_RTC_OFFSET, (uint32_t *)&cache, sizeof(cache));
+#endif
+    if (store_fs) {
+        //Only written when the parent changed, to spare the flash
+        mesh_parent_cache_t old = {};
+        File f = store_fs->open(MESH_PARENT_FILE, "r");
+        if (f) {
+            f.read((uint8_t *)&old, sizeof(old));
+            f.close();
         }
+        if (memcmp(old.bssid, cache.bssid, 6) || old.channel != cache.channel || old.ssid_idx != cache.ssid_idx || old.magic != cache.magic) {
+            f = store_fs->open(MESH_PARENT_FILE, "w");
+            if (f) {
+                f.write((const uint8_t *)&cache, sizeof(cache));
+                f.close();
+            }
+        }
+    }
+}
+
+bool ESP8266MQTTMesh::parent_cache_use() {
+    //Try the last parent which worked before falling back to a scan, which keeps the radio busy for seconds
+    mesh_parent_cache_t cache = {};
+    if (parentCacheTried || ! parent_cache_load(&cache)) {
+        return false;
     }
-    ap_ptr = ap;
+    parentCacheTried = true;
+    scan_channels |= 1 << cache.channel;
+    ap_t cached = {};
+    cached.rssi = cache.rssi;
+    memcpy(cached.bssid, cache.bssid, 6);
+    cached.channel = cache.channel;
+    cached.ssid_idx = cache.ssid_idx;
+    ap_clear();
+    ap_ptr = ap_use(&cached);
+    dbgPrintln(EMMDBG_WIFI, "Trying last parent " + mac_str(ap_ptr->bssid) + " on channel " + String(ap_ptr->channel));
+    return true;
 }
 
 int ESP8266MQTTMesh::match_networks(const char *ssid, const char *bssid)
@@ -506,13 +1118,33 @@ int ESP8266MQTTMesh::match_networks(const char *ssid, const char *bssid)
     return NETWORK_MESH_NODE;
 }
 
-void ESP8266MQTTMesh::schedule_connect(float delay) {
+uint32_t ESP8266MQTTMesh::backoff(uint8_t *attempts) {
+    //Full jitter: a random wait up to base * 2^attempts (at most cap), so that nodes which lost their parent or the
+    //broker together spread their retries out instead of coming back in lockstep
+    uint32_t range = backoff_base_ms;
+    for (uint8_t i = 0; i < *attempts && range < backoff_cap_ms; i++) {
+        range <<= 1;
+    }
+    if (range > backoff_cap_ms) {
+        range = backoff_cap_ms;
+    }
+    if (*attempts < UINT8_MAX) {
+        (*attempts)++;
+    }
+    //xorshift32
+    backoff_seed ^= backoff_seed << 13;
+    backoff_seed ^= backoff_seed >> 17;
+    backoff_seed ^= backoff_seed << 5;
+    return backoff_seed % (range + 1);
+}
+
+void ESP8266MQTTMesh::schedule_connect(uint32_t delay_ms) {
     if(connectScheduled){
         return;
     }
     connectScheduled = true;
-    dbgPrintln(EMMDBG_WIFI_EXTRA, "Scheduling reconnect for " + String(delay,2)+ " seconds from now");
-    schedule.once(delay, connect_static, this);
+    dbgPrintln(EMMDBG_WIFI_EXTRA, "Scheduling reconnect for " + String(delay_ms) + "ms from now");
+    schedule.once_ms(delay_ms, connect_static, this);
 }
 
 void ESP8266MQTTMesh::connect() {
@@ -522,20 +1154,28 @@ void ESP8266MQTTMesh::connect() {
         return;
     }
     retry_connect = 1;
+    if (MESH_OFFLINE_REBOOT_MS && millis() - offline_start > MESH_OFFLINE_REBOOT_MS) {
+        dbgPrintln(EMMDBG_WIFI, "Could not get online for " + String(millis() - offline_start) + "ms, restarting");
+        die();
+    }
+    conn_state_set(MESH_STATE_SCANNING);
     if (scanning) {
         scan();
-        schedule_connect(0.5);
+        //A scan which found nothing is only repeated after a backoff
+        schedule_connect(scanning || ap_ptr ? MESH_SCAN_POLL_MS : backoff(&backoff_wifi));
         return;
     }
-    if (! ap_ptr) {
+    if (! ap_ptr && ! parent_cache_use()) {
         // No networks found, try again
         scan();
-        schedule_connect(5.0);
+        schedule_connect(MESH_SCAN_POLL_MS);
         return;
     }
-    int i = 0;
-    for (ap_t *p = ap; p != NULL; p = p->next, i++) {
-        dbgPrintln(EMMDBG_WIFI, String(i) + String(p == ap_ptr ? " * " : "   ") + mac_str(p->bssid) + " " + String(p->rssi));
+    for (int i = 0; i < ap_count; i++) {
+        ap_t *p = &aps[i];
+        if (p->seen) {
+            dbgPrintln(EMMDBG_WIFI, String(i) + String(p == ap_ptr ? " * " : "   ") + mac_str(p->bssid) + " " + String(p->rssi) + " " + String(p->cost));
+        }
     }
     char _mesh_ssid[32];
     const char *ssid;
@@ -545,13 +1185,19 @@ void ESP8266MQTTMesh::connect() {
         ssid = build_mesh_ssid(_mesh_ssid, ap_ptr->bssid);
         password = mesh_password;
         meshConnect = true;
+        if (! txq[0].buf) {
+            //A gateway never needs queues for its uplink
+            txq_alloc(0);
+        }
     } else {
         ssid = networks[ap_ptr->ssid_idx].ssid;
         password = networks[ap_ptr->ssid_idx].password;
         meshConnect = false;
     }
     dbgPrintln(EMMDBG_WIFI, "Connecting to SSID : '" + String(ssid) + "' BSSID '" + mac_str(ap_ptr->bssid) + "'");
-    WiFi.begin(ssid, password);
+    //Locked to the channel and BSSID found, so the association does not need a scan of its own
+    conn_state_set(MESH_STATE_ASSOCIATING);
+    WiFi.begin(ssid, password, ap_ptr->channel, ap_ptr->bssid);
     alreaddyDisconnected = false;
 }
 
@@ -561,14 +1207,17 @@ String ESP8266MQTTMesh::mac_str(uint8_t *bssid) {
     return String(mac);
 }
 const char *ESP8266MQTTMesh::build_mesh_ssid(char buf[32], uint8_t *mac) {
+    //buf is a pointer here, sizeof() can't give its size
+    const size_t len = 32;
     char chipid[8];
     sprintf(chipid, "_%02x%02x%02x", mac[3], mac[4], mac[5]);
-    strlcpy(buf, mesh_ssid, sizeof(buf)-7);
-    strlcat(buf, chipid, sizeof(buf));
+    strlcpy(buf, mesh_ssid, len - 7);
+    strlcat(buf, chipid, len);
     return buf;
 }
 
-void ESP8266MQTTMesh::parse_message(const char *topic, const char *msg) {
+void ESP8266MQTTMesh::parse_message(const char *topic, const char *msg, size_t len) {
+  //msg need not be NUL terminated, e.g. when it lies in the TCP segment it arrived in
   int inTopicLen = strlen(inTopic);
   if (strstr(topic, inTopic) != topic) {
       return;
@@ -577,7 +1226,7 @@ void ESP8266MQTTMesh::parse_message(const char *topic, const char *msg) {
   if (strstr(subtopic ,"ota/") == subtopic) {
 #if HAS_OTA
       const char *cmd = subtopic + 4;
-      handle_ota(cmd, msg);
+      handle_ota(cmd, msg, len);
 #endif
       return;
   }
@@ -588,18 +1237,32 @@ void ESP8266MQTTMesh::parse_message(const char *topic, const char *msg) {
   if (! callback) {
       return;
   }
+  subtopic = local_subtopic(topic);
+  if (subtopic) {
+      HandleMessages(subtopic, msg, len);
+  }
+}
+
+const char *ESP8266MQTTMesh::local_subtopic(const char *topic) {
+  //The topic the callback sees for a message from the broker, or NULL if the message is not for this node
+  int inTopicLen = strlen(inTopic);
+  if (strstr(topic, inTopic) != topic) {
+      return NULL;
+  }
+  const char *subtopic = topic + inTopicLen;
   int myIDLen = strlen(myID);
   if(strstr(subtopic, myID) == subtopic) {
       //Only handle messages addressed to this node
-      HandleMessages(subtopic + myIDLen, msg);
+      return subtopic + myIDLen;
   }
   else if(strstr(subtopic, "broadcast/") == subtopic) {
       //Or messages sent to all nodes
-      HandleMessages(subtopic + 10, msg);
+      return subtopic + 10;
   }
+  return NULL;
 }
 
-void ESP8266MQTTMesh::HandleMessages(const char *topic, const char *msg) {
+void ESP8266MQTTMesh::HandleMessages(const char *topic, const char *msg, size_t len) {
   if(strstr(topic,"Ping") == topic){
     dbgPrintln(EMMDBG_MSG, "answering Ping!");
     String topic = "Ping";
@@ -607,199 +1270,2023 @@ void ESP8266MQTTMesh::HandleMessages(const char *topic, const char *msg) {
   }else if(strstr(topic,"Restart") == topic){
     dbgPrintln(EMMDBG_MSG, "Got Restart Command, restarting now");
     die();
-  }else{
+  }else if (rx_terminated(msg, len)) {
     callback(topic, msg);
+  }else{
+    //The callback takes a C string, so a payload which is not terminated is copied
+    char *buf = rx_lease(len + 1);
+    if (! buf) {
+      dbgPrintf(EMMDBG_MSG, "No receive buffer to pass %s to the callback, dropping it", topic);
+      stats.rx_dropped++;
+      return;
+    }
+    memcpy(buf, msg, len);
+    buf[len] = '\0';
+    callback(topic, buf);
+    rx_release(buf);
   }
 }
 
 void ESP8266MQTTMesh::connect_mqtt() {
+    mqttTimer.detach();
     dbgPrintln(EMMDBG_MQTT, "Attempting MQTT connection (" + String(mqtt_server) + ":" + String(mqtt_port) + ")...");
     // Attempt to connect
     mqttClient.connect();
 }
 
 
-void ESP8266MQTTMesh::publish(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd) {
-    publish(outTopic, myID, subtopic, msg, msgCmd);
+static bool is_qos(uint8_t msgType) {
+    return msgType == MSG_TYPE_QOS_1 || msgType == MSG_TYPE_QOS_2
+        || msgType == MSG_TYPE_RETAIN_QOS_1 || msgType == MSG_TYPE_RETAIN_QOS_2;
 }
 
-void ESP8266MQTTMesh::publish_node(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd) {
-    publish(inTopic, myID, subtopic, msg, msgCmd);
+uint16_t ESP8266MQTTMesh::publish(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd, enum MSG_PRIO prio) {
+    return publish(outTopic, myID, subtopic, msg, msgCmd, prio);
 }
 
-void ESP8266MQTTMesh::publish(const char *topicDirection, const char *baseTopic, const char *subTopic, const char *msg, uint8_t msgType) {
-    char topic[64];
-    strlcpy(topic, topicDirection, sizeof(topic));
-    strlcat(topic, baseTopic, sizeof(topic));
-    strlcat(topic, subTopic, sizeof(topic));
-    dbgPrintln(EMMDBG_MQTT_EXTRA, "Sending: " + String(topic) + "=" + String(msg));
+uint16_t ESP8266MQTTMesh::publish_node(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd, enum MSG_PRIO prio) {
+    return publish(inTopic, myID, subtopic, msg, msgCmd, prio);
+}
+
+void ESP8266MQTTMesh::sendToNode(const char *id, const char *subtopic, const char *msg) {
+    char topic[TOPIC_LEN];
+    strlcpy(topic, inTopic, sizeof(topic));
+    strlcat(topic, id, sizeof(topic));
+    if (id[0] && id[strlen(id)-1] != '/') {
+        strlcat(topic, "/", sizeof(topic));
+    }
+    strlcat(topic, subtopic, sizeof(topic));
+    dbgPrintf(EMMDBG_MQTT_EXTRA, "Sending to node: %s=%s", topic, msg);
+    route_peer(-1, topic, msg, strlen(msg));
+}
+
+uint16_t ESP8266MQTTMesh::publish(const char *topicDirection, const char *baseTopic, const char *subTopic, const char *msg, uint8_t msgType, uint8_t prio) {
+    char topic[64];
+    strlcpy(topic, topicDirection, sizeof(topic));
+    strlcat(topic, baseTopic, sizeof(topic));
+    strlcat(topic, subTopic, sizeof(topic));
+    dbgPrintf(EMMDBG_MQTT_EXTRA, "Sending: %s=%s", topic, msg);
+    //topicDirection + baseTopic is the part which repeats from message to message
+    size_t prefix_len = baseTopic[0] ? strlen(topicDirection) + strlen(baseTopic) : 0;
+    //Messages too large for any receive buffer go out in fragments right away, the offline store could not replay them
+    bool large = MESH_HDR_MAX + strlen(topic) + strlen(msg) >= MQTT_MAX_PACKET_SIZE;
+    if (store_fs && ! large && (store_backlog() || ! (meshConnect ? p2pConnected : mqttClient.connected()))) {
+        //Logged behind anything stored earlier, so messages reach the broker in order.  A QoS message gets its ID now,
+        //and the delivery callback reports it once the message has been replayed and acknowledged
+        uint16_t id = is_qos(msgType) ? qos_new_id() : 0;
+        return store_append(topic, msg, msgType, prefix_len, prio, id) ? id : 0;
+    }
+    return publish_now(topic, msg, msgType, prefix_len, prio);
+}
+
+uint16_t ESP8266MQTTMesh::publish_now(const char *topic, const char *msg, uint8_t msgType, size_t prefix_len, uint8_t prio, uint16_t id) {
+    size_t msg_len = strlen(msg);
+    if (meshConnect && MESH_HDR_MAX + strlen(topic) + msg_len > MESH_FRAME_MAX) {
+        //Too large for a single frame.  Fragments are not tracked by the QoS store
+        frag_send(topic, msg, msg_len, msgType, prefix_len, prio);
+        return 0;
+    }
+    if (is_qos(msgType)) {
+        //Kept until the broker has acknowledged it, the ID is reported to the delivery callback
+        if (! id) {
+            id = qos_new_id();
+        }
+        if (qos_add(-1, id, msgType, topic, msg, strlen(msg), prefix_len, 0, prio)) {
+            return id;
+        }
+        dbgPrintf(EMMDBG_MQTT, "QoS store is full, sending %s without tracking it", topic);
+    }
     if (! meshConnect) {
-        mqtt_publish(topic, msg, msgType);
+        broker_send(topic, msg, strlen(msg), msgType);
+    } else {
+        send_frame(0, msgType, topic, strlen(topic), msg, strlen(msg), prefix_len, 0, 0, prio);
+    }
+    return 0;
+}
+
+static const char *store_name(int seg) {
+    return seg ? "/mesh_store1" : "/mesh_store0";
+}
+
+static const char *store_old_name(int seg) {
+    //Logs written before records kept their priority and ID
+    return seg ? "/mesh_log1" : "/mesh_log0";
+}
+
+void ESP8266MQTTMesh::store_init() {
+    //Pick up messages logged before a reboot
+    uint32_t gen[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        if (store_fs->exists(store_old_name(i))) {
+            dbgPrintf(EMMDBG_FS, "Discarding %s, which was written by an older version", store_old_name(i));
+            store_fs->remove(store_old_name(i));
+        }
+        if (! store_fs->exists(store_name(i))) {
+            continue;
+        }
+        File f = store_fs->open(store_name(i), "r");
+        if (f && f.read((uint8_t *)&gen[i], sizeof(gen[i])) == sizeof(gen[i])) {
+            store_len[i] = f.size();
+        }
+        f.close();
+        if (! store_len[i]) {
+            store_fs->remove(store_name(i));
+        }
+    }
+    store_wr = store_len[1] && (! store_len[0] || (int32_t)(gen[1] - gen[0]) > 0) ? 1 : 0;
+    store_rd = store_len[store_wr ^ 1] ? store_wr ^ 1 : store_wr;
+    store_rd_pos = sizeof(uint32_t);
+    store_gen = gen[store_wr];
+    store_batch = new uint8_t[MESH_STORE_BATCH];
+    if (store_backlog()) {
+        dbgPrintf(EMMDBG_FS, "Offline store holds %u bytes from before the restart", (unsigned)(store_len[0] + store_len[1]));
+    }
+}
+
+bool ESP8266MQTTMesh::store_append(const char *topic, const char *msg, uint8_t msgType, size_t prefix_len, uint8_t prio, uint16_t id) {
+    mesh_store_rec_t rec;
+    size_t topic_len = strlen(topic);
+    size_t msg_len = strlen(msg);
+    size_t size = sizeof(rec) + topic_len + msg_len;
+    if (! store_batch || topic_len >= TOPIC_LEN || size >= rx_pool_size) {
+        //Messages must fit in a receive buffer to be replayed
+        dbgPrintf(EMMDBG_FS, "Message is too large for the offline store: %s", topic);
+        stats.store_dropped++;
+        return false;
+    }
+    rec.payload_len = msg_len;
+    rec.msgType = msgType;
+    rec.topic_len = topic_len;
+    rec.prefix_len = prefix_len;
+    rec.prio = prio;
+    rec.id = id;
+    if (store_batch_used + size > MESH_STORE_BATCH) {
+        store_flush();
+    }
+    if (size > MESH_STORE_BATCH) {
+        //Too large to batch, write it as it is
+        int seg = store_segment(size);
+        if (seg < 0 || ! store_write((const uint8_t *)&rec, sizeof(rec))
+            || ! store_write((const uint8_t *)topic, topic_len) || ! store_write((const uint8_t *)msg, msg_len)) {
+            stats.store_dropped++;
+            return false;
+        }
+        store_count[seg]++;
+        return true;
+    }
+    memcpy(store_batch + store_batch_used, &rec, sizeof(rec));
+    memcpy(store_batch + store_batch_used + sizeof(rec), topic, topic_len);
+    memcpy(store_batch + store_batch_used + sizeof(rec) + topic_len, msg, msg_len);
+    store_batch_used += size;
+    store_batch_count++;
+    if (! storeFlushScheduled) {
+        storeFlushScheduled = true;
+        storeTimer.once_ms(MESH_STORE_FLUSH_MS, store_flush_static, this);
+    }
+    return true;
+}
+
+int ESP8266MQTTMesh::store_segment(size_t len) {
+    //Returns the segment 'len' more bytes are written to, starting the other segment when the current one
+    //is full.  Returns -1 if the bytes must be dropped
+    uint32_t seg_size = store_size / 2;
+    if (len + sizeof(uint32_t) > seg_size) {
+        return -1;
+    }
+    if (store_len[store_wr] + len <= seg_size) {
+        return store_wr;
+    }
+    int other = store_wr ^ 1;
+    if (store_len[other]) {
+        //The other segment still holds the oldest messages
+        if (store_policy == MESH_STORE_DROP_NEWEST) {
+            return -1;
+        }
+        dbgPrintf(EMMDBG_FS, "Offline store is full, dropping %u old messages", store_count[other]);
+        stats.store_dropped += store_count[other];
+        store_remove(other);
+    }
+    store_wr = other;
+    return store_wr;
+}
+
+bool ESP8266MQTTMesh::store_write(const uint8_t *data, size_t len) {
+    //A record which was only partly written ends the segment for the replay, which reports it as damaged
+    File f = store_fs->open(store_name(store_wr), "a");
+    if (! f) {
+        dbgPrintf(EMMDBG_FS, "Could not open %s", store_name(store_wr));
+        stats.store_errors++;
+        return false;
+    }
+    if (! store_len[store_wr]) {
+        store_gen++;
+        if (f.write((const uint8_t *)&store_gen, sizeof(store_gen)) != sizeof(store_gen)) {
+            dbgPrintf(EMMDBG_FS, "Could not write to %s", store_name(store_wr));
+            stats.store_errors++;
+            f.close();
+            store_fs->remove(store_name(store_wr));
+            return false;
+        }
+        store_len[store_wr] = sizeof(store_gen);
+    }
+    size_t written = f.write(data, len);
+    store_len[store_wr] += written;
+    f.close();
+    if (written != len) {
+        dbgPrintf(EMMDBG_FS, "Wrote only %u of %u bytes to %s", (unsigned)written, (unsigned)len, store_name(store_wr));
+        stats.store_errors++;
+        return false;
+    }
+    return true;
+}
+
+void ESP8266MQTTMesh::store_flush() {
+    if (! store_batch_used) {
+        return;
+    }
+    int seg = store_segment(store_batch_used);
+    if (seg < 0 || ! store_write(store_batch, store_batch_used)) {
+        stats.store_dropped += store_batch_count;
+    } else {
+        store_count[seg] += store_batch_count;
+    }
+    store_batch_used = 0;
+    store_batch_count = 0;
+}
+
+void ESP8266MQTTMesh::store_remove(int seg) {
+    store_fs->remove(store_name(seg));
+    store_len[seg] = 0;
+    store_count[seg] = 0;
+    if (store_rd == seg) {
+        store_rd = seg ^ 1;
+        store_rd_pos = sizeof(uint32_t);
+    }
+}
+
+void ESP8266MQTTMesh::store_schedule_replay() {
+    if (store_fs && store_backlog() && ! storeReplayScheduled) {
+        storeReplayScheduled = true;
+        replayTimer.once_ms(MESH_STORE_REPLAY_MS, store_replay_static, this);
+    }
+}
+
+void ESP8266MQTTMesh::store_replay() {
+    if (! (meshConnect ? p2pConnected : mqttClient.connected())) {
+        //Resumes once connected again
+        return;
+    }
+    char *buf = rx_lease();
+    //Don't outrun the uplink
+    for (int n = 0; buf && n < MESH_STORE_REPLAY_BATCH && store_backlog() && ! (meshConnect ? txq[0].congested : brokerq.used); ) {
+        if (! store_len[store_rd] || store_rd_pos >= store_len[store_rd]) {
+            //Everything in this segment was sent
+            if (store_len[store_rd]) {
+                store_remove(store_rd);
+            } else if (store_len[store_rd ^ 1]) {
+                store_rd ^= 1;
+                store_rd_pos = sizeof(uint32_t);
+            } else {
+                store_flush();
+                store_rd = store_wr;
+            }
+            continue;
+        }
+        mesh_store_rec_t rec;
+        char topic[TOPIC_LEN];
+        File f = store_fs->open(store_name(store_rd), "r");
+        bool ok = f && f.seek(store_rd_pos)
+            && f.read((uint8_t *)&rec, sizeof(rec)) == sizeof(rec)
+            && rec.topic_len < TOPIC_LEN
+            && sizeof(rec) + rec.topic_len + rec.payload_len < rx_pool_size
+            && f.read((uint8_t *)topic, rec.topic_len) == rec.topic_len
+            && f.read((uint8_t *)buf, rec.payload_len) == rec.payload_len;
+        f.close();
+        if (! ok) {
+            dbgPrintf(EMMDBG_FS, "Offline store %s is damaged, discarding the rest of it", store_name(store_rd));
+            store_rd_pos = store_len[store_rd];
+            continue;
+        }
+        topic[rec.topic_len] = '\0';
+        buf[rec.payload_len] = '\0';
+        store_rd_pos += sizeof(rec) + rec.topic_len + rec.payload_len;
+        publish_now(topic, buf, rec.msgType, rec.prefix_len, rec.prio, rec.id);
+        n++;
+    }
+    rx_release(buf);
+    store_schedule_replay();
+}
+
+void ESP8266MQTTMesh::shutdown_AP() {
+    if(! AP_ready)
+        return;
+    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+        if(espClient[i]) {
+            delete espClient[i];
+            espClient[i] = NULL;
+        }
+        txq_free(i);
+        //A frame cut off half way would otherwise keep its receive buffer leased
+        rx_reset(i);
+        route_drop_link(i);
+        qos_orphan(i);
+    }
+    //Nothing is behind this node any more
+    routeWildcard = false;
+    ap_subnet = 0;
+    WiFi.softAPdisconnect(true);
+    WiFi.mode(WIFI_STA);
+    AP_ready = false;
+}
+
+void ESP8266MQTTMesh::setup_AP() {
+    if (AP_ready)
+        return;
+    
+    uint octet2 = WiFi.gatewayIP()[1] + 1;
+    if (octet2==255) {
+        octet2++;
+    }
+    if (octet2==0) {
+        octet2++;
+    }
+    IPAddress apIP(WiFi.gatewayIP()[0],
+                   octet2,
+                   1,
+                   1);
+    ap_subnet = octet2;
+    IPAddress apGateway(apIP);
+    IPAddress apSubmask(255, 255, 255, 0);
+    WiFi.mode(WIFI_AP_STA);
+    WiFi.softAPConfig(apIP, apGateway, apSubmask);
+    char _mesh_ssid[32];
+    uint8_t mac[6];
+    build_mesh_ssid(_mesh_ssid, WiFi.softAPmacAddress(mac));
+    WiFi.softAP(_mesh_ssid, mesh_password, WiFi.channel(), 1);
+    dbgPrintln(EMMDBG_WIFI, "Initialized AP as '" + String(_mesh_ssid) + "'  IP '" + apIP.toString() + "'");
+    AP_ready = true;
+    advertise();
+}
+
+void ESP8266MQTTMesh::send_connected_msg() {
+    //The list of nodes is only stored on the broker.  Individual nodes don't knowother node IDs
+    /*char topic[10];
+    strlcpy(topic, myID, sizeof(topic));
+    topic[strlen(topic)-1] = 0; // Chop off trailing '/'
+    publish(outTopic, "bssid/", topic, WiFi.softAPmacAddress().c_str(), MSG_TYPE_RETAIN_QOS_0);*/
+    if(wasConnected){
+        publish("info/reset_Reason", String("lost_Connection").c_str(), MSG_TYPE_RETAIN_QOS_0);
+    }else{
+#ifdef ESP32
+        publish("info/reset_Reason", String(esp_reset_reason()).c_str(), MSG_TYPE_RETAIN_QOS_0);
+#else
+        publish("info/reset_Reason", String(ESP.getResetReason()).c_str(), MSG_TYPE_RETAIN_QOS_0);
+#endif
+    }
+    
+    publish("info/MAC", String(WiFi.macAddress()).c_str(), MSG_TYPE_RETAIN_QOS_0);
+    publish("info/MAC_hosted_AP", String(WiFi.softAPmacAddress()).c_str(), MSG_TYPE_RETAIN_QOS_0);
+    publish("info/IP_local", WiFi.localIP().toString().c_str(), MSG_TYPE_RETAIN_QOS_0);
+    
+    if(ap_ptr == NULL){
+        Serial.println("Warning: ap_ptr is NULL");
+    }else{
+        publish("info/RSSI", String(ap_ptr->rssi).c_str(), MSG_TYPE_RETAIN_QOS_0);
+        publish("info/connectedTo", String(mac_str(ap_ptr->bssid)).c_str(), MSG_TYPE_RETAIN_QOS_0);
+    }
+    publish("info/available", "online", MSG_TYPE_RETAIN_QOS_0);
+}
+
+
+void ESP8266MQTTMesh::init_hdr(mesh_hdr_t *hdr, uint8_t msgType, size_t topic_len, size_t msg_len) {
+    hdr->ver = MESH_FRAME_VER;
+    hdr->hdr_len = sizeof(mesh_hdr_t);
+    hdr->msgType = msgType;
+    hdr->flags = 0;
+    hdr->topic_len = topic_len;
+    hdr->payload_len = msg_len;
+}
+
+static size_t opt_size(uint8_t flag) {
+    switch(flag) {
+        case MESH_FLAG_ALIAS: return sizeof(mesh_alias_t);
+        case MESH_FLAG_COMPRESSED: return sizeof(uint16_t);
+        case MESH_FLAG_MSGID: return sizeof(uint16_t);
+        case MESH_FLAG_ORIGIN: return sizeof(mesh_origin_t);
+        case MESH_FLAG_FRAG: return sizeof(mesh_frag_t);
+    }
+    return 0;
+}
+
+static uint8_t *add_opt(mesh_hdr_t *hdr, uint8_t flag, size_t len) {
+    //hdr must point to a MESH_HDR_MAX buffer, and options must be added in flag order
+    uint8_t *opt = (uint8_t *)hdr + hdr->hdr_len;
+    hdr->flags |= flag;
+    hdr->hdr_len += len;
+    return opt;
+}
+
+static const uint8_t *find_opt(const mesh_hdr_t *hdr, uint8_t flag) {
+    if (! (hdr->flags & flag)) {
+        return NULL;
+    }
+    size_t offset = sizeof(mesh_hdr_t);
+    for (uint8_t bit = 0x01; bit != flag; bit <<= 1) {
+        if (hdr->flags & bit) {
+            size_t len = opt_size(bit);
+            if (! len) {
+                //Can't tell where the requested field starts
+                return NULL;
+            }
+            offset += len;
+        }
+    }
+    if (offset + opt_size(flag) > hdr->hdr_len) {
+        return NULL;
+    }
+    return (const uint8_t *)hdr + offset;
+}
+
+static uint16_t opt_u16(const mesh_hdr_t *hdr, uint8_t flag) {
+    //Value of a uint16_t option, 0 if the frame does not carry it
+    uint16_t val = 0;
+    const uint8_t *opt = find_opt(hdr, flag);
+    if (opt) {
+        memcpy(&val, opt, sizeof(val));
+    }
+    return val;
+}
+
+static const char *parse_node_id(const char *str, uint32_t *id) {
+    //Reads a hex node ID terminated by '/'. Returns the text following it, or NULL if str does not start with an ID
+    uint32_t val = 0;
+    int i;
+    for (i = 0; i < 9 && str[i] != '/'; i++) {
+        char c = str[i];
+        if (c >= '0' && c <= '9') {
+            val = (val << 4) | (c - '0');
+        } else if (c >= 'A' && c <= 'F') {
+            val = (val << 4) | (c - 'A' + 10);
+        } else if (c >= 'a' && c <= 'f') {
+            val = (val << 4) | (c - 'a' + 10);
+        } else {
+            return NULL;
+        }
+    }
+    if (i == 0 || i > 8 || str[i] != '/') {
+        return NULL;
+    }
+    *id = val;
+    return str + i + 1;
+}
+
+static size_t node_prefix_len(const char *topic) {
+    //The prefix of a topic relayed for another node is its direction and node ID, e.g. 'esp8266-out/00A1B2/'
+    const char *slash = strchr(topic, '/');
+    if (slash) {
+        slash = strchr(slash + 1, '/');
+    }
+    return slash ? slash - topic + 1 : 0;
+}
+
+bool ESP8266MQTTMesh::txq_alloc(int idx) {
+    //The bulk ring is left out, see txq_bulk_alloc()
+    mesh_txq_t *q = &txq[idx];
+    txq_free(idx);
+    q->buf = new uint8_t[MESH_TX_CONTROL_SIZE + MESH_TX_QUEUE_SIZE];
+    if (! q->buf) {
+        return false;
+    }
+    q->ring[MSG_PRIO_CONTROL].buf = q->buf;
+    q->ring[MSG_PRIO_CONTROL].size = MESH_TX_CONTROL_SIZE;
+    q->ring[MSG_PRIO_TELEMETRY].buf = q->buf + MESH_TX_CONTROL_SIZE;
+    q->ring[MSG_PRIO_TELEMETRY].size = MESH_TX_QUEUE_SIZE;
+    return true;
+}
+
+void ESP8266MQTTMesh::txq_free(int idx) {
+    delete [] txq[idx].ring[MSG_PRIO_BULK].buf;
+    delete [] txq[idx].buf;
+    memset(&txq[idx], 0, sizeof(mesh_txq_t));
+}
+
+static bool txq_bulk_alloc(mesh_txq_t *q) {
+    //Most links never carry bulk traffic, so its ring is only held while bulk frames are waiting.  Without it they
+    //wait in the telemetry ring
+    mesh_ring_t *r = &q->ring[MSG_PRIO_BULK];
+    if (! r->buf && q->buf) {
+        r->buf = new uint8_t[MESH_TX_BULK_SIZE];
+        r->size = r->buf ? MESH_TX_BULK_SIZE : 0;
+    }
+    return r->buf != NULL;
+}
+
+static void ring_write(mesh_ring_t *r, const void *data, size_t len) {
+    if (! len) {
+        return;
+    }
+    size_t first = r->size - r->head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(r->buf + r->head, data, first);
+    memcpy(r->buf, (const uint8_t *)data + first, len - first);
+    r->head = (r->head + len) % r->size;
+    r->used += len;
+    r->queued += len;
+}
+
+static void ring_peek(const mesh_ring_t *r, void *data, size_t len) {
+    size_t first = r->size - r->tail;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(data, r->buf + r->tail, first);
+    memcpy((uint8_t *)data + first, r->buf, len - first);
+}
+
+static uint8_t frame_prio(const mesh_hdr_t *hdr) {
+    uint8_t bits = (hdr->flags & MESH_FLAG_PRIO_MASK) >> 6;
+    return bits ? bits - 1 : MSG_PRIO_AUTO;
+}
+
+static size_t credit_cost(const mesh_hdr_t *hdr, size_t alias_len) {
+    //Credit is counted in what the frame may take up once the parent has expanded its topic alias and payload and
+    //added every optional field, not in what it takes on the wire.  Both ends count it this way
+    uint16_t raw_len = opt_u16(hdr, MESH_FLAG_COMPRESSED);
+    return MESH_HDR_MAX + alias_len + hdr->topic_len + (raw_len ? raw_len : hdr->payload_len);
+}
+
+bool ESP8266MQTTMesh::txq_start_frame(mesh_txq_t *q) {
+    //Control frames go first.  Bulk frames get a turn after MESH_TX_TELEMETRY_WEIGHT telemetry frames so
+    //that a firmware transfer still makes progress while sensors are busy
+    mesh_ring_t *ring = q->ring;
+    int cls;
+    if (q == &txq[0] && ! uplinkHello && millis() - uplink_since < MESH_HELLO_WAIT_MS) {
+        //Until the parent's HELLO tells whether it grants credit.  One which never sends it is an older node which doesn't
+        if (! txFlushScheduled) {
+            txFlushScheduled = true;
+            txTimer.once_ms(MESH_HELLO_WAIT_MS - (millis() - uplink_since), flush_uplink_static, this);
+        }
+        return false;
+    }
+    if (ring[MSG_PRIO_CONTROL].used) {
+        cls = MSG_PRIO_CONTROL;
+    } else if (ring[MSG_PRIO_BULK].used && q->spill[MSG_PRIO_BULK]) {
+        //The bulk frames queued before one which had to wait in the telemetry queue go ahead of it
+        cls = MSG_PRIO_BULK;
+    } else if (ring[MSG_PRIO_TELEMETRY].used && (! ring[MSG_PRIO_BULK].used || q->run < MESH_TX_TELEMETRY_WEIGHT)) {
+        cls = MSG_PRIO_TELEMETRY;
+    } else if (ring[MSG_PRIO_BULK].used) {
+        cls = MSG_PRIO_BULK;
+    } else {
+        return false;
+    }
+    uint8_t buf[MESH_HDR_MAX];
+    mesh_hdr_t *hdr = (mesh_hdr_t *)buf;
+    mesh_ring_t *r = &ring[cls];
+    ring_peek(r, buf, sizeof(mesh_hdr_t));
+    ring_peek(r, buf, hdr->hdr_len);
+    size_t len = hdr->hdr_len + hdr->topic_len + hdr->payload_len;
+    const mesh_alias_t *alias = (const mesh_alias_t *)find_opt(hdr, MESH_FLAG_ALIAS);
+    if (q == &txq[0] && (uplink_caps & MESH_CAP_CREDIT)) {
+        //The parent has only promised room for what it granted
+        size_t cost = credit_cost(hdr, alias && ! alias->define_len ? tx_alias[alias->id].len : 0);
+        if (cost > uplink_credit) {
+            credit_request(cost);
+            return false;
+        }
+        uplink_credit -= cost;
+    }
+    if (cls == MSG_PRIO_TELEMETRY) {
+        q->run = ring[MSG_PRIO_BULK].used ? q->run + 1 : 0;
+    } else if (cls == MSG_PRIO_BULK) {
+        q->run = 0;
+    }
+    q->cur = cls;
+    q->frame_left = len;
+    r->frames--;
+    if (q == &txq[0] && alias && tx_alias[alias->id].refs) {
+        tx_alias[alias->id].refs--;
+    }
+    return true;
+}
+
+void ESP8266MQTTMesh::txq_consume(mesh_txq_t *q, size_t len) {
+    //Advance past 'len' sent bytes of the current frame
+    mesh_ring_t *r = &q->ring[q->cur];
+    r->tail = (r->tail + len) % r->size;
+    r->used -= len;
+    r->sent += len;
+    q->frame_left -= len;
+    if (q->cur == MSG_PRIO_BULK && ! r->used) {
+        //Allocated again by the next bulk frame
+        delete [] r->buf;
+        r->buf = NULL;
+        r->size = 0;
+        r->head = r->tail = 0;
+    } else if (q->cur == MSG_PRIO_TELEMETRY) {
+        for (int cls = 0; cls < MSG_PRIO_COUNT; cls++) {
+            q->spill[cls] = q->spill[cls] > len ? q->spill[cls] - len : 0;
+        }
+    }
+}
+
+void ESP8266MQTTMesh::txq_drop_partial(int idx) {
+    //The start of this frame went out on a connection which no longer exists.  The rest is useless on a new one
+    mesh_txq_t *q = &txq[idx];
+    if (q->frame_left) {
+        dbgPrintf(EMMDBG_WIFI, "Dropping partially sent frame on link %d", idx);
+        txq_consume(q, q->frame_left);
+        stats.tx_dropped++;
+        check_watermark(idx);
+    }
+}
+
+void ESP8266MQTTMesh::check_watermark(int idx) {
+    mesh_txq_t *q = &txq[idx];
+    size_t used = q->ring[MSG_PRIO_TELEMETRY].used;
+    if (idx == 0 && frag_tx.total) {
+        //The rest of a large message waits here just the same, and the next one would be dropped
+        used += frag_tx.total - frag_tx.offset;
+    }
+    if (! q->congested && used >= MESH_TX_HIGH_WATER) {
+        q->congested = true;
+        dbgPrintf(EMMDBG_WIFI, "TX queue for link %d is congested", idx);
+        if (txWatermarkCallback) {
+            txWatermarkCallback(idx, true);
+        }
+    } else if (q->congested && used <= MESH_TX_LOW_WATER) {
+        q->congested = false;
+        dbgPrintf(EMMDBG_WIFI, "TX queue for link %d has drained", idx);
+        if (txWatermarkCallback) {
+            txWatermarkCallback(idx, false);
+        }
+    }
+}
+
+void ESP8266MQTTMesh::flush_tx(int idx) {
+    AsyncClient *c = espClient[idx];
+    mesh_txq_t *q = &txq[idx];
+    if (! c || ! q->buf || ! c->connected()) {
+        return;
+    }
+    if (idx == 0 && ! q->frame_left && ! send_aliases()) {
+        //The queued frames may use the aliases still waiting
+        return;
+    }
+    size_t sent = 0;
+    //The class is picked again at every frame boundary, so nothing waits behind more than the frame in progress
+    while (c->canSend() && c->space() && (q->frame_left || txq_start_frame(q))) {
+        //Only hand over what fits in the TCP window.  The rest goes out from onAck()
+        mesh_ring_t *r = &q->ring[q->cur];
+        size_t len = q->frame_left;
+        if (r->tail + len > r->size) {
+            len = r->size - r->tail;
+        }
+        if (len > c->space()) {
+            len = c->space();
+        }
+        len = c->add((const char *)r->buf + r->tail, len);
+        if (! len) {
+            break;
+        }
+        txq_consume(q, len);
+        sent += len;
+    }
+    if (sent) {
+        c->send();
+        check_watermark(idx);
+        if (idx == 0) {
+            //Room was made for our children and for the rest of a large message
+            credit_service();
+            frag_feed();
+        }
+    }
+}
+
+void ESP8266MQTTMesh::flush_all() {
+    for (int idx = 0; idx <= ESP8266_NUM_CLIENTS; idx++) {
+        if (idx == 0 && txFlushScheduled) {
+            //Still inside the coalescing window
+            continue;
+        }
+        flush_tx(idx);
+    }
+}
+
+int ESP8266MQTTMesh::client_index(AsyncClient *c) {
+    for (int idx = 0; idx <= ESP8266_NUM_CLIENTS; idx++) {
+        if (espClient[idx] == c) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+bool ESP8266MQTTMesh::write_frame(int index, const mesh_hdr_t *hdr, const char *topic, const char *msg) {
+    //The frame is copied into the link's preallocated queue for its class, nothing is assembled on the heap
+    mesh_txq_t *q = &txq[index];
+    size_t len = hdr->hdr_len + hdr->topic_len + hdr->payload_len;
+    uint8_t cls = frame_prio(hdr);
+    uint8_t spill = MSG_PRIO_COUNT;
+    if (cls >= MSG_PRIO_COUNT) {
+        cls = MSG_PRIO_TELEMETRY;
+    } else if (cls == MSG_PRIO_BULK && ! q->spill[cls]) {
+        txq_bulk_alloc(q);
+    }
+    if (cls != MSG_PRIO_TELEMETRY && (q->spill[cls] || q->ring[cls].used + len > q->ring[cls].size)) {
+        //Large commands and a full bulk queue wait in the telemetry queue, so a child's frame always finds the room its
+        //credit promised.  Frames of their class queued after them follow them there, so that they arrive in order
+        spill = cls;
+        cls = MSG_PRIO_TELEMETRY;
+    }
+    mesh_ring_t *r = &q->ring[cls];
+    size_t room = q->buf ? r->size - r->used : 0;
+    if (index == 0 && cls == MSG_PRIO_TELEMETRY && ! txRelay) {
+        //What our children were granted is kept for their frames
+        size_t granted = credit_granted();
+        room = room > granted ? room - granted : 0;
+    }
+    if (len > room) {
+        dbgPrintf(EMMDBG_WIFI, "Dropping message because the TX queue for link %d is full: %.*s", index, (int)hdr->topic_len, topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    ring_write(r, hdr, hdr->hdr_len);
+    ring_write(r, topic, hdr->topic_len);
+    ring_write(r, msg, hdr->payload_len);
+    r->frames++;
+    q->last_cls = cls;
+    if (spill < MSG_PRIO_COUNT) {
+        q->spill[spill] = r->used;
+    }
+    stats.tx_frames++;
+    stats.tx_bytes += len;
+    uint32_t heap = ESP.getFreeHeap();
+    if (heap < stats.heap_min) {
+        stats.heap_min = heap;
+    }
+    dbgPrintf(EMMDBG_WIFI_EXTRA, "Queued %u byte frame in class %d on link %d: %.*s", (unsigned)len, cls, index, (int)hdr->topic_len, topic);
+    check_watermark(index);
+    if (index == 0 && coalesce_ms && cls != MSG_PRIO_CONTROL && r->used < coalesce_bytes) {
+        //Hold upstream frames for up to coalesce_ms so that they leave in a single segment
+        if (! txFlushScheduled) {
+            txFlushScheduled = true;
+            txTimer.once_ms(coalesce_ms, flush_uplink_static, this);
+        }
+        return true;
+    }
+    if (index == 0 && txFlushScheduled) {
+        txTimer.detach();
+        txFlushScheduled = false;
+    }
+    if (! txHold) {
+        flush_tx(index);
+    }
+    return true;
+}
+
+bool ESP8266MQTTMesh::send_frame(int index, uint8_t msgType, const char *topic, size_t topic_len, const char *msg, size_t msg_len, size_t prefix_len, size_t raw_len, uint16_t msg_id, uint8_t prio, const mesh_origin_t *origin, const mesh_frag_t *frag) {
+    uint8_t buf[MESH_HDR_MAX];
+    mesh_hdr_t *hdr = (mesh_hdr_t *)buf;
+    if (topic_len == 0 || topic_len >= TOPIC_LEN || MESH_HDR_MAX + topic_len + (raw_len ? raw_len : msg_len) > MESH_FRAME_MAX) {
+        dbgPrintf(EMMDBG_MSG, "Dropping message which does not fit in a frame: %.*s", (int)topic_len, topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    if (raw_len && (index != 0 || ! (uplink_caps & MESH_CAP_COMPRESS))) {
+        //msg is compressed, but the next hop can't take it that way
+        int len = zbuf ? mesh_lz_decompress(zbuf, MQTT_MAX_PACKET_SIZE - 1, (const uint8_t *)msg, msg_len) : -1;
+        if (len < 0 || (size_t)len != raw_len) {
+            dbgPrintf(EMMDBG_MSG, "Dropping message with corrupt payload: %.*s", (int)topic_len, topic);
+            stats.tx_dropped++;
+            return false;
+        }
+        msg = (const char *)zbuf;
+        msg_len = len;
+        raw_len = 0;
+    } else if (! raw_len && index == 0 && zbuf && (uplink_caps & MESH_CAP_COMPRESS)
+               && ! MESH_IS_CONTROL(msgType) && msg_len >= 32) {
+        //Only worth it if at least a few bytes are saved
+        size_t len = mesh_lz_compress(zbuf, msg_len - 4, (const uint8_t *)msg, msg_len);
+        if (len) {
+            stats.tx_zsaved += msg_len - len;
+            raw_len = msg_len;
+            msg = (const char *)zbuf;
+            msg_len = len;
+        }
+    }
+    if (prio >= MSG_PRIO_COUNT) {
+        prio = topic_prio(msgType, topic, topic_len);
+    }
+    init_hdr(hdr, msgType, topic_len, msg_len);
+    const char *wire_topic = topic;
+    mesh_alias_entry_t *entry = NULL;
+    //Frames of other classes may overtake the one defining an alias, so only telemetry uses them
+    if (index == 0 && prio == MSG_PRIO_TELEMETRY && prefix_len > sizeof(mesh_alias_t) + 2 && prefix_len < MESH_ALIAS_LEN && prefix_len < topic_len) {
+        mesh_alias_t *alias = (mesh_alias_t *)add_opt(hdr, MESH_FLAG_ALIAS, sizeof(mesh_alias_t));
+        for (int i = 0; i < MESH_ALIAS_COUNT; i++) {
+            if (tx_alias[i].len == prefix_len && memcmp(tx_alias[i].prefix, topic, prefix_len) == 0) {
+                entry = &tx_alias[i];
+                alias->id = i;
+                alias->define_len = 0;
+                wire_topic += prefix_len;
+                hdr->topic_len -= prefix_len;
+                break;
+            }
+        }
+        for (int i = 0; i < MESH_ALIAS_COUNT && ! entry; i++) {
+            //Only replace an alias once no queued frame refers to it any more
+            int id = (tx_alias_next + i) % MESH_ALIAS_COUNT;
+            if (! tx_alias[id].refs) {
+                entry = &tx_alias[id];
+                tx_alias_next = (id + 1) % MESH_ALIAS_COUNT;
+                memcpy(entry->prefix, topic, prefix_len);
+                entry->len = prefix_len;
+                alias->id = id;
+                alias->define_len = prefix_len;
+            }
+        }
+        if (! entry) {
+            //Every alias is still in use, send the full topic
+            init_hdr(hdr, msgType, topic_len, msg_len);
+        }
+    }
+    if (raw_len) {
+        uint16_t len = raw_len;
+        memcpy(add_opt(hdr, MESH_FLAG_COMPRESSED, sizeof(len)), &len, sizeof(len));
+    }
+    if (msg_id) {
+        memcpy(add_opt(hdr, MESH_FLAG_MSGID, sizeof(msg_id)), &msg_id, sizeof(msg_id));
+    }
+    if (! MESH_IS_CONTROL(msgType) || msgType == MESH_FRAME_PEER) {
+        //Messages which start here get a new origin, relayed ones keep theirs
+        mesh_origin_t own;
+        if (! origin) {
+            origin_new(&own);
+            origin = &own;
+        }
+        memcpy(add_opt(hdr, MESH_FLAG_ORIGIN, sizeof(mesh_origin_t)), origin, sizeof(mesh_origin_t));
+    }
+    if (frag) {
+        memcpy(add_opt(hdr, MESH_FLAG_FRAG, sizeof(mesh_frag_t)), frag, sizeof(mesh_frag_t));
+    }
+    hdr->flags |= MESH_FLAG_PRIO(prio);
+    if (entry) {
+        entry->refs++;
+    }
+    if (! write_frame(index, hdr, wire_topic, msg)) {
+        if (entry) {
+            entry->refs--;
+            if (! entry->refs && hdr->topic_len == topic_len) {
+                //The definition never made it into the queue
+                entry->len = 0;
+            }
+        }
+        return false;
+    }
+    return true;
+}
+
+bool ESP8266MQTTMesh::send_message(int index, const char *topic, const char *msg, uint8_t msgType, size_t prefix_len) {
+    return send_frame(index, msgType, topic, strlen(topic), msg, msg ? strlen(msg) : 0, prefix_len);
+}
+
+uint8_t ESP8266MQTTMesh::topic_prio(uint8_t msgType, const char *topic, size_t topic_len) {
+    //Link management and commands sent to nodes are control traffic, firmware images are bulk and
+    //everything else is telemetry
+    size_t inTopicLen = strlen(inTopic);
+    if (MESH_IS_CONTROL(msgType)) {
+        return MSG_PRIO_CONTROL;
+    }
+    if (topic_len < inTopicLen || memcmp(topic, inTopic, inTopicLen) != 0) {
+        return MSG_PRIO_TELEMETRY;
+    }
+    if (topic_len >= inTopicLen + 4 && memcmp(topic + inTopicLen, "ota/", 4) == 0) {
+        return MSG_PRIO_BULK;
+    }
+    return MSG_PRIO_CONTROL;
+}
+
+bool ESP8266MQTTMesh::send_aliases() {
+    //Defines the aliases a new parent must know before the frames in the TX queue which use them.  They are sent past
+    //the queue, and tried again on every flush until the connection has room for them.  False while any is left
+    AsyncClient *c = espClient[0];
+    bool sent = false;
+    bool done = true;
+    for (int i = 0; i < MESH_ALIAS_COUNT && done; i++) {
+        mesh_alias_entry_t *entry = &tx_alias[i];
+        if (! entry->pending) {
+            continue;
+        }
+        uint8_t buf[MESH_HDR_MAX + MESH_ALIAS_LEN];
+        mesh_hdr_t *hdr = (mesh_hdr_t *)buf;
+        init_hdr(hdr, MESH_FRAME_ALIAS, entry->len, 0);
+        mesh_alias_t *alias = (mesh_alias_t *)add_opt(hdr, MESH_FLAG_ALIAS, sizeof(mesh_alias_t));
+        alias->id = i;
+        alias->define_len = entry->len;
+        memcpy(buf + hdr->hdr_len, entry->prefix, entry->len);
+        size_t len = hdr->hdr_len + entry->len;
+        if (c->space() < len || c->add((const char *)buf, len) != len) {
+            dbgPrintln(EMMDBG_WIFI, "No room to resend topic alias " + String(i) + " yet");
+            done = false;
+            continue;
+        }
+        entry->pending = false;
+        sent = true;
+    }
+    if (sent) {
+        c->send();
+    }
+    return done;
+}
+
+const char *ESP8266MQTTMesh::expand_payload(const char *msg, size_t msg_len, size_t raw_len, size_t *len) {
+    //Returns the payload and its length, decompressing it if raw_len is set
+    if (! raw_len) {
+        *len = msg_len;
+        return msg;
+    }
+    if (! zbuf || raw_len >= MQTT_MAX_PACKET_SIZE
+        || mesh_lz_decompress(zbuf, raw_len, (const uint8_t *)msg, msg_len) != (int)raw_len) {
+        return NULL;
+    }
+    *len = raw_len;
+    return (const char *)zbuf;
+}
+
+void ESP8266MQTTMesh::send_hello(int idx) {
+    mesh_hello_t hello;
+    hello.caps = (zbuf ? MESH_CAP_COMPRESS : 0) | MESH_CAP_CREDIT;
+    hello.depth = mesh_depth;
+    hello.path_rssi = path_rssi;
+    send_frame(idx, MESH_FRAME_HELLO, myID, strlen(myID), (const char *)&hello, sizeof(hello), 0);
+}
+
+void ESP8266MQTTMesh::set_depth(uint8_t depth, int8_t rssi) {
+    if (depth == mesh_depth && rssi == path_rssi) {
+        return;
+    }
+    mesh_depth = depth;
+    path_rssi = rssi;
+    //Our children's depth changed with ours
+    advertise();
+    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+        if (espClient[i]) {
+            send_hello(i);
+        }
+    }
+}
+
+void ESP8266MQTTMesh::handle_control(int idx, const mesh_hdr_t *hdr, const char *topic, const char *msg) {
+    switch(hdr->msgType) {
+    case MESH_FRAME_ALIAS:
+        //Topic aliases were already learned by decode_topic()
+        break;
+    case MESH_FRAME_HELLO:
+        if (idx == 0 && hdr->payload_len >= MESH_HELLO_MIN) {
+            mesh_hello_t hello = {};
+            memcpy(&hello, msg, hdr->payload_len < sizeof(hello) ? hdr->payload_len : sizeof(hello));
+            if (! uplinkHello || hello.caps != uplink_caps) {
+                //A parent repeats its HELLO when its depth changes, which must not cost us our credit
+                uplink_reset();
+                uplink_caps = hello.caps;
+                uplinkHello = true;
+            }
+            uint8_t depth = (hello.depth ? hello.depth : MESH_DEPTH_UNKNOWN) + 1;
+            int8_t rssi = WiFi.RSSI();
+            if (hello.path_rssi && hello.path_rssi < rssi) {
+                rssi = hello.path_rssi;
+            }
+            dbgPrintf(EMMDBG_WIFI, "Parent %s has capabilities %02x, depth %u", topic, uplink_caps, hello.depth);
+            set_depth(depth, rssi);
+            //Frames held back for the HELLO can go now
+            flush_tx(0);
+        }
+        break;
+    case MESH_FRAME_CREDIT:
+        if (idx == 0 && hdr->payload_len >= sizeof(uint16_t)) {
+            uint16_t grant;
+            memcpy(&grant, msg, sizeof(grant));
+            uplink_credit += grant;
+            creditRequested = false;
+            flush_tx(0);
+        } else if (idx > 0 && hdr->payload_len >= sizeof(mesh_credit_req_t)) {
+            mesh_credit_req_t req;
+            memcpy(&req, msg, sizeof(req));
+            mesh_credit_t *cr = &credits[idx-1];
+            //Frames arrive in order, so everything sent with the previous grant has been counted
+            cr->active = true;
+            cr->granted = 0;
+            cr->need = req.need ? req.need : 1;
+            cr->want = req.want > cr->need ? req.want : cr->need;
+            credit_service();
+        }
+        break;
+    case MESH_FRAME_ACK:
+        if (idx == 0 && hdr->payload_len >= sizeof(uint16_t)) {
+            uint16_t id;
+            memcpy(&id, msg, sizeof(id));
+            qos_complete(id);
+        }
+        break;
+    case MESH_FRAME_PEER:
+        route_peer(idx, topic, msg, hdr->payload_len, (const mesh_origin_t *)find_opt(hdr, MESH_FLAG_ORIGIN));
+        break;
+    case MESH_FRAME_LEAVE:
+        if (idx > 0) {
+            uint32_t id;
+            if (parse_node_id(topic, &id)) {
+                route_drop(idx, id);
+            }
+        }
+        break;
+    case MESH_FRAME_JOIN:
+        if (idx > 0) {
+            uint32_t id;
+            if (parse_node_id(topic, &id)) {
+                route_add(idx, id);
+            }
+            for (size_t off = 0; off + sizeof(id) <= hdr->payload_len; off += sizeof(id)) {
+                memcpy(&id, msg + off, sizeof(id));
+                route_add(idx, id);
+            }
+            //Every node up to the broker has to learn the new path, whatever it knew before
+            if (meshConnect && p2pConnected) {
+                send_frame(0, MESH_FRAME_JOIN, topic, strlen(topic), msg, hdr->payload_len, 0);
+            }
+        }
+        break;
+    default:
+        dbgPrintf(EMMDBG_WIFI, "Ignoring unknown control frame %02x on link %d", hdr->msgType, idx);
+    }
+}
+
+bool ESP8266MQTTMesh::decode_topic(int idx, const mesh_hdr_t *hdr, const char *wire, char *topic) {
+    //Expand the received topic into 'topic' (TOPIC_LEN bytes), learning any alias defined along the way
+    size_t len = 0;
+    const mesh_alias_t *alias = (const mesh_alias_t *)find_opt(hdr, MESH_FLAG_ALIAS);
+    if (alias) {
+        if (idx == 0 || alias->id >= MESH_ALIAS_COUNT) {
+            return false;
+        }
+        mesh_alias_entry_t *entry = &rx_alias[idx-1][alias->id];
+        if (alias->define_len) {
+            if (alias->define_len > hdr->topic_len || alias->define_len >= MESH_ALIAS_LEN) {
+                return false;
+            }
+            memcpy(entry->prefix, wire, alias->define_len);
+            entry->len = alias->define_len;
+        } else {
+            if (! entry->len || entry->len + hdr->topic_len >= TOPIC_LEN) {
+                return false;
+            }
+            memcpy(topic, entry->prefix, entry->len);
+            len = entry->len;
+        }
+    }
+    memcpy(topic + len, wire, hdr->topic_len);
+    topic[len + hdr->topic_len] = '\0';
+    return true;
+}
+
+void ESP8266MQTTMesh::forward_downstream(const char *topic, const char *msg, size_t msg_len, uint8_t prio, const mesh_origin_t *origin, const mesh_frag_t *frag) {
+    uint8_t buf[MESH_HDR_MAX];
+    mesh_hdr_t *hdr = (mesh_hdr_t *)buf;
+    mesh_origin_t own;
+    size_t topic_len = strlen(topic);
+    int link = route_topic(topic);
+    if (link == 0) {
+        //Addressed to this node
+        return;
+    }
+    if (topic_len == 0 || topic_len >= TOPIC_LEN || MESH_HDR_MAX + topic_len + msg_len > MESH_FRAME_MAX) {
+        dbgPrintf(EMMDBG_MSG, "Dropping message which does not fit in a frame: %s", topic);
+        stats.tx_dropped++;
+        return;
+    }
+    if (prio >= MSG_PRIO_COUNT) {
+        prio = topic_prio(MSG_TYPE_NONE, topic, topic_len);
+    }
+    if (frag && prio == MSG_PRIO_CONTROL) {
+        //Fragments must stay in one queue, or a short last one would overtake the others.  Most don't fit the control queue
+        prio = MSG_PRIO_TELEMETRY;
+    }
+    if (! origin) {
+        //Fresh from the broker
+        origin_new(&own);
+        origin = &own;
+    }
+    //Build the header once and reuse it for every child
+    init_hdr(hdr, MSG_TYPE_NONE, topic_len, msg_len);
+    memcpy(add_opt(hdr, MESH_FLAG_ORIGIN, sizeof(mesh_origin_t)), origin, sizeof(mesh_origin_t));
+    if (frag) {
+        memcpy(add_opt(hdr, MESH_FLAG_FRAG, sizeof(mesh_frag_t)), frag, sizeof(mesh_frag_t));
+    }
+    hdr->flags |= MESH_FLAG_PRIO(prio);
+    mesh_origin_t o;
+    mesh_frag_t f;
+    mesh_frag_fail_t *fail = NULL;
+    if (frag) {
+        memcpy(&o, origin, sizeof(o));
+        memcpy(&f, frag, sizeof(f));
+        for (int i = 0; i < MESH_FRAG_TRACK && ! fail; i++) {
+            if (frag_fail[i].links && frag_fail[i].origin.id == o.id && frag_fail[i].origin.seq == o.seq) {
+                fail = &frag_fail[i];
+            }
+        }
+    }
+    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
+        if (! espClient[i] || (link >= 0 && link != i)) {
+            continue;
+        }
+        if (fail && (fail->links & (1UL << i))) {
+            //Already counted as dropped when it missed a fragment
+            continue;
+        }
+        if (! write_frame(i, hdr, topic, msg) && frag && f.offset + msg_len < f.total) {
+            if (! fail) {
+                fail = &frag_fail[frag_fail_next];
+                frag_fail_next = (frag_fail_next + 1) % MESH_FRAG_TRACK;
+                fail->origin = o;
+                fail->links = 0;
+            }
+            dbgPrintf(EMMDBG_MSG, "Link %d missed part of %s, dropping the rest of it", i, topic);
+            fail->links |= 1UL << i;
+        }
+    }
+    if (fail && f.offset + msg_len >= f.total) {
+        fail->links = 0;
+    }
+}
+
+void ESP8266MQTTMesh::frag_downstream(const char *topic, const char *msg, size_t msg_len, uint8_t prio, const mesh_origin_t *origin, const mesh_frag_t *frag) {
+    forward_downstream(topic, msg, msg_len, prio, origin, frag);
+    frag_deliver(topic, msg, msg_len, origin, frag);
+}
+
+mesh_frag_rx_t *ESP8266MQTTMesh::frag_slot(const mesh_origin_t *origin, const mesh_frag_t *frag, size_t len, bool need_buf) {
+    //Finds the message a fragment belongs to, starting a new one on its first fragment.  NULL if the fragment can't be used
+    mesh_origin_t o;
+    mesh_frag_t f;
+    memcpy(&o, origin, sizeof(o));
+    memcpy(&f, frag, sizeof(f));
+    uint32_t now = millis();
+    mesh_frag_rx_t *slot = NULL;
+    if (! f.total || f.offset + len > f.total) {
+        return NULL;
+    }
+    for (int i = 0; i < MESH_FRAG_SLOTS; i++) {
+        mesh_frag_rx_t *s = &frag_rx[i];
+        if (s->total && now - s->seen > MESH_FRAG_TIMEOUT_MS) {
+            dbgPrintf(EMMDBG_MSG, "Abandoning fragmented message %08X:%u after %u of %u bytes",
+                      s->origin.id, s->origin.seq, (unsigned)s->have, (unsigned)s->total);
+            frag_release(s);
+            stats.rx_dropped++;
+        }
+        if (s->total && s->origin.id == o.id && s->origin.seq == o.seq) {
+            slot = s;
+        }
+    }
+    if (slot) {
+        if (slot->have != f.offset || slot->total != f.total) {
+            //Out of order, e.g. part of a copy.  The message carries on with the fragment it is waiting for
+            return NULL;
+        }
+        slot->seen = now;
+        return slot;
+    }
+    if (f.offset) {
+        //The start of the message was missed
+        return NULL;
+    }
+    for (int i = 0; i < MESH_FRAG_SLOTS && ! slot; i++) {
+        if (! frag_rx[i].total) {
+            slot = &frag_rx[i];
+        }
+    }
+    if (slot && need_buf) {
+        //With room to terminate it
+        slot->buf = f.total <= MESH_FRAG_MAX ? rx_lease(f.total + 1) : NULL;
+    }
+    if (! slot || (need_buf && ! slot->buf)) {
+        dbgPrintf(EMMDBG_MSG, "No room for %u byte fragmented message %08X:%u", (unsigned)f.total, o.id, o.seq);
+        stats.rx_dropped++;
+        return NULL;
+    }
+    slot->origin = o;
+    slot->total = f.total;
+    slot->have = 0;
+    slot->seen = now;
+    return slot;
+}
+
+void ESP8266MQTTMesh::frag_release(mesh_frag_rx_t *slot) {
+    rx_release(slot->buf);
+    memset(slot, 0, sizeof(mesh_frag_rx_t));
+}
+
+bool ESP8266MQTTMesh::frag_needs_whole(const char *topic) {
+    //Whether parse_message() must see a message from the broker in one piece on this node
+    int inTopicLen = strlen(inTopic);
+    if (strstr(topic, inTopic) != topic) {
+        return false;
+    }
+    const char *subtopic = topic + inTopicLen;
+    if (strstr(subtopic, "ota/") == subtopic || strstr(subtopic, "fw/") == subtopic) {
+        return true;
+    }
+    return callback && ! streamCallback && local_subtopic(topic);
+}
+
+void ESP8266MQTTMesh::frag_deliver(const char *topic, const char *msg, size_t len, const mesh_origin_t *origin, const mesh_frag_t *frag) {
+    //Pieces of a large message for this node go to the stream callback as they arrive.  Messages this node needs in
+    //one piece (without a stream callback, or for OTA) are put back together in receive buffers, up to MESH_FRAG_MAX
+    //bytes.  Anything else was only passed through
+    const char *subtopic = local_subtopic(topic);
+    bool whole = frag_needs_whole(topic);
+    if (! whole && ! (subtopic && streamCallback)) {
+        return;
+    }
+    mesh_frag_rx_t *slot = frag_slot(origin, frag, len, whole);
+    if (! slot) {
+        return;
+    }
+    if (whole) {
+        memcpy(slot->buf + slot->have, msg, len);
+    } else {
+        streamCallback(subtopic, msg, len, slot->have, slot->total);
+    }
+    slot->have += len;
+    if (slot->have == slot->total) {
+        if (slot->buf) {
+            slot->buf[slot->total] = '\0';
+            parse_message(topic, slot->buf, slot->total);
+        }
+        frag_release(slot);
+    }
+}
+
+void ESP8266MQTTMesh::frag_reassemble(const char *topic, const char *msg, size_t len, uint8_t msgType, const mesh_origin_t *origin, const mesh_frag_t *frag) {
+    //The broker only takes whole messages
+    mesh_frag_rx_t *slot = frag_slot(origin, frag, len, true);
+    if (! slot) {
+        return;
+    }
+    memcpy(slot->buf + slot->have, msg, len);
+    slot->have += len;
+    if (slot->have == slot->total) {
+        broker_send(topic, slot->buf, slot->total, msgType);
+        frag_release(slot);
+    }
+}
+
+bool ESP8266MQTTMesh::frag_send(const char *topic, const char *msg, size_t msg_len, uint8_t msgType, size_t prefix_len, uint8_t prio) {
+    //Fragments are queued straight from msg while the uplink queue has room.  Only what it can't take yet is copied, to
+    //receive buffers, and queued from there as the uplink drains.  One message is sent this way at a time
+    size_t topic_len = strlen(topic);
+    if (topic_len == 0 || topic_len >= TOPIC_LEN) {
+        dbgPrintf(EMMDBG_MSG, "Dropping message which does not fit in a frame: %s", topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    if (msg_len > MESH_FRAG_MAX) {
+        //The broker's side of the mesh could not put it back together
+        dbgPrintf(EMMDBG_MSG, "Dropping %u byte message larger than MESH_FRAG_MAX: %s", (unsigned)msg_len, topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    if (frag_tx.total) {
+        dbgPrintf(EMMDBG_MSG, "Dropping large message while another one is being sent: %s", topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    if (prio >= MSG_PRIO_COUNT) {
+        prio = topic_prio(msgType, topic, topic_len);
+    }
+    if (prio == MSG_PRIO_CONTROL) {
+        //Far too large for the control queue
+        prio = MSG_PRIO_TELEMETRY;
+    }
+    memcpy(frag_tx.topic, topic, topic_len);
+    frag_tx.topic_len = topic_len;
+    frag_tx.prefix_len = prefix_len;
+    frag_tx.msgType = msgType;
+    frag_tx.prio = prio;
+    frag_tx.msg = msg;
+    frag_tx.base = 0;
+    frag_tx.total = msg_len;
+    frag_tx.offset = 0;
+    frag_tx.seen = millis();
+    //Nothing is sent unless all of it can follow: the receive buffers must be able to hold whatever the uplink queue
+    //can't take now, or the queue must have room for every fragment
+    size_t frags = (msg_len + MESH_FRAG_SIZE - 1) / MESH_FRAG_SIZE;
+    char *lease = rx_lease(msg_len);
+    if (! lease && frag_room() < msg_len + frags * (MESH_HDR_MAX + topic_len)) {
+        dbgPrintf(EMMDBG_MSG, "No room to send large message: %s", topic);
+        stats.tx_dropped++;
+        memset(&frag_tx, 0, sizeof(frag_tx));
+        return false;
+    }
+    origin_new(&frag_tx.origin);
+    frag_feed();
+    rx_release(lease);
+    if (frag_tx.total) {
+        //msg is only the caller's until we return.  The buffers just released are enough for the rest
+        frag_tx.lease = rx_lease(frag_tx.total - frag_tx.offset);
+        if (! frag_tx.lease) {
+            dbgPrintf(EMMDBG_MSG, "Abandoning large message after %u of %u bytes", (unsigned)frag_tx.offset, (unsigned)frag_tx.total);
+            stats.tx_dropped++;
+            frag_done();
+            return false;
+        }
+        memcpy(frag_tx.lease, msg + frag_tx.offset, frag_tx.total - frag_tx.offset);
+        frag_tx.msg = frag_tx.lease;
+        frag_tx.base = frag_tx.offset;
+    }
+    check_watermark(0);
+    return true;
+}
+
+size_t ESP8266MQTTMesh::frag_room() {
+    //Room for the fragments of frag_tx in the uplink queue.  They go where write_frame() would put them
+    mesh_txq_t *q = &txq[0];
+    const mesh_ring_t *r = &q->ring[frag_tx.prio];
+    if (frag_tx.prio == MSG_PRIO_BULK && q->spill[MSG_PRIO_BULK]) {
+        r = &q->ring[MSG_PRIO_TELEMETRY];
+    } else if (frag_tx.prio == MSG_PRIO_BULK && ! r->buf) {
+        //Allocated with the first frame
+        return q->buf ? MESH_TX_BULK_SIZE : 0;
+    }
+    size_t room = r->buf ? r->size - r->used : 0;
+    if (r == &q->ring[MSG_PRIO_TELEMETRY] && ! txRelay) {
+        //What our children were granted is kept for their frames
+        size_t granted = credit_granted();
+        room = room > granted ? room - granted : 0;
+    }
+    return room;
+}
+
+void ESP8266MQTTMesh::frag_done() {
+    rx_release(frag_tx.lease);
+    memset(&frag_tx, 0, sizeof(frag_tx));
+    check_watermark(0);
+}
+
+void ESP8266MQTTMesh::frag_feed() {
+    if (! frag_tx.total || frag_tx.feeding) {
+        return;
+    }
+    if (millis() - frag_tx.seen > MESH_FRAG_TIMEOUT_MS) {
+        //The receiving end has given up on it by now
+        dbgPrintf(EMMDBG_MSG, "Abandoning large message after %u of %u bytes", (unsigned)frag_tx.offset, (unsigned)frag_tx.total);
+        stats.tx_dropped++;
+        frag_done();
+        return;
+    }
+    frag_tx.feeding = true;
+    while (frag_tx.offset < frag_tx.total) {
+        size_t len = frag_tx.total - frag_tx.offset;
+        if (len > MESH_FRAG_SIZE) {
+            len = MESH_FRAG_SIZE;
+        }
+        if (MESH_HDR_MAX + frag_tx.topic_len + len > frag_room()) {
+            //Wait for room instead of having the queue drop a piece
+            frag_tx.feeding = false;
+            return;
+        }
+        mesh_frag_t frag = { frag_tx.total, frag_tx.offset };
+        const char *msg = frag_tx.msg + (frag_tx.offset - frag_tx.base);
+        if (! send_frame(0, frag_tx.msgType, frag_tx.topic, frag_tx.topic_len, msg, len, frag_tx.prefix_len, 0, 0,
+                         frag_tx.prio, &frag_tx.origin, &frag)) {
+            //Tried again once the uplink drains, the rest is no use without this piece
+            frag_tx.feeding = false;
+            return;
+        }
+        frag_tx.offset += len;
+        frag_tx.seen = millis();
+    }
+    frag_done();
+}
+
+int ESP8266MQTTMesh::route_topic(const char *topic) {
+    //Returns the child link leading to the node a message is addressed to, 0 if it is addressed to this node
+    //and -1 if it must go to every child (broadcast/, ota/, fw/ or a node which has not been seen)
+    uint32_t id, self;
+    size_t inTopicLen = strlen(inTopic);
+    if (strncmp(topic, inTopic, inTopicLen) != 0 || ! parse_node_id(topic + inTopicLen, &id)) {
+        return -1;
+    }
+    if (parse_node_id(myID, &self) && id == self) {
+        return 0;
+    }
+    for (int i = 0; i < MESH_ROUTE_COUNT; i++) {
+        if (routes[i].link && routes[i].id == id) {
+            return routes[i].link;
+        }
+    }
+    return -1;
+}
+
+void ESP8266MQTTMesh::route_learn(int link, const char *topic, const char *msg, size_t msg_len, size_t raw_len) {
+    //topic was sent towards the broker by a node in the subtree behind 'link'
+    uint32_t id;
+    size_t outTopicLen = strlen(outTopic);
+    size_t inTopicLen = strlen(inTopic);
+    if (strncmp(topic, outTopic, outTopicLen) == 0) {
+        topic += outTopicLen;
+        if (strcmp(topic, "connect") == 0) {
+            //The announcement of a node which just joined carries its ID in the payload: '... ChipID:<id> ...'
+            size_t len;
+            const char *payload = msg ? expand_payload(msg, msg_len, raw_len, &len) : NULL;
+            for (size_t off = 0; payload && off + 7 < len; off++) {
+                if (memcmp(payload + off, "ChipID:", 7) != 0) {
+                    continue;
+                }
+                char str[10];
+                size_t i;
+                for (i = 0; i < 8 && off + 7 + i < len && payload[off + 7 + i] != ' '; i++) {
+                    str[i] = payload[off + 7 + i];
+                }
+                str[i] = '/';
+                str[i + 1] = '\0';
+                if (parse_node_id(str, &id)) {
+                    route_add(link, id);
+                }
+                break;
+            }
+            return;
+        }
+    } else if (strncmp(topic, inTopic, inTopicLen) == 0) {
+        topic += inTopicLen;
+    } else {
+        //Not relayed for a node
+        return;
+    }
+    if (parse_node_id(topic, &id)) {
+        route_add(link, id);
+    } else if (! meshConnect) {
+        //Not an ID this node can route or subscribe by, e.g. one set with setID()
+        route_wildcard();
+    }
+}
+
+void ESP8266MQTTMesh::route_add(int link, uint32_t id) {
+    mesh_route_t *route = NULL;
+    for (int i = 0; i < MESH_ROUTE_COUNT; i++) {
+        if (routes[i].link && routes[i].id == id) {
+            route = &routes[i];
+            break;
+        }
+        //Otherwise use a free entry, or replace the one which has been quiet the longest
+        if (! route || (route->link && (! routes[i].link || (int32_t)(routes[i].seen - route->seen) < 0))) {
+            route = &routes[i];
+        }
+    }
+    if (route->link != link || route->id != id) {
+        dbgPrintf(EMMDBG_MQTT_EXTRA, "Node %06X is reached through link %d", (unsigned)id, link);
+    }
+    if (! route->link || route->id != id) {
+        if (route->link && ! meshConnect) {
+            //The node being replaced is most likely still there, and must keep getting its messages
+            route_wildcard();
+        }
+        route_subscribe(id, true);
+    }
+    route->id = id;
+    route->link = link;
+    route->seen = millis();
+}
+
+void ESP8266MQTTMesh::route_drop(int link, uint32_t id) {
+    for (int i = 0; i < MESH_ROUTE_COUNT; i++) {
+        //The node may already have shown up behind another link
+        if (routes[i].link == link && routes[i].id == id) {
+            dbgPrintf(EMMDBG_MQTT_EXTRA, "Node %06X left link %d", (unsigned)id, link);
+            routes[i].link = 0;
+            route_subscribe(id, false);
+            if (meshConnect && p2pConnected) {
+                char topic[10];
+                snprintf(topic, sizeof(topic), "%06X/", (unsigned)id);
+                send_frame(0, MESH_FRAME_LEAVE, topic, strlen(topic), "", 0, 0);
+            }
+            return;
+        }
+    }
+}
+
+void ESP8266MQTTMesh::route_announce() {
+    //One frame for this node and its whole subtree.  Whether it overtakes or follows the LEAVE our old parent sends, the
+    //node where both paths meet ends up with the new link
+    if (! meshConnect || ! p2pConnected) {
+        return;
+    }
+    uint32_t ids[MESH_ROUTE_COUNT];
+    size_t count = 0;
+    for (int i = 0; i < MESH_ROUTE_COUNT; i++) {
+        if (routes[i].link) {
+            ids[count++] = routes[i].id;
+        }
+    }
+    dbgPrintf(EMMDBG_MQTT_EXTRA, "Announcing %u nodes to the new parent", (unsigned)count);
+    send_frame(0, MESH_FRAME_JOIN, myID, strlen(myID), (const char *)ids, count * sizeof(ids[0]), 0);
+}
+
+void ESP8266MQTTMesh::route_peer(int from, const char *topic, const char *msg, size_t msg_len, const mesh_origin_t *origin) {
+    //Peer messages climb the tree until they reach a node which knows the branch leading to their
+    //destination (their lowest common ancestor), and then go down that branch.  'from' is -1 for
+    //messages sent by this node
+    int link = route_topic(topic);
+    if (link == 0) {
+        parse_message(topic, msg, msg_len);
+    } else if (link > 0 && link != from) {
+        send_frame(link, MESH_FRAME_PEER, topic, strlen(topic), msg, msg_len, 0, 0, 0, MSG_PRIO_AUTO, origin);
+    } else if (link < 0 && from != 0) {
+        if (meshConnect) {
+            send_frame(0, MESH_FRAME_PEER, topic, strlen(topic), msg, msg_len, node_prefix_len(topic), 0, 0, MSG_PRIO_AUTO, origin);
+        } else {
+            //Not in this mesh, the broker may still know a gateway for it
+            broker_send(topic, msg, msg_len, MSG_TYPE_NONE);
+        }
+    } else {
+        dbgPrintf(EMMDBG_MQTT, "No route for peer message %s, dropping it", topic);
+    }
+}
+
+void ESP8266MQTTMesh::origin_new(mesh_origin_t *origin) {
+    origin->id = _chipID;
+    origin->seq = ++origin_seq;
+}
+
+bool ESP8266MQTTMesh::origin_is_dup(const mesh_origin_t *origin) {
+    mesh_origin_t o;
+    memcpy(&o, origin, sizeof(o));
+    for (int i = 0; i < MESH_DEDUP_COUNT; i++) {
+        if (origin_seen[i].id == o.id && origin_seen[i].seq == o.seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ESP8266MQTTMesh::origin_mark_seen(const mesh_origin_t *origin) {
+    //The oldest entry is replaced, so a message is recognised as long as MESH_DEDUP_COUNT newer ones haven't passed
+    memcpy(&origin_seen[origin_seen_next], origin, sizeof(mesh_origin_t));
+    origin_seen_next = (origin_seen_next + 1) % MESH_DEDUP_COUNT;
+}
+
+bool ESP8266MQTTMesh::frag_is_dup(const mesh_origin_t *origin, const mesh_frag_t *frag, size_t len) {
+    //All fragments of a message share its origin.  A fragment is a copy if the message got past its offset already
+    mesh_origin_t o;
+    mesh_frag_t f;
+    memcpy(&o, origin, sizeof(o));
+    memcpy(&f, frag, sizeof(f));
+    mesh_frag_seen_t *s = NULL;
+    for (int i = 0; i < MESH_FRAG_TRACK && ! s; i++) {
+        if (frag_seen[i].next && frag_seen[i].origin.id == o.id && frag_seen[i].origin.seq == o.seq) {
+            s = &frag_seen[i];
+        }
+    }
+    if (s ? f.offset < s->next : origin_is_dup(origin)) {
+        return true;
+    }
+    if (f.offset + len >= f.total) {
+        //Complete, any later copy of it is found in origin_seen
+        origin_mark_seen(origin);
+        if (s) {
+            s->next = 0;
+        }
+        return false;
+    }
+    if (! s) {
+        s = &frag_seen[frag_seen_next];
+        frag_seen_next = (frag_seen_next + 1) % MESH_FRAG_TRACK;
+        s->origin = o;
+    }
+    s->next = f.offset + len;
+    return false;
+}
+
+void ESP8266MQTTMesh::credit_request(size_t need) {
+    //Asks the parent for enough credit for at least the next frame.  What is left of the previous grant is given
+    //up, so credit never sits with a node which can't use it while another one waits
+    AsyncClient *c = espClient[0];
+    mesh_txq_t *q = &txq[0];
+    if (creditRequested || ! c || ! c->connected()) {
+        return;
+    }
+    size_t want = 0;
+    for (int cls = 0; cls < MSG_PRIO_COUNT; cls++) {
+        want += q->ring[cls].used;
+    }
+    if (want > MESH_CREDIT_WINDOW) {
+        want = MESH_CREDIT_WINDOW;
+    }
+    if (want < need) {
+        want = need;
+    }
+    uint8_t buf[MESH_HDR_MAX];
+    mesh_hdr_t *hdr = (mesh_hdr_t *)buf;
+    mesh_credit_req_t req = { (uint16_t)need, (uint16_t)want };
+    init_hdr(hdr, MESH_FRAME_CREDIT, strlen(myID), sizeof(req));
+    hdr->flags |= MESH_FLAG_PRIO(MSG_PRIO_CONTROL);
+    //Sent past the queues, since they are what is waiting for it.  Tried again on the next flush if there is no room
+    if (c->space() < hdr->hdr_len + hdr->topic_len + sizeof(req)) {
+        return;
+    }
+    c->add((const char *)buf, hdr->hdr_len);
+    c->add(myID, hdr->topic_len);
+    c->add((const char *)&req, sizeof(req));
+    c->send();
+    uplink_credit = 0;
+    creditRequested = true;
+    stats.credit_stalls++;
+    dbgPrintf(EMMDBG_WIFI_EXTRA, "Asked parent for %u-%u bytes of credit", (unsigned)need, (unsigned)want);
+}
+
+void ESP8266MQTTMesh::uplink_reset() {
+    //Forgets what we know about our parent until its HELLO arrives
+    uplink_caps = 0;
+    uplink_credit = 0;
+    creditRequested = false;
+    uplinkHello = false;
+    uplink_since = millis();
+}
+
+void ESP8266MQTTMesh::credit_service() {
+    //Grants pending requests in turn from the room left in our own uplink queue, or in the queue for the broker.
+    //MESH_CREDIT_RESERVE of it is kept for our own messages.  A request which does not fit holds up the ones
+    //behind it, so a child with a large frame is not starved by others sending small ones
+    const mesh_ring_t *r = meshConnect ? &txq[0].ring[MSG_PRIO_TELEMETRY] : &brokerq;
+    long avail = r->buf ? r->size - r->used : 0;
+    avail -= MESH_CREDIT_RESERVE + credit_granted();
+    for (int n = 0; n < ESP8266_NUM_CLIENTS; n++) {
+        int i = (credit_turn + n) % ESP8266_NUM_CLIENTS;
+        mesh_credit_t *cr = &credits[i];
+        if (! cr->need) {
+            continue;
+        }
+        if (avail < cr->need) {
+            break;
+        }
+        uint16_t grant = avail < cr->want ? avail : cr->want;
+        cr->granted += grant;
+        cr->need = 0;
+        avail -= grant;
+        credit_turn = (i + 1) % ESP8266_NUM_CLIENTS;
+        send_frame(i + 1, MESH_FRAME_CREDIT, myID, strlen(myID), (const char *)&grant, sizeof(grant), 0);
+    }
+}
+
+uint32_t ESP8266MQTTMesh::credit_granted() {
+    uint32_t granted = 0;
+    for (int i = 0; i < ESP8266_NUM_CLIENTS; i++) {
+        granted += credits[i].granted;
+    }
+    return granted;
+}
+
+uint16_t ESP8266MQTTMesh::qos_new_id() {
+    if (! ++qos_next_id) {
+        qos_next_id = 1;
+    }
+    return qos_next_id;
+}
+
+static size_t qos_entry_size(const mesh_qos_entry_t *e) {
+    return sizeof(mesh_qos_entry_t) + e->topic_len + e->payload_len;
+}
+
+bool ESP8266MQTTMesh::qos_add(int from_link, uint16_t from_id, uint8_t msgType, const char *topic, const char *msg, size_t msg_len, size_t prefix_len, size_t raw_len, uint8_t prio, const mesh_origin_t *origin) {
+    size_t topic_len = strlen(topic);
+    size_t size = sizeof(mesh_qos_entry_t) + topic_len + msg_len;
+    if (topic_len >= TOPIC_LEN || qos_used + size > MESH_QOS_STORE_SIZE) {
+        return false;
+    }
+    if (! qos_store) {
+        //Only nodes which carry QoS 1/2 messages need the store
+        qos_store = new uint8_t[MESH_QOS_STORE_SIZE];
+        if (! qos_store) {
+            return false;
+        }
+    }
+    mesh_qos_entry_t *e = (mesh_qos_entry_t *)(qos_store + qos_used);
+    e->id = 0;
+    e->from_id = from_id;
+    e->from_link = from_link;
+    e->msgType = msgType;
+    e->prio = prio;
+    e->prefix_len = prefix_len;
+    e->topic_len = topic_len;
+    e->payload_len = msg_len;
+    e->raw_len = raw_len;
+    if (origin) {
+        memcpy(&e->origin, origin, sizeof(mesh_origin_t));
     } else {
-        send_message(0, topic, msg, msgType);
+        origin_new(&e->origin);
     }
+    e->tx_cls = MSG_PRIO_COUNT;
+    e->start = millis();
+    memcpy(qos_store + qos_used + sizeof(mesh_qos_entry_t), topic, topic_len);
+    memcpy(qos_store + qos_used + sizeof(mesh_qos_entry_t) + topic_len, msg, msg_len);
+    qos_used += size;
+    qos_transmit(e);
+    qos_schedule();
+    return true;
 }
 
-void ESP8266MQTTMesh::shutdown_AP() {
-    if(! AP_ready)
-        return;
-    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
-        if(espClient[i]) {
-            delete espClient[i];
-            espClient[i] = NULL;
+void ESP8266MQTTMesh::qos_transmit(mesh_qos_entry_t *e) {
+    const char *topic = (const char *)(e + 1);
+    const char *msg = topic + e->topic_len;
+    e->sent = millis();
+    if (meshConnect) {
+        if (! p2pConnected) {
+            return;
+        }
+        if (! e->id) {
+            e->id = qos_new_id();
+        }
+        e->tx_cls = MSG_PRIO_COUNT;
+        if (send_frame(0, e->msgType, topic, e->topic_len, msg, e->payload_len, e->prefix_len, e->raw_len, e->id, e->prio, &e->origin)) {
+            e->tx_cls = txq[0].last_cls;
+            e->tx_end = txq[0].ring[e->tx_cls].queued;
+        }
+    } else {
+        char full_topic[TOPIC_LEN];
+        size_t len;
+        const char *payload = expand_payload(msg, e->payload_len, e->raw_len, &len);
+        if (! mqttClient.connected() || ! payload) {
+            return;
         }
+        memcpy(full_topic, topic, e->topic_len);
+        full_topic[e->topic_len] = '\0';
+        //The packet ID identifies the message once the broker acknowledges it in onMqttPublish()
+        e->id = mqtt_publish(full_topic, payload, len, e->msgType);
     }
-    WiFi.softAPdisconnect(true);
-    WiFi.mode(WIFI_STA);
-    AP_ready = false;
 }
 
-void ESP8266MQTTMesh::setup_AP() {
-    if (AP_ready)
+void ESP8266MQTTMesh::qos_complete(uint16_t id) {
+    for (size_t off = 0; id && off < qos_used; off += qos_entry_size((mesh_qos_entry_t *)(qos_store + off))) {
+        mesh_qos_entry_t *e = (mesh_qos_entry_t *)(qos_store + off);
+        if (e->id != id) {
+            continue;
+        }
+        int from_link = e->from_link;
+        uint16_t from_id = e->from_id;
+        uint32_t latency = millis() - e->start;
+        size_t size = qos_entry_size(e);
+        memmove(qos_store + off, qos_store + off + size, qos_used - off - size);
+        qos_used -= size;
+        if (from_link > 0) {
+            send_ack(from_link, from_id);
+        } else if (from_link < 0 && deliveryCallback) {
+            deliveryCallback(from_id, latency);
+        }
         return;
-    
-    uint octet2 = WiFi.gatewayIP()[1] + 1;
-    if (octet2==255) {
-        octet2++;
     }
-    if (octet2==0) {
-        octet2++;
+}
+
+void ESP8266MQTTMesh::qos_resend_all() {
+    //The new uplink has seen none of the IDs, so every stored message is sent again
+    for (size_t off = 0; off < qos_used; off += qos_entry_size((mesh_qos_entry_t *)(qos_store + off))) {
+        mesh_qos_entry_t *e = (mesh_qos_entry_t *)(qos_store + off);
+        e->id = 0;
+        qos_transmit(e);
     }
-    IPAddress apIP(WiFi.gatewayIP()[0],
-                   octet2,
-                   1,
-                   1);
-    IPAddress apGateway(apIP);
-    IPAddress apSubmask(255, 255, 255, 0);
-    WiFi.mode(WIFI_AP_STA);
-    WiFi.softAPConfig(apIP, apGateway, apSubmask);
-    char _mesh_ssid[32];
-    uint8_t mac[6];
-    build_mesh_ssid(_mesh_ssid, WiFi.softAPmacAddress(mac));
-    WiFi.softAP(_mesh_ssid, mesh_password, WiFi.channel(), 1);
-    dbgPrintln(EMMDBG_WIFI, "Initialized AP as '" + String(_mesh_ssid) + "'  IP '" + apIP.toString() + "'");
-    AP_ready = true;
+    qos_schedule();
 }
 
-void ESP8266MQTTMesh::send_connected_msg() {
-    //The list of nodes is only stored on the broker.  Individual nodes don't knowother node IDs
-    /*char topic[10];
-    strlcpy(topic, myID, sizeof(topic));
-    topic[strlen(topic)-1] = 0; // Chop off trailing '/'
-    publish(outTopic, "bssid/", topic, WiFi.softAPmacAddress().c_str(), MSG_TYPE_RETAIN_QOS_0);*/
-    if(wasConnected){
-        publish("info/reset_Reason", String("lost_Connection").c_str(), MSG_TYPE_RETAIN_QOS_0);
-    }else{
-#ifdef ESP32
-        publish("info/reset_Reason", String(esp_reset_reason()).c_str(), MSG_TYPE_RETAIN_QOS_0);
-#else
-        publish("info/reset_Reason", String(ESP.getResetReason()).c_str(), MSG_TYPE_RETAIN_QOS_0);
-#endif
+void ESP8266MQTTMesh::qos_retry() {
+    if (meshConnect ? ! p2pConnected : ! mqttClient.connected()) {
+        //Everything is sent again once connected
+        qos_schedule();
+        return;
     }
-    
-    publish("info/MAC", String(WiFi.macAddress()).c_str(), MSG_TYPE_RETAIN_QOS_0);
-    publish("info/MAC_hosted_AP", String(WiFi.softAPmacAddress()).c_str(), MSG_TYPE_RETAIN_QOS_0);
-    publish("info/IP_local", WiFi.localIP().toString().c_str(), MSG_TYPE_RETAIN_QOS_0);
-    
-    if(ap_ptr == NULL){
-        Serial.println("Warning: ap_ptr is NULL");
-    }else{
-        publish("info/RSSI", String(ap_ptr->rssi).c_str(), MSG_TYPE_RETAIN_QOS_0);
-        publish("info/connectedTo", String(mac_str(ap_ptr->bssid)).c_str(), MSG_TYPE_RETAIN_QOS_0);
+    uint32_t now = millis();
+    for (size_t off = 0; off < qos_used; off += qos_entry_size((mesh_qos_entry_t *)(qos_store + off))) {
+        mesh_qos_entry_t *e = (mesh_qos_entry_t *)(qos_store + off);
+        //The broker connection is reliable while it lasts, so there only messages which could not be published are retried.
+        //A copy still waiting in our own queue has not timed out, the link is just slow
+        if (meshConnect ? now - e->sent >= MESH_QOS_RETRY_MS && ! qos_queued(e) : ! e->id) {
+            stats.qos_retries++;
+            qos_transmit(e);
+        }
     }
-    publish("info/available", "online", MSG_TYPE_RETAIN_QOS_0);
+    qos_schedule();
 }
 
+void ESP8266MQTTMesh::qos_schedule() {
+    if (qos_used && ! qosRetryScheduled) {
+        qosRetryScheduled = true;
+        qosTimer.once_ms(MESH_QOS_RETRY_MS, qos_retry_static, this);
+    }
+}
 
-bool ESP8266MQTTMesh::send_message(int index, const char *topicOrMsg, const char *msg, uint8_t msgType) {
-    std::string completeMessage = "";
-    if (msgType == 0) {
-        msgType = MSG_TYPE_INVALID;
+void ESP8266MQTTMesh::qos_orphan(int link) {
+    //Messages from a child which disconnected are still delivered, but there is nobody to acknowledge them to
+    for (size_t off = 0; off < qos_used; off += qos_entry_size((mesh_qos_entry_t *)(qos_store + off))) {
+        mesh_qos_entry_t *e = (mesh_qos_entry_t *)(qos_store + off);
+        if (e->from_link == link) {
+            e->from_link = 0;
+        }
     }
-    char msgTypeStr[2];
-    msgTypeStr[0] = msgType;
-    msgTypeStr[1] = '\0';
-    if (index == 0) {
-        //We only send the msgType upstream
-        completeMessage += String(msgTypeStr).c_str();
-    }
-    completeMessage += String(topicOrMsg).c_str();
-    if (msg) {
-        completeMessage += String("=").c_str();
-        completeMessage += String(msg).c_str();
-    }
-    //char c_string[completeMessage.length() + 2];
-    //strcpy(c_string, completeMessage.c_str());
-    //c_string[completeMessage.length()] = '\n';
-    //c_string[completeMessage.length() + 1] = '\0';
-    espClient[index]->write((completeMessage + '\n' + '\0').c_str());
-    dbgPrintln(EMMDBG_WIFI_EXTRA, String("now sending raw Message: ") + completeMessage.c_str());
-    return true;
 }
 
+bool ESP8266MQTTMesh::qos_pending(int link, uint16_t id) {
+    for (size_t off = 0; off < qos_used; off += qos_entry_size((mesh_qos_entry_t *)(qos_store + off))) {
+        mesh_qos_entry_t *e = (mesh_qos_entry_t *)(qos_store + off);
+        if (e->from_link == link && e->from_id == id) {
+            return true;
+        }
+    }
+    return false;
+}
 
-/*
-bool ESP8266MQTTMesh::send_message(int index, const char *topicOrMsg, const char *msg, uint8_t msgType) {
-    char msgTypeStr[2];
-    if (msgType == 0) {
-        msgType = MSG_TYPE_INVALID;
+bool ESP8266MQTTMesh::qos_queued(const mesh_qos_entry_t *e) {
+    return e->tx_cls < MSG_PRIO_COUNT && (int32_t)(txq[0].ring[e->tx_cls].sent - e->tx_end) < 0;
+}
+
+bool ESP8266MQTTMesh::qos_is_dup(int link, uint16_t id) {
+    for (int i = 0; i < MESH_QOS_DEDUP; i++) {
+        if (qos_seen[link-1][i] == id) {
+            return true;
+        }
     }
-    msgTypeStr[0] = msgType;
-    msgTypeStr[1] = 0;
-    if (index == 0) {
-        //We only send the msgType upstream
-        espClient[index]->write(msgTypeStr,1);
+    return false;
+}
+
+void ESP8266MQTTMesh::qos_mark_seen(int link, uint16_t id) {
+    qos_seen[link-1][qos_seen_next[link-1]] = id;
+    qos_seen_next[link-1] = (qos_seen_next[link-1] + 1) % MESH_QOS_DEDUP;
+}
+
+void ESP8266MQTTMesh::send_ack(int link, uint16_t id) {
+    if (espClient[link]) {
+        send_frame(link, MESH_FRAME_ACK, myID, strlen(myID), (const char *)&id, sizeof(id), 0);
     }
-    espClient[index]->write(topicOrMsg);
-    if (msg) {
-        espClient[index]->write("=", 1);
-        espClient[index]->write(msg);
+}
+
+void ESP8266MQTTMesh::subscribe_topic(const char *subtopic, bool subscribe) {
+    char topic[TOPIC_LEN];
+    strlcpy(topic, inTopic, sizeof(topic));
+    strlcat(topic, subtopic, sizeof(topic));
+    strlcat(topic, "#", sizeof(topic));
+    if (subscribe) {
+        mqttClient.subscribe(topic, 0);
+    } else {
+        mqttClient.unsubscribe(topic);
     }
-    espClient[index]->write("\n", 1);
-    return true;
 }
-*/
 
+void ESP8266MQTTMesh::route_subscribe_all(bool subscribe) {
+    //The topics this node and the nodes behind it need
+    subscribe_topic(myID, subscribe);
+    subscribe_topic("broadcast/", subscribe);
+    subscribe_topic("ota/", subscribe);
+    subscribe_topic("fw/", subscribe);
+    for (int i = 0; i < MESH_ROUTE_COUNT; i++) {
+        if (routes[i].link) {
+            route_subscribe(routes[i].id, subscribe);
+        }
+    }
+}
 
-void ESP8266MQTTMesh::broadcast_message(const char *topicOrMsg, const char *msg) {
-    for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
-        if (espClient[i]) {
-            send_message(i, topicOrMsg, msg);
+void ESP8266MQTTMesh::route_wildcard() {
+    //Falls back to all of in_topic, as before there were routes.  Kept until the AP is shut down and the table is empty
+    if (routeWildcard) {
+        return;
+    }
+    dbgPrintln(EMMDBG_MQTT, "Route table can't cover every node, subscribing to all of " + String(inTopic));
+    if (mqttClient.connected()) {
+        subscribe_topic("");
+        //Overlapping subscriptions could get a message delivered more than once
+        route_subscribe_all(false);
+    }
+    routeWildcard = true;
+}
+
+void ESP8266MQTTMesh::route_subscribe(uint32_t id, bool subscribe) {
+    //Only the node connected to the broker subscribes on behalf of its subtree
+    if (meshConnect || ! mqttClient.connected() || routeWildcard) {
+        return;
+    }
+    char topic[TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "%s%06X/#", inTopic, (unsigned)id);
+    if (subscribe) {
+        mqttClient.subscribe(topic, 0);
+    } else {
+        mqttClient.unsubscribe(topic);
+    }
+}
+
+void ESP8266MQTTMesh::route_drop_link(int link) {
+    for (int i = 0; i < MESH_ROUTE_COUNT; i++) {
+        if (routes[i].link == link) {
+            route_drop(link, routes[i].id);
         }
     }
 }
 
-void ESP8266MQTTMesh::handle_client_data(int idx, char *rawdata) {
-            dbgPrintln(EMMDBG_MQTT_EXTRA, "Received: msg from " + espClient[idx]->remoteIP().toString() + " on " + (idx == 0 ? "STA" : "AP"));
-            const char *data = rawdata + (idx ? 1 : 0); //packages from other Modules use the first bit as an Message Type
-            dbgPrintln(EMMDBG_MQTT_EXTRA, "--> '" + String(data) + "'");
-            char topic[64];
-            const char *msg;
-            if (! keyValue(data, '=', topic, sizeof(topic), &msg)) {
-                dbgPrintln(EMMDBG_MQTT, "Failed to handle message");
+void ESP8266MQTTMesh::handle_client_data(int idx, const mesh_hdr_t *hdr, const char *topic, const char *msg) {
+    const mesh_origin_t *origin = (const mesh_origin_t *)find_opt(hdr, MESH_FLAG_ORIGIN);
+    const mesh_frag_t *frag = (const mesh_frag_t *)find_opt(hdr, MESH_FLAG_FRAG);
+    uint16_t msg_id = opt_u16(hdr, MESH_FLAG_MSGID);
+    if (frag && ! origin) {
+        dbgPrintf(EMMDBG_MSG, "Dropping fragment without origin on link %d: %s", idx, topic);
+        return;
+    }
+    if (frag && frag_is_dup(origin, frag, hdr->payload_len)) {
+        dbgPrintf(EMMDBG_MSG, "Dropping duplicate fragment %08X:%u on link %d: %s", origin->id, origin->seq, idx, topic);
+        stats.rx_duplicates++;
+        return;
+    }
+    if (origin && ! frag && origin_is_dup(origin)) {
+        //Seen before, e.g. resent after a parent change.  Nothing is parsed or forwarded twice
+        dbgPrintf(EMMDBG_MSG, "Dropping duplicate %08X:%u on link %d: %s", origin->id, origin->seq, idx, topic);
+        stats.rx_duplicates++;
+        if (idx > 0 && msg_id && ! qos_pending(idx, msg_id)) {
+            //This node already has the message, either on the broker or in its own QoS store
+            send_ack(idx, msg_id);
+        }
+        return;
+    }
+    if (origin && ! frag && ! msg_id) {
+        //QoS messages are only marked once they are safely stored, so a copy resent because the store was full is not lost
+        origin_mark_seen(origin);
+    }
+    if (MESH_IS_CONTROL(hdr->msgType)) {
+        handle_control(idx, hdr, topic, msg);
+        return;
+    }
+    dbgPrintf(EMMDBG_MQTT_EXTRA, "Received: msg on %s %d", idx == 0 ? "STA" : "AP", idx);
+    if (idx > 0) {
+        route_learn(idx, topic, frag ? NULL : msg, hdr->payload_len, opt_u16(hdr, MESH_FLAG_COMPRESSED));
+    }
+    dbgPrintf(EMMDBG_MQTT_EXTRA, "--> '%s=%.*s'", topic, (int)hdr->payload_len, msg);
+    if (idx == 0) {
+        //This is a packet from MQTT, pass it on to the children which need it
+        if (frag) {
+            frag_downstream(topic, msg, hdr->payload_len, frame_prio(hdr), origin, frag);
+            return;
+        }
+        forward_downstream(topic, msg, hdr->payload_len, frame_prio(hdr), origin);
+        parse_message(topic, msg, hdr->payload_len);
+    } else {
+        uint16_t raw_len = opt_u16(hdr, MESH_FLAG_COMPRESSED);
+        uint8_t prio = frame_prio(hdr);
+        if (frag) {
+            //Relayed piece by piece, only the node connected to the broker puts the message back together
+            if (meshConnect) {
+                send_frame(0, hdr->msgType, topic, strlen(topic), msg, hdr->payload_len, node_prefix_len(topic), raw_len, 0, prio, origin, frag);
+            } else {
+                size_t len;
+                const char *payload = expand_payload(msg, hdr->payload_len, raw_len, &len);
+                if (payload) {
+                    frag_reassemble(topic, payload, len, hdr->msgType, origin, frag);
+                }
+            }
+            return;
+        }
+        //The child resent a message before getting our acknowledgement.  One still in our store is acknowledged once the
+        //broker has it, however long ago it arrived.  Otherwise repeat the acknowledgement if the broker already has it
+        bool pending = msg_id && qos_pending(idx, msg_id);
+        if (pending || (msg_id && qos_is_dup(idx, msg_id))) {
+            if (! pending) {
+                send_ack(idx, msg_id);
+            }
+            return;
+        }
+        if (! meshConnect) {
+            size_t len;
+            const char *payload = expand_payload(msg, hdr->payload_len, raw_len, &len);
+            if (! payload) {
+                dbgPrintf(EMMDBG_MQTT, "Dropping message with corrupt payload: %s", topic);
                 return;
             }
-            if (idx == 0) {
-                //This is a packet from MQTT, need to rebroadcast to each connected station
-                broadcast_message(data);
-                parse_message(topic, msg);
+            if (! msg_id) {
+                broker_send(topic, payload, len, hdr->msgType);
+            } else if (qos_add(idx, msg_id, hdr->msgType, topic, payload, len, 0, 0, prio, origin)) {
+                qos_mark_seen(idx, msg_id);
+                origin_mark_seen(origin);
             } else {
-                unsigned char msgType = rawdata[0];
-                if (strstr(topic,"/mesh_cmd")  == topic + strlen(topic) - 9) {
-                    // We will handle this packet locally
-                    // TODO: implement proper Routing instead of broadcasting each Package! connected Modules can communicate with this one by using the Topic "/mesh_cmd/..."
-                    dbgPrintln(EMMDBG_MQTT, "received unknown Mesh Command from connected Node");
-                } else {
-                    if (! meshConnect) {
-                        mqtt_publish(topic, msg, msgType);
-                    } else {
-                        send_message(0, data, NULL, msgType);
-                    }
-                }
+                dbgPrintf(EMMDBG_MQTT, "QoS store is full, %s will be resent by the child", topic);
             }
+        } else {
+            //Compressed payloads are relayed as they are. The payload length is already known, so forward without re-measuring it
+            if (! msg_id) {
+                send_frame(0, hdr->msgType, topic, strlen(topic), msg, hdr->payload_len, node_prefix_len(topic), raw_len, 0, prio, origin);
+            } else if (qos_add(idx, msg_id, hdr->msgType, topic, msg, hdr->payload_len, node_prefix_len(topic), raw_len, prio, origin)) {
+                qos_mark_seen(idx, msg_id);
+                origin_mark_seen(origin);
+            } else {
+                dbgPrintf(EMMDBG_MQTT, "QoS store is full, %s will be resent by the child", topic);
+            }
+        }
+    }
 }
 
-uint16_t ESP8266MQTTMesh::mqtt_publish(const char *topic, const char *msg, uint8_t msgType)
+uint16_t ESP8266MQTTMesh::mqtt_publish(const char *topic, const char *msg, size_t msg_len, uint8_t msgType)
 {
     uint8_t qos = 0;
     bool retain = false;
@@ -816,7 +3303,80 @@ uint16_t ESP8266MQTTMesh::mqtt_publish(const char *topic, const char *msg, uint8
     {
         qos = msgType - MSG_TYPE_QOS_0;
     }
-    return mqttClient.publish(topic, qos, retain, msg);
+    //A zero length would make AsyncMqttClient measure msg, which need not be NUL terminated
+    return mqttClient.publish(topic, qos, retain, msg_len ? msg : "", msg_len);
+}
+
+bool ESP8266MQTTMesh::broker_send(const char *topic, const char *msg, size_t msg_len, uint8_t msgType) {
+    //Messages wait in brokerq while the connection to the broker has no room for them, and the ones after them
+    //wait behind them so that they reach the broker in order
+    if (! brokerq.used && mqtt_publish(topic, msg, msg_len, msgType)) {
+        return true;
+    }
+    mesh_store_rec_t rec = {};
+    size_t topic_len = strlen(topic);
+    size_t size = sizeof(rec) + topic_len + msg_len;
+    if (topic_len >= TOPIC_LEN || ! rx_pool_count || size >= rx_pool_size) {
+        //Held messages are handed to the broker from a receive buffer
+        dbgPrintf(EMMDBG_MQTT, "Dropping message which is too large to hold for the broker: %s", topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    size_t room = brokerq.buf ? brokerq.size - brokerq.used : 0;
+    if (! txRelay) {
+        //What our children were granted is kept for their messages
+        size_t granted = credit_granted();
+        room = room > granted ? room - granted : 0;
+    }
+    if (size > room) {
+        dbgPrintf(EMMDBG_MQTT, "Dropping message because the queue for the broker is full: %s", topic);
+        stats.tx_dropped++;
+        return false;
+    }
+    rec.payload_len = msg_len;
+    rec.msgType = msgType;
+    rec.topic_len = topic_len;
+    ring_write(&brokerq, &rec, sizeof(rec));
+    ring_write(&brokerq, topic, topic_len);
+    ring_write(&brokerq, msg, msg_len);
+    brokerq.frames++;
+    if (! brokerDrainScheduled) {
+        brokerDrainScheduled = true;
+        brokerTimer.once_ms(MESH_BROKER_POLL_MS, broker_drain_static, this);
+    }
+    return true;
+}
+
+void ESP8266MQTTMesh::broker_drain() {
+    //AsyncMqttClient doesn't tell when its connection has room again, so this polls while messages are held
+    char *buf = brokerq.used ? rx_lease() : NULL;
+    bool sent = false;
+    while (buf && brokerq.used && mqttClient.connected()) {
+        mesh_store_rec_t rec;
+        char topic[TOPIC_LEN];
+        ring_peek(&brokerq, &rec, sizeof(rec));
+        size_t size = sizeof(rec) + rec.topic_len + rec.payload_len;
+        ring_peek(&brokerq, buf, size);
+        memcpy(topic, buf + sizeof(rec), rec.topic_len);
+        topic[rec.topic_len] = '\0';
+        if (! mqtt_publish(topic, buf + sizeof(rec) + rec.topic_len, rec.payload_len, rec.msgType)) {
+            break;
+        }
+        brokerq.tail = (brokerq.tail + size) % brokerq.size;
+        brokerq.used -= size;
+        brokerq.sent += size;
+        brokerq.frames--;
+        sent = true;
+    }
+    rx_release(buf);
+    if (sent) {
+        //Room was made for our children
+        credit_service();
+    }
+    if (brokerq.used && mqttClient.connected() && ! brokerDrainScheduled) {
+        brokerDrainScheduled = true;
+        brokerTimer.once_ms(MESH_BROKER_POLL_MS, broker_drain_static, this);
+    }
 }
 
 bool ESP8266MQTTMesh::keyValue(const char *data, char separator, char *key, int keylen, const char **value) {
@@ -850,7 +3410,7 @@ void ESP8266MQTTMesh::get_fw_string(char *msg, int len, const char *prefix)
     strlcat(msg, id, len);
 }
 
-void ESP8266MQTTMesh::handle_fw(const char *cmd) {
+void ESP8266MQTTMesh::handle_fw(const char * /*cmd*/) {
     // int len;
     // if(strstr(cmd, myID) == cmd) {
     //     len = strlen(myID);
@@ -943,8 +3503,8 @@ void ESP8266MQTTMesh::erase_sector() {
     }
 }
 
-void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
-    dbgPrintln(EMMDBG_OTA_EXTRA, "OTA cmd " + String(cmd) + " Length: " + String(strlen(msg)));
+void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg, size_t len) {
+    dbgPrintln(EMMDBG_OTA_EXTRA, "OTA cmd " + String(cmd) + " Length: " + String(len));
     if(strstr(cmd, myID) == cmd) {
         cmd += strlen(myID);
     } else {
@@ -958,12 +3518,16 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
     }
     if(0 == strcmp(cmd, "start")) {
         dbgPrintln(EMMDBG_OTA_EXTRA, "OTA Start");
-        parse_ota_info(msg);
+        char info[128];
+        size_t info_len = len < sizeof(info) - 1 ? len : sizeof(info) - 1;
+        memcpy(info, msg, info_len);
+        info[info_len] = '\0';
+        parse_ota_info(info);
         if (ota_info.len == 0) {
             dbgPrintln(EMMDBG_OTA, "Ignoring OTA because firmware length = 0");
             return;
         }
-        dbgPrintln(EMMDBG_OTA, "-> " + String(msg));
+        dbgPrintln(EMMDBG_OTA, "-> " + String(info));
         if (ota_info.len > freeSpaceEnd - freeSpaceStart) {
             dbgPrintln(EMMDBG_MSG, "Not enough space for firmware: " + String(ota_info.len) + " > " + String(freeSpaceEnd - freeSpaceStart));
             return;
@@ -975,8 +3539,8 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
         schedule.once<void (*)(ESP8266MQTTMesh*), ESP8266MQTTMesh*>(0.0, erase_sector, this);
     }
     else if(0 == strcmp(cmd, "check")) {
-        if (strlen(msg) > 0) {
-            char *out = md5((uint8_t *)msg, strlen(msg));
+        if (len > 0) {
+            char *out = md5((uint8_t *)msg, len);
             publish("ota/check", out);
         } else {
             const char *md5ok = check_ota_md5() ? "MD5 Passed" : "MD5 Failed";
@@ -1001,8 +3565,8 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
         // If this is a broadcast OTA update, this would never go through
         //publish("ota/flash", "Success");
 
-        shutdown_AP();
         p2pConnected = false;
+        shutdown_AP();
         mqttClient.disconnect();
         delay(100);
         ESP.restart();
@@ -1015,7 +3579,7 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
             dbgPrintln(EMMDBG_MSG, "Illegal address " + String(address) + " specified");
             return;
         }
-        int msglen = strlen(msg);
+        int msglen = len;
         if (msglen > 1024) {
             dbgPrintln(EMMDBG_MSG, "Message length " + String(msglen) + " too long");
             return;
@@ -1041,44 +3605,41 @@ void ESP8266MQTTMesh::handle_ota(const char *cmd, const char *msg) {
 }
 #endif //HAS_OTA
 
-void ESP8266MQTTMesh::onWifiConnect(const WiFiEventStationModeGotIP& event) {
+void ESP8266MQTTMesh::onWifiAssociated(const WiFiEventStationModeConnected& event) {
+    dbgPrintln(EMMDBG_WIFI_EXTRA, "Associated on channel " + String(event.channel));
+    if (! switching) {
+        conn_state_set(MESH_STATE_DHCP);
+    }
+}
+
+void ESP8266MQTTMesh::onWifiConnect(const WiFiEventStationModeGotIP& /*event*/) {
     do_blink = false and blink_status;
+    if (! switching) {
+        conn_state_set(MESH_STATE_LINK);
+    }
     
     // when connecting to the Mesh, not the direct Connection
     if (meshConnect) {
-        dbgPrintln(EMMDBG_WIFI, "Connecting to mesh: " + WiFi.gatewayIP().toString() + " on port: " + String(mesh_port));
-#if ASYNC_TCP_SSL_ENABLED
-        espClient[0]->connect(WiFi.gatewayIP(), mesh_port, mesh_secure.cert ? true : false);
-#else
-        espClient[0]->connect(WiFi.gatewayIP(), mesh_port);
-#endif
-#ifdef ESP32
-        schedule.once<ESP8266MQTTMesh*> (5000, checkConnectionEstablished_static, this);
-#else
-        schedule.once<void (*)(ESP8266MQTTMesh*), ESP8266MQTTMesh*> (5000, checkConnectionEstablished_static, this);
-#endif
-        bufptr[0] = inbuffer[0];
+        link_connect();
     } else {
         dbgPrintln(EMMDBG_WIFI, "Connecting to mqtt");
         connect_mqtt();
     }
 }
 
-void ESP8266MQTTMesh::checkConnectionEstablished() {
-    if(!connected()){
-        dbgPrintln(EMMDBG_WIFI, "restarting because tried to accomplish p2p Connection, but Connection wasn't astablished.");
-        die();
-        while(true){}
-    }
-}
-
 
 void ESP8266MQTTMesh::onWifiDisconnect(const WiFiEventStationModeDisconnected& event) {
+    if (switching) {
+        //Leaving the old parent.  switch_timeout() takes over if the new one does not work out
+        dbgPrintln(EMMDBG_WIFI, "Left parent while switching: " + String(event.reason));
+        return;
+    }
     do_blink = true and blink_status;
+    conn_state_set(MESH_STATE_SCANNING);
     
     //Reasons are here: ESP8266WiFiType.h-> WiFiDisconnectReason
     if (! connectScheduled) {
-        schedule_connect(2.0);
+        schedule_connect(backoff(&backoff_wifi));
     }
     dbgPrintln(EMMDBG_WIFI, "Disconnected from Wi-Fi: " + event.ssid + " because: " + String(event.reason));
     if (alreaddyDisconnected){ //prevent the Function to fire multiple times on a single Disconnect
@@ -1091,15 +3652,7 @@ void ESP8266MQTTMesh::onWifiDisconnect(const WiFiEventStationModeDisconnected& e
         // we'll be booted and should try again
         retry_connect--;
     } else{
-        if (ap_ptr != NULL){
-            if (ap_ptr->next != NULL){
-                ap_ptr = ap_ptr->next;
-            }else{
-                ap_ptr = NULL;
-            }
-        }else{
-            ap_ptr = NULL;
-        }
+        ap_next();
     }
 }
 
@@ -1115,8 +3668,9 @@ void ESP8266MQTTMesh::onAPDisconnect(const WiFiEventSoftAPModeStationDisconnecte
     dbgPrintln(EMMDBG_WIFI, "Got disconnection from Station " + mac_str((uint8_t*)ip.mac));
 }
 
-void ESP8266MQTTMesh::onMqttConnect(bool sessionPresent) {
+void ESP8266MQTTMesh::onMqttConnect(bool /*sessionPresent*/) {
     dbgPrintln(EMMDBG_MQTT, "MQTT Connected");
+    backoff_mqtt = 0;
     /*
     // Once connected, publish an announcement...
     char msg[128];
@@ -1125,13 +3679,25 @@ void ESP8266MQTTMesh::onMqttConnect(bool sessionPresent) {
     //strlcat(publishMsg, WiFi.localIP().toString().c_str(), sizeof(publishMsg));
     publish(outTopic, "", "connect", msg, MSG_TYPE_NONE);
      */
-    // ... and resubscribe
-    char subscribe[TOPIC_LEN];
-    strlcpy(subscribe, inTopic, sizeof(subscribe));
-    strlcat(subscribe, "#", sizeof(subscribe));
-    mqttClient.subscribe(subscribe, 0);
+    if (! brokerq.buf) {
+        brokerq.buf = new uint8_t[MESH_BROKER_QUEUE_SIZE];
+        brokerq.size = MESH_BROKER_QUEUE_SIZE;
+    }
+    broker_drain();
+    // ... and resubscribe to the topics this node and the nodes behind it need
+    qos_resend_all();
+    store_schedule_replay();
+    if (routeWildcard) {
+        subscribe_topic("");
+    } else {
+        route_subscribe_all(true);
+    }
 
+    set_depth(1, WiFi.RSSI());
+    parent_cache_save();
+    switch_done();
     send_connected_msg();
+    conn_online();
     setup_AP();
     wasConnected = true;
 }
@@ -1150,8 +3716,16 @@ void ESP8266MQTTMesh::onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
 #endif
     shutdown_AP();
     p2pConnected = false;
+    mesh_depth = 0;
+    //The rest of a message which was arriving in pieces won't come
+    rx_release(mqtt_rx);
+    mqtt_rx = NULL;
     if (WiFi.isConnected()) {
-        connect_mqtt();
+        conn_state_set(MESH_STATE_LINK);
+        //The broker may just have restarted, and every gateway and router it serves is about to retry
+        uint32_t wait = backoff(&backoff_mqtt);
+        dbgPrintln(EMMDBG_MQTT, "Reconnecting to MQTT in " + String(wait) + "ms");
+        mqttTimer.once_ms(wait, connect_mqtt_static, this);
     }
 }
 
@@ -1169,25 +3743,61 @@ void ESP8266MQTTMesh::onMqttUnsubscribe(uint16_t packetId) {
   Serial.println(packetId);
 }
 
-void ESP8266MQTTMesh::onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
-  if(index + len + 1 > MQTT_MAX_PACKET_SIZE){
-    dbgPrintln(EMMDBG_MQTT_EXTRA, "Message arrived, but was to long, InputBuffer: " + String(MQTT_MAX_PACKET_SIZE) + ", total MSG Length: " + String(total) + ", handled Part Length: " + String(index + len));
-    return;
-  }
+void ESP8266MQTTMesh::onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties /*properties*/, size_t len, size_t index, size_t total) {
   if(index + len > total){
     dbgPrintln(EMMDBG_MQTT_EXTRA, "Message arrived but partial Lengths was bigger then total Length (" + String(index) + String(len) + ">" + String(total) + ")");
     return;
   }
-  memcpy(&inbuffer[0][index], payload, len);
-  inbuffer[0][total] = '\0';
-  if (index + len == total) {
-    dbgPrintln(EMMDBG_MQTT_EXTRA, "Message arrived [" + String(topic) + "] '" + String(inbuffer[0]) + "'");
-    broadcast_message(topic, inbuffer[0]);
-    parse_message(topic, inbuffer[0]);
+  bool fits = MESH_HDR_MAX + strlen(topic) + total <= MESH_FRAME_MAX;
+  if (fits && index == 0 && len == total) {
+    //Arrived whole, so it is passed on from where it lies
+    dbgPrintf(EMMDBG_MQTT_EXTRA, "Message arrived [%s] '%.*s'", topic, (int)total, payload);
+    forward_downstream(topic, payload, total, MSG_PRIO_AUTO, NULL);
+    parse_message(topic, payload, total);
+    return;
+  }
+  if (fits && total < rx_pool_size) {
+    //Split over several TCP segments.  It is put back together in a receive buffer and passed on whole, which costs
+    //neither fragments nor heap
+    if (index == 0) {
+      rx_release(mqtt_rx);
+      mqtt_rx = rx_lease();
+      if (! mqtt_rx) {
+        dbgPrintln(EMMDBG_MQTT, "Message arrived in pieces, but no receive buffer is free.  Passing it on in fragments");
+      }
+    }
+    if (mqtt_rx) {
+      memcpy(mqtt_rx + index, payload, len);
+      if (index + len < total) {
+        return;
+      }
+      char *msg = mqtt_rx;
+      mqtt_rx = NULL;
+      msg[total] = '\0';
+      dbgPrintf(EMMDBG_MQTT_EXTRA, "Message arrived [%s] '%s'", topic, msg);
+      forward_downstream(topic, msg, total, MSG_PRIO_AUTO, NULL);
+      parse_message(topic, msg, total);
+      rx_release(msg);
+      return;
+    }
+  }
+  //Too large for a frame, or no receive buffer was free for it.  Each chunk is passed on in fragments as soon as it
+  //arrives instead of after the whole message, and only kept here if this node needs all of it
+  if (index == 0) {
+    origin_new(&mqtt_origin);
+    dbgPrintln(EMMDBG_MQTT_EXTRA, "Message arrived in pieces, total MSG Length: " + String(total));
+  }
+  for (size_t off = 0; off < len; off += MESH_FRAG_SIZE) {
+    size_t n = len - off < MESH_FRAG_SIZE ? len - off : MESH_FRAG_SIZE;
+    mesh_frag_t frag = { (uint32_t)total, (uint32_t)(index + off) };
+    frag_downstream(topic, payload + off, n, MSG_PRIO_AUTO, &mqtt_origin, &frag);
   }
 }
 
 void ESP8266MQTTMesh::onMqttPublish(uint16_t packetId) {
+  if (! meshConnect) {
+    qos_complete(packetId);
+  }
   //Serial.println("Publish acknowledged.");
   //Serial.print("  packetId: ");
   //Serial.println(packetId);
@@ -1216,12 +3826,24 @@ void ESP8266MQTTMesh::onClient(AsyncClient* c) { //when other Node connects to t
     for (int i = 1; i <= ESP8266_NUM_CLIENTS; i++) {
         if (! espClient[i]) {
             espClient[i] = c;
-            espClient[i]->onDisconnect([this](void * arg, AsyncClient *c)                           { this->onDisconnect(c);      }, this);
-            espClient[i]->onError(     [this](void * arg, AsyncClient *c, int8_t error)             { this->onError(c, error);    }, this);
-            espClient[i]->onAck(       [this](void * arg, AsyncClient *c, size_t len, uint32_t time){ this->onAck(c, len, time);  }, this);
-            espClient[i]->onTimeout(   [this](void * arg, AsyncClient *c, uint32_t time)            { this->onTimeout(c, time);   }, this);
-            espClient[i]->onData(      [this](void * arg, AsyncClient *c, void* data, size_t len)   { this->onData(c, data, len); }, this);
-            bufptr[i] = inbuffer[i];
+            espClient[i]->onDisconnect([this](void * /*arg*/, AsyncClient *c)                           { this->onDisconnect(c);      }, this);
+            espClient[i]->onError(     [this](void * /*arg*/, AsyncClient *c, int8_t error)             { this->onError(c, error);    }, this);
+            espClient[i]->onAck(       [this](void * /*arg*/, AsyncClient *c, size_t len, uint32_t time){ this->onAck(c, len, time);  }, this);
+            espClient[i]->onTimeout(   [this](void * /*arg*/, AsyncClient *c, uint32_t time)            { this->onTimeout(c, time);   }, this);
+            espClient[i]->onData(      [this, i](void * /*arg*/, AsyncClient *c, void* data, size_t len){ this->onData(i, c, data, len); }, this);
+            rx_reset(i);
+            memset(rx_alias[i-1], 0, sizeof(rx_alias[i-1]));
+            memset(qos_seen[i-1], 0, sizeof(qos_seen[i-1]));
+            memset(&credits[i-1], 0, sizeof(mesh_credit_t));
+            if (! txq_alloc(i)) {
+                dbgPrintln(EMMDBG_WIFI, "Discarding client connection from: " + c->remoteIP().toString() + " because its TX queue could not be allocated");
+                espClient[i] = NULL;
+                c->close(1);
+                delete c;
+                return;
+            }
+            send_hello(i);
+            advertise();
             return;
         }
     }
@@ -1233,6 +3855,7 @@ void ESP8266MQTTMesh::onClient(AsyncClient* c) { //when other Node connects to t
 void ESP8266MQTTMesh::onConnect(AsyncClient* c) { //when this Node itself get a connection, not if a nother Node logs into this AP!
     dbgPrintln(EMMDBG_WIFI, "Connected to mesh");
     p2pConnected = true;
+    uplink_reset();
 #if ASYNC_TCP_SSL_ENABLED
     if (mesh_secure.cert) {
         SSL* clientSsl = c->getSSL();
@@ -1253,11 +3876,28 @@ void ESP8266MQTTMesh::onConnect(AsyncClient* c) { //when this Node itself get a
             return;
         }
     }
+#else
+    (void)c;
 #endif
+    //A new parent knows none of our aliases.  The ones queued frames still use are defined again ahead of them, the
+    //others on their next use
+    for (int i = 0; i < MESH_ALIAS_COUNT; i++) {
+        tx_alias[i].pending = tx_alias[i].refs > 0;
+        if (! tx_alias[i].refs) {
+            tx_alias[i].len = 0;
+        }
+    }
+    //Send whatever was queued while the link was down before the announcements
+    flush_tx(0);
+    qos_resend_all();
+    store_schedule_replay();
+    parent_cache_save();
+    switch_done();
     char msg[128];
     get_fw_string(msg, sizeof(msg), "Connected");
     publish(outTopic, "", "connect", msg, MSG_TYPE_NONE);
     send_connected_msg();
+    conn_online();
     setup_AP();
     wasConnected = true;
 }
@@ -1265,8 +3905,29 @@ void ESP8266MQTTMesh::onConnect(AsyncClient* c) { //when this Node itself get a
 void ESP8266MQTTMesh::onDisconnect(AsyncClient* c) {
     if (c == espClient[0]) {
         dbgPrintln(EMMDBG_WIFI, "Disconnected from mesh");
-        shutdown_AP();
         p2pConnected = false;
+        uplink_reset();
+        rx_reset(0);
+        //Anything still queued is kept and sent once we are connected again
+        txq_drop_partial(0);
+        if (switching) {
+            //Our children stay with us while we move to a new parent
+            return;
+        }
+        if (conn_state == MESH_STATE_LINK) {
+            //Not online through this parent yet, so there is no subtree to take down.  Retry, and only give up on
+            //the parent once the retries are used up
+            if (! linkRetryPending) {
+                if (link_retries < MESH_LINK_RETRIES) {
+                    link_retry();
+                } else {
+                    conn_fail();
+                }
+            }
+            return;
+        }
+        shutdown_AP();
+        mesh_depth = 0;
         WiFi.disconnect();
         return;
     }
@@ -1275,6 +3936,14 @@ void ESP8266MQTTMesh::onDisconnect(AsyncClient* c) {
             dbgPrintln(EMMDBG_WIFI, "Disconnected Client from this AP");
             delete espClient[i];
             espClient[i] = NULL;
+            txq_free(i);
+            rx_reset(i);
+            route_drop_link(i);
+            qos_orphan(i);
+            //Its unused credit can go to the other children
+            memset(&credits[i-1], 0, sizeof(mesh_credit_t));
+            credit_service();
+            advertise();
             return;
         }
     }
@@ -1284,14 +3953,18 @@ void ESP8266MQTTMesh::onError(AsyncClient* c, int8_t error) {
     dbgPrintln(EMMDBG_WIFI, "Got error on " + c->remoteIP().toString() + ": " + String(error));
 }
 void ESP8266MQTTMesh::onAck(AsyncClient* c, size_t len, uint32_t time) {
-    dbgPrintln(EMMDBG_WIFI_EXTRA, "Got ack on " + c->remoteIP().toString() + ": " + String(len) + " / " + String(time));
+    dbgPrintf(EMMDBG_WIFI_EXTRA, "Got ack: %u / %u", (unsigned)len, (unsigned)time);
+    int idx = client_index(c);
+    if (idx > 0 || (idx == 0 && ! txFlushScheduled)) {
+        flush_tx(idx);
+    }
 }
 
 void ESP8266MQTTMesh::onTimeout(AsyncClient* c, uint32_t time) {
     if(espClient[0] == c){ //Main Mesh Connection got Timeout
         dbgPrintln(EMMDBG_WIFI, "main Connection timed Out : " + String(time));
-        shutdown_AP();
         p2pConnected = false;
+        shutdown_AP();
         WiFi.disconnect();
         return;
     }else{ //connected Client timed out
@@ -1300,33 +3973,179 @@ void ESP8266MQTTMesh::onTimeout(AsyncClient* c, uint32_t time) {
     }
 }
 
-void ESP8266MQTTMesh::onData(AsyncClient* c, void* data, size_t len) { //TODO: currently received Package has no String Terminator at the End, fix it!
-    dbgPrintln(EMMDBG_WIFI_EXTRA, "Got data from " + c->remoteIP().toString() + ": " + String((char *)data));
-    for (int idx = meshConnect ? 0 : 1; idx <= ESP8266_NUM_CLIENTS; idx++) {
-        if (espClient[idx] == c) {
-            if(bufptr[idx] + len > inbuffer[idx] + MQTT_MAX_PACKET_SIZE){
-                dbgPrintln(EMMDBG_WIFI, "Bufferoverflow by handling fragmented Packages!!!! FragmentBuffer Adress: " + String(*bufptr[idx]) + ", Buffer Start: " + String(*inbuffer[idx]) + ", Package Length: " + String(len) + ", Max Package Length: " + String(MQTT_MAX_PACKET_SIZE));
-                bufptr[idx] = inbuffer[idx];
-                return;
+static bool valid_frame(const mesh_hdr_t *hdr) {
+    //A frame split across segments is collected in a receive buffer, see onData()
+    return hdr->ver == MESH_FRAME_VER
+        && hdr->hdr_len >= sizeof(mesh_hdr_t)
+        && hdr->hdr_len <= MESH_HDR_MAX
+        && hdr->topic_len > 0
+        && hdr->topic_len < TOPIC_LEN
+        && hdr->hdr_len + hdr->topic_len + hdr->payload_len <= MESH_FRAME_MAX;
+}
+
+static size_t frame_len(const mesh_hdr_t *hdr) {
+    return hdr->hdr_len + hdr->topic_len + hdr->payload_len;
+}
+
+char *ESP8266MQTTMesh::rx_lease(size_t len) {
+    //Leases enough adjacent buffers to hold len bytes, at least one.  They are released together
+    int n = len > rx_pool_size ? (len + rx_pool_size - 1) / rx_pool_size : 1;
+    if (! rx_pool || n > rx_pool_count) {
+        return NULL;
+    }
+    uint32_t mask = n < 32 ? (1UL << n) - 1 : 0xFFFFFFFF;
+    for (int i = 0; i + n <= rx_pool_count; i++) {
+        if (! (rx_pool_used & (mask << i))) {
+            rx_pool_used |= mask << i;
+            rx_pool_span |= (mask << i) & ~(1UL << i);
+            return rx_pool + i * rx_pool_size;
+        }
+    }
+    return NULL;
+}
+
+bool ESP8266MQTTMesh::rx_terminated(const char *msg, size_t len) {
+    //Whether msg lies in a receive buffer and is followed by a NUL.  Payloads collected there usually are
+    return rx_pool && msg >= rx_pool && msg + len < rx_pool + rx_pool_count * rx_pool_size && msg[len] == '\0';
+}
+
+void ESP8266MQTTMesh::rx_release(char *buf) {
+    if (buf) {
+        int i = (buf - rx_pool) / rx_pool_size;
+        rx_pool_used &= ~(1UL << i);
+        while (++i < rx_pool_count && (rx_pool_span & (1UL << i))) {
+            rx_pool_used &= ~(1UL << i);
+            rx_pool_span &= ~(1UL << i);
+        }
+    }
+}
+
+void ESP8266MQTTMesh::rx_reset(int idx) {
+    rx_release(rx[idx].buf);
+    rx[idx].buf = NULL;
+    rx[idx].have = 0;
+    rx[idx].skip = 0;
+}
+
+void ESP8266MQTTMesh::dispatch_frame(int idx, const mesh_hdr_t *hdr, const char *frame) {
+    char topic[TOPIC_LEN];
+    //Credit and topic aliases are sent past the queue, so they cost no credit
+    if (idx > 0 && hdr->msgType != MESH_FRAME_CREDIT && hdr->msgType != MESH_FRAME_ALIAS) {
+        mesh_credit_t *cr = &credits[idx-1];
+        const mesh_alias_t *alias = (const mesh_alias_t *)find_opt(hdr, MESH_FLAG_ALIAS);
+        size_t len = credit_cost(hdr, alias && ! alias->define_len && alias->id < MESH_ALIAS_COUNT ? rx_alias[idx-1][alias->id].len : 0);
+        if (cr->active) {
+            cr->granted = len < cr->granted ? cr->granted - len : 0;
+        }
+    }
+    txRelay = idx > 0;
+    if (decode_topic(idx, hdr, frame + hdr->hdr_len, topic)) {
+        handle_client_data(idx, hdr, topic, frame + hdr->hdr_len + hdr->topic_len);
+    } else {
+        dbgPrintf(EMMDBG_WIFI, "Dropping frame with unknown topic alias from link %d", idx);
+    }
+    txRelay = false;
+    if (idx > 0 && ! meshConnect) {
+        //The broker may have taken the frame, so its credit is free again
+        credit_service();
+    }
+}
+
+void ESP8266MQTTMesh::onData(int idx, AsyncClient* c, void* data, size_t len) {
+    dbgPrintf(EMMDBG_WIFI_EXTRA, "Got %u bytes on link %d", (unsigned)len, idx);
+    if (espClient[idx] != c) {
+        dbgPrintln(EMMDBG_WIFI, "Could not find client");
+        return;
+    }
+    mesh_rx_t *r = &rx[idx];
+    char *dptr = (char *)data;
+    bool bad_frame = false;
+    //A segment often carries several frames, forward them all before flushing
+    txHold++;
+    while (len) {
+        if (r->skip) {
+            //Discard the rest of a frame which could not be buffered
+            size_t count = r->skip < len ? r->skip : len;
+            r->skip -= count;
+            dptr += count;
+            len -= count;
+            continue;
+        }
+        if (r->have == 0 && len >= sizeof(mesh_hdr_t)) {
+            //No partial frame is pending, so a frame which is complete in this segment can be handled where it lies
+            const mesh_hdr_t *frame = (const mesh_hdr_t *)dptr;
+            if (! valid_frame(frame)) {
+                bad_frame = true;
+                break;
             }
-            char *dptr = (char *)data;
-            for (size_t i = 0; i < len; i++) {
-                if(dptr[i] == '\n') { //dptr[i]=='\n' steht immer am Ende eines vollständigen Paketes!
-                    *bufptr[idx]++ = '\0'; //handles fragmented Packages even if a nother client sends Stuff in between
-                    handle_client_data(idx, inbuffer[idx]);
-                    bufptr[idx] = inbuffer[idx];
-                }else{
-                    *bufptr[idx]++ = dptr[i]; //handles fragmented Packages even if a nother client sends Stuff in between
-                }
+            size_t flen = frame_len(frame);
+            if (flen <= len) {
+                //The segment is left as it is, everything after the header goes by the frame's lengths
+                dispatch_frame(idx, frame, dptr);
+                dptr += flen;
+                len -= flen;
+                continue;
             }
-            return;
         }
+        //Frames may be split across (or share) TCP segments, so only take what is needed to complete the current one
+        if (r->have < sizeof(mesh_hdr_t)) {
+            size_t count = sizeof(mesh_hdr_t) - r->have < len ? sizeof(mesh_hdr_t) - r->have : len;
+            memcpy(r->hdr + r->have, dptr, count);
+            r->have += count;
+            dptr += count;
+            len -= count;
+            if (r->have < sizeof(mesh_hdr_t)) {
+                break;
+            }
+            const mesh_hdr_t *hdr = (const mesh_hdr_t *)r->hdr;
+            if (! valid_frame(hdr)) {
+                bad_frame = true;
+                break;
+            }
+            if (frame_len(hdr) < rx_pool_size) {
+                r->buf = rx_lease();
+            }
+            if (! r->buf) {
+                dbgPrintf(EMMDBG_WIFI, "No receive buffer for a %u byte frame from link %d, dropping it", (unsigned)frame_len(hdr), idx);
+                stats.rx_dropped++;
+                r->skip = frame_len(hdr) - sizeof(mesh_hdr_t);
+                r->have = 0;
+                continue;
+            }
+            memcpy(r->buf, r->hdr, sizeof(mesh_hdr_t));
+        }
+        const mesh_hdr_t *hdr = (const mesh_hdr_t *)r->buf;
+        size_t want = frame_len(hdr);
+        size_t count = want - r->have < len ? want - r->have : len;
+        memcpy(r->buf + r->have, dptr, count);
+        r->have += count;
+        dptr += count;
+        len -= count;
+        if (r->have == want) {
+            //Saves the callback a copy, see rx_terminated()
+            r->buf[want] = '\0';
+            dispatch_frame(idx, hdr, r->buf);
+            rx_reset(idx);
+        }
+    }
+    if (bad_frame) {
+        //There is no way to find the next frame boundary, so drop the link and let it reconnect
+        dbgPrintln(EMMDBG_WIFI, "Received invalid frame header, closing connection");
+        rx_reset(idx);
+        //Frames forwarded from the valid part of the segment still have to go out
+        if (! --txHold) {
+            flush_all();
+        }
+        c->close(true);
+        return;
+    }
+    if (! --txHold) {
+        flush_all();
     }
-    dbgPrintln(EMMDBG_WIFI, "Could not find client");
 }
 
 void ESP8266MQTTMesh::setID(const char *id){
-    strncpy (myID, id, sizeof(myID));
+    strlcpy(myID, id, sizeof(myID));
     strlcat(myID, "/", sizeof(myID));
 }
 
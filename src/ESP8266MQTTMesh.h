@@ -61,6 +61,133 @@
   #define ESP8266_NUM_CLIENTS 4 //4 seems to be them maximal Ammount the esp8266 can handle
 #endif
 
+#ifndef MESH_FRAME_MAX
+  #define MESH_FRAME_MAX 640 //Largest frame on a mesh link, counting MESH_HDR_MAX for its header.  Larger messages are sent in fragments.  Must be the same on every node
+#endif
+#if MESH_FRAME_MAX > MQTT_MAX_PACKET_SIZE
+  #error "MESH_FRAME_MAX must not be larger than MQTT_MAX_PACKET_SIZE"
+#endif
+#ifndef MESH_TX_QUEUE_SIZE
+  #define MESH_TX_QUEUE_SIZE 1024 //Bytes queued per mesh link while waiting for TCP window space
+#endif
+#if MESH_TX_QUEUE_SIZE < MESH_FRAME_MAX || MESH_TX_QUEUE_SIZE > 65535
+  #error "MESH_TX_QUEUE_SIZE must hold at least one full frame and be less than 64k"
+#endif
+#ifndef MESH_TX_CONTROL_SIZE
+  #define MESH_TX_CONTROL_SIZE 256 //Bytes of control traffic queued per mesh link, sent ahead of the MESH_TX_QUEUE_SIZE telemetry queue
+#endif
+#ifndef MESH_TX_BULK_SIZE
+  #define MESH_TX_BULK_SIZE MESH_FRAME_MAX //Bytes of bulk traffic queued per mesh link, only allocated while bulk frames wait
+#endif
+#if MESH_TX_BULK_SIZE < MESH_FRAME_MAX || MESH_TX_BULK_SIZE > 65535 || MESH_TX_CONTROL_SIZE > 65535
+  #error "MESH_TX_BULK_SIZE must hold at least one full frame and the TX queues must be less than 64k"
+#endif
+#define MESH_TX_TELEMETRY_WEIGHT 4 //Telemetry frames sent for each bulk frame while both are waiting
+#ifndef MESH_ALIAS_COUNT
+  #define MESH_ALIAS_COUNT 4 //Topic prefixes which can be abbreviated on the link towards the broker
+#endif
+#define MESH_ALIAS_LEN 28 //Long enough for the outTopic/inTopic prefix followed by a node ID
+#ifndef MESH_QOS_STORE_SIZE
+  #define MESH_QOS_STORE_SIZE 2048 //Bytes of QoS 1/2 messages kept until the broker has acknowledged them
+#endif
+#if MESH_QOS_STORE_SIZE < MQTT_MAX_PACKET_SIZE || MESH_QOS_STORE_SIZE > 65535
+  #error "MESH_QOS_STORE_SIZE must hold at least one full message and be less than 64k"
+#endif
+#define MESH_QOS_RETRY_MS 5000 //Resend a message towards the broker if it was not acknowledged in this time
+#define MESH_QOS_DEDUP 8 //Message IDs remembered per child to detect retransmissions
+#ifndef MESH_DEDUP_COUNT
+  #define MESH_DEDUP_COUNT 32 //Origin IDs and sequence numbers of recent messages remembered to drop duplicates
+#endif
+#ifndef MESH_STORE_BATCH
+  #define MESH_STORE_BATCH 512 //Messages logged while offline are collected in RAM and written to flash in blocks of this size...
+#endif
+#define MESH_STORE_FLUSH_MS  5000 //...or after this long
+#define MESH_STORE_REPLAY_MS 100  //Interval between batches of logged messages sent once connected again
+#define MESH_STORE_REPLAY_BATCH 4 //Logged messages sent per interval
+#ifndef MESH_FRAG_SIZE
+  #define MESH_FRAG_SIZE 512 //Payload bytes per fragment of a message too large for a single frame
+#endif
+#ifndef MESH_FRAG_MAX
+  #define MESH_FRAG_MAX 8192 //Largest fragmented message reassembled in receive buffers (for the broker, or without a stream callback)
+#endif
+#define MESH_FRAG_SLOTS 2 //Fragmented messages received at the same time
+#define MESH_FRAG_TRACK 4 //Fragmented messages passing through whose progress is remembered to drop duplicate fragments
+#define MESH_FRAG_TIMEOUT_MS 10000 //A fragmented message which made no progress for this long is abandoned
+#ifndef MESH_RTC_OFFSET
+  #define MESH_RTC_OFFSET 32 //RTC user memory block (of 4 bytes) holding the parent cache, after the eboot command used by OTA
+#endif
+#define MESH_PARENT_MAGIC 0x50415245 //Marks a valid parent cache (combined with the mesh password)
+#ifndef MESH_SCAN_MISSES
+  #define MESH_SCAN_MISSES 2 //Scans of the known channels finding nothing before all channels are scanned again
+#endif
+#ifndef MESH_BG_SCAN_MS
+  #define MESH_BG_SCAN_MS 60000 //Interval of the scans for a better parent while connected through the mesh
+#endif
+#define MESH_BG_SCAN_POLL_MS 200 //Check for the results of a background scan this often
+#ifndef MESH_SWITCH_HYSTERESIS
+  #define MESH_SWITCH_HYSTERESIS 20 //A new parent must cost this much less than the current one to switch
+#endif
+#ifndef MESH_SWITCH_RSSI
+  #define MESH_SWITCH_RSSI -80 //Below this (dBm) any cheaper parent is taken
+#endif
+#define MESH_SWITCH_TIMEOUT_MS 10000 //Give up on a new parent which did not connect in this time
+#define MESH_SCAN_CHANNEL_MS 300 //ESP32 only: time spent on each channel of a scan
+#ifndef MESH_AP_COUNT
+  #define MESH_AP_COUNT 8 //Possible parents remembered, the cheapest ones found by the scans
+#endif
+#define MESH_COST_FAIL 20 //Added to the cost of a possible parent for each failed attempt to connect through it
+#ifndef MESH_ASSOC_TIMEOUT_MS
+  #define MESH_ASSOC_TIMEOUT_MS 10000 //Time to associate with a parent before the next one is tried
+#endif
+#ifndef MESH_DHCP_TIMEOUT_MS
+  #define MESH_DHCP_TIMEOUT_MS 10000 //Time to get an address from a parent before the next one is tried
+#endif
+#ifndef MESH_LINK_TIMEOUT_MS
+  #define MESH_LINK_TIMEOUT_MS 5000 //Time for the connection to a parent node once the node has an address
+#endif
+#ifndef MESH_LINK_RETRIES
+  #define MESH_LINK_RETRIES 3 //Connections to a parent node retried before the next parent is tried
+#endif
+#ifndef MESH_BACKOFF_BASE_MS
+  #define MESH_BACKOFF_BASE_MS 500 //Default longest wait before the first retry of a failed connection, doubled for each further one
+#endif
+#ifndef MESH_BACKOFF_CAP_MS
+  #define MESH_BACKOFF_CAP_MS 60000 //Default longest wait before any retry
+#endif
+#define MESH_SCAN_POLL_MS 500 //Check for the results of a scan for a parent this often
+#ifndef MESH_OFFLINE_REBOOT_MS
+  #define MESH_OFFLINE_REBOOT_MS 900000 //Reboot after failing to get online for this long, 0 never
+#endif
+#ifndef MESH_BEACON_COUNT
+  #define MESH_BEACON_COUNT 16 //Advertisements of other nodes remembered from a scan
+#endif
+#define MESH_IE_TYPE 0x4D //First byte of the vendor specific element a node adds to its beacons
+#define MESH_DEPTH_UNKNOWN 3 //Depth assumed for a node which did not advertise one
+#define MESH_COST_HOP 30 //Default parent cost of every hop between this node and the access point
+#define MESH_COST_RSSI_GOOD -70 //Links weaker than this (dBm) add 2 per dB to the default parent cost
+#define MESH_COST_FULL 1000 //Added to the default parent cost of a node which can't take another child
+#ifndef MESH_CREDIT_WINDOW
+  #define MESH_CREDIT_WINDOW 1024 //Most credit a child asks its parent for at once
+#endif
+#ifndef MESH_ROUTE_COUNT
+  #define MESH_ROUTE_COUNT 32 //Node IDs remembered for sending messages from the broker down the right branch
+#endif
+#ifndef MESH_CREDIT_RESERVE
+  #define MESH_CREDIT_RESERVE 256 //Room in the uplink queue never granted to children, kept for this node's own messages
+#endif
+#ifndef MESH_HELLO_WAIT_MS
+  #define MESH_HELLO_WAIT_MS 500 //Hold frames for a new parent's HELLO this long before assuming it does not grant credit
+#endif
+#ifndef MESH_BROKER_QUEUE_SIZE
+  #define MESH_BROKER_QUEUE_SIZE 2048 //Bytes a gateway holds while the connection to the broker has no room
+#endif
+#define MESH_BROKER_POLL_MS 10 //Try to hand held messages to the broker this often
+#if MESH_CREDIT_RESERVE > MESH_TX_QUEUE_SIZE - MESH_FRAME_MAX || MESH_CREDIT_RESERVE > MESH_BROKER_QUEUE_SIZE - MESH_FRAME_MAX
+  #error "MESH_CREDIT_RESERVE must leave room to grant a full frame"
+#endif
+#define MESH_TX_HIGH_WATER (MESH_TX_QUEUE_SIZE * 3 / 4) //Report congestion of the telemetry queue above this level...
+#define MESH_TX_LOW_WATER  (MESH_TX_QUEUE_SIZE / 4)     //...and clear it once drained below this one
+
 enum MSG_TYPE {
     MSG_TYPE_NONE = 0xFE,
     MSG_TYPE_INVALID = 0xFF,
@@ -72,6 +199,286 @@ enum MSG_TYPE {
     MSG_TYPE_RETAIN_QOS_2 = 15,
 };
 
+// Traffic classes.  Every mesh link has a queue per class; control frames are always sent first, and
+// bulk frames get a turn after every MESH_TX_TELEMETRY_WEIGHT telemetry frames
+enum MSG_PRIO {
+    MSG_PRIO_CONTROL = 0,   //Commands for nodes and link management
+    MSG_PRIO_TELEMETRY = 1, //Regular publishes
+    MSG_PRIO_BULK = 2,      //Large transfers such as firmware images
+    MSG_PRIO_AUTO = 0xFF,   //Pick the class from the topic
+};
+#define MSG_PRIO_COUNT 3
+
+enum MESH_STORE_POLICY {
+    MESH_STORE_DROP_OLDEST = 0, //When the offline store is full, discard the oldest half of it
+    MESH_STORE_DROP_NEWEST = 1, //When the offline store is full, discard new messages
+};
+
+#define MESH_FRAME_VER 1
+
+// Every message exchanged between mesh nodes starts with this header.  Optional
+// fields selected by 'flags' are appended to the fixed part and are included in
+// 'hdr_len', so the topic always starts at hdr_len and the payload follows it.
+// Neither the topic nor the payload is NUL terminated on the wire.
+typedef struct __attribute__((packed)) {
+    uint8_t  ver;          // MESH_FRAME_VER
+    uint8_t  hdr_len;      // fixed header + optional fields
+    uint8_t  msgType;      // MSG_TYPE_*
+    uint8_t  flags;
+    uint8_t  topic_len;
+    uint16_t payload_len;
+} mesh_hdr_t;
+
+#define MESH_HDR_MAX 32 //Fixed header plus all optional fields
+#if MESH_FRAG_SIZE + MESH_HDR_MAX + TOPIC_LEN > MESH_FRAME_MAX
+  #error "MESH_FRAG_SIZE must leave room for the header and topic in a frame"
+#endif
+
+// Optional header fields.  They follow the fixed header in the order of their flag bits
+#define MESH_FLAG_ALIAS      0x01 //mesh_alias_t
+#define MESH_FLAG_COMPRESSED 0x02 //uint16_t uncompressed payload length.  The payload is MeshLZ compressed
+#define MESH_FLAG_MSGID      0x04 //uint16_t message ID.  The receiver acknowledges it with MESH_FRAME_ACK
+#define MESH_FLAG_ORIGIN     0x08 //mesh_origin_t.  Identifies a message end to end so that copies of it can be dropped
+#define MESH_FLAG_FRAG       0x10 //mesh_frag_t.  The payload is one piece of a larger message with the same origin
+
+// The top two flag bits are not an optional field.  They carry the traffic class (MSG_PRIO_* + 1, 0 if
+// unknown) so that relays queue a frame in the same class as its sender
+#define MESH_FLAG_PRIO_MASK  0xC0
+#define MESH_FLAG_PRIO(prio) (((prio) + 1) << 6)
+
+// Frame types from MESH_FRAME_CONTROL up to MSG_TYPE_NONE manage the link itself and are never published
+#define MESH_FRAME_CONTROL 0x80
+#define MESH_IS_CONTROL(msgType) ((msgType) >= MESH_FRAME_CONTROL && (msgType) < MSG_TYPE_NONE)
+#define MESH_FRAME_ALIAS   0x80 //Only (re)defines a topic alias
+#define MESH_FRAME_HELLO   0x81 //Sent by a parent to a new child.  Topic is the parent's ID, payload is mesh_hello_t
+#define MESH_FRAME_LEAVE   0x82 //Sent towards the broker when a node left the subtree.  Topic is the node's ID
+#define MESH_FRAME_PEER    0x83 //Message for another node (inTopic + ID + subtopic), delivered without the broker if possible
+#define MESH_FRAME_ACK     0x84 //Sent by a parent once the broker has a message.  Topic is the parent's ID, payload the uint16_t message ID
+#define MESH_FRAME_CREDIT  0x85 //Flow control.  From a child the payload is mesh_credit_req_t, from a parent the uint16_t bytes granted
+#define MESH_FRAME_JOIN    0x86 //Sent towards the broker by a node which moved to a new parent.  Topic is the node's ID, payload the uint32_t IDs behind it
+
+#define MESH_CAP_COMPRESS  0x01 //Accepts compressed payloads
+#define MESH_CAP_CREDIT    0x02 //Grants credit.  Children only send what they were granted
+
+typedef struct __attribute__((packed)) {
+    uint8_t caps;          // MESH_CAP_*
+    uint8_t depth;         // hops between the parent and the access point
+    int8_t  path_rssi;     // weakest link between the parent and the access point
+} mesh_hello_t;
+#define MESH_HELLO_MIN 1 //Older parents only send caps
+
+// Added by every node with its access point up to its beacons and probe responses, so that nodes looking for
+// a parent know more than the signal strength
+typedef struct __attribute__((packed)) {
+    uint8_t type;          // MESH_IE_TYPE
+    uint8_t depth;         // hops between the node and the access point
+    uint8_t free_slots;    // children it can still accept
+    int8_t  path_rssi;     // weakest link between the node and the access point
+    uint8_t subnet;        // second octet of the addresses its access point hands out
+} mesh_beacon_ie_t;
+#define MESH_BEACON_IE_MIN 4 //Older nodes don't send the subnet
+
+typedef struct {
+    uint8_t bssid[6];
+    mesh_beacon_ie_t ie;
+} mesh_beacon_t;
+
+// What is known about a possible parent when ranking the results of a scan
+typedef struct {
+    int8_t  rssi;          // signal of the candidate
+    bool    is_ap;         // an access point from the network list rather than a mesh node
+    bool    advertised;    // false if a mesh node did not advertise the fields below
+    uint8_t depth;         // hops between the candidate and the access point, 0 for the access point itself
+    uint8_t free_slots;    // children it can still accept
+    int8_t  path_rssi;     // weakest link between the candidate and the access point, 0 if none
+    uint8_t subnet;        // second octet of the candidate's subnet, 0 if unknown
+} mesh_parent_info_t;
+
+// A child which has run out of credit asks for at least 'need' bytes (its next frame) and at most 'want'.
+// Whatever is left of its previous grant is given up with the request.
+typedef struct __attribute__((packed)) {
+    uint16_t need;
+    uint16_t want;
+} mesh_credit_req_t;
+
+// Set by the node a message enters the mesh at (the sender, or the node connected to the broker for messages
+// from it) and kept unchanged by every relay
+typedef struct __attribute__((packed)) {
+    uint32_t id;           // chip ID of that node
+    uint16_t seq;          // incremented for every message it sends
+} mesh_origin_t;
+
+// Position of a fragment.  Fragments are sent in order and every one of them carries the full topic, so relays
+// forward them like any other frame; only the final receiver puts them back together
+typedef struct __attribute__((packed)) {
+    uint32_t total;        // length of the whole message
+    uint32_t offset;       // where this fragment's payload starts in it
+} mesh_frag_t;
+
+// Topic prefixes (typically outTopic + node ID) are replaced with a short ID on the way towards the broker.
+// A frame either defines alias 'id' as the first define_len bytes of its (complete) topic, or, when
+// define_len is 0, sends only the part of the topic which follows the prefix.
+typedef struct __attribute__((packed)) {
+    uint8_t id;
+    uint8_t define_len;
+} mesh_alias_t;
+
+typedef struct {
+    uint8_t  len;
+    uint16_t refs;         // frames in the TX queue which still use this alias (sender only)
+    bool     pending;      // to be defined again on a new uplink before any queued frame (sender only)
+    char     prefix[MESH_ALIAS_LEN];
+} mesh_alias_entry_t;
+
+// Ring buffer of complete frames of one traffic class waiting to be handed to a mesh link
+typedef struct {
+    uint8_t  *buf;
+    uint16_t size;
+    uint16_t head;         // next byte to write
+    uint16_t tail;         // next byte to send
+    uint16_t used;
+    uint16_t frames;       // frames which have not started sending yet
+    uint32_t queued;       // bytes ever queued and sent, to tell whether a frame has left
+    uint32_t sent;
+} mesh_ring_t;
+
+// Send queues of a mesh link.  Frames are never interleaved, so the class can only change between frames
+typedef struct {
+    uint8_t     *buf;      // single allocation holding the control and telemetry rings.  The bulk ring has its own
+    mesh_ring_t ring[MSG_PRIO_COUNT];
+    uint8_t     cur;       // class of the frame currently being sent
+    uint8_t     run;       // telemetry frames sent in a row while bulk frames were waiting
+    uint16_t    frame_left; // bytes left of the frame currently being sent
+    uint16_t    spill[MSG_PRIO_COUNT]; // telemetry bytes queued up to the end of the last frame of each class which did not fit its own queue
+    uint8_t     last_cls;  // class the last frame was queued in
+    bool        congested; // telemetry queue above MESH_TX_HIGH_WATER and not yet back under MESH_TX_LOW_WATER
+} mesh_txq_t;
+
+// Credit of a child link, as seen by the parent
+typedef struct {
+    bool     active;       // the child has asked for credit, so it is counted
+    uint16_t granted;      // bytes the child may still send
+    uint16_t need;         // pending request, 0 if none
+    uint16_t want;
+} mesh_credit_t;
+
+// Which child link leads to a node.  Learned from the topics of frames sent towards the broker
+typedef struct {
+    uint32_t id;
+    uint8_t  link;         // 0 if the entry is unused
+    uint32_t seen;         // millis() of the last frame from the node, used to pick an entry to replace
+} mesh_route_t;
+
+// A QoS 1/2 message waiting for the broker's acknowledgement, followed by its topic and payload.
+// Nodes forwarding a message for a child only acknowledge it to the child once their own parent
+// (or the broker) has acknowledged it, so the message is kept until it is safe on the broker.
+typedef struct __attribute__((packed)) {
+    uint16_t id;           // ID on the uplink, or the MQTT packet ID when connected to the broker (0 = not sent)
+    uint16_t from_id;      // ID the message arrived with, or the ID returned by publish()
+    int8_t   from_link;    // child link to acknowledge, -1 if published by this node, 0 if the child is gone
+    uint8_t  msgType;
+    uint8_t  prio;         // MSG_PRIO_*
+    uint8_t  prefix_len;
+    uint8_t  topic_len;
+    uint16_t payload_len;
+    uint16_t raw_len;      // uncompressed payload length if the payload is compressed
+    mesh_origin_t origin;  // kept so that every retransmission is recognised as the same message
+    uint8_t  tx_cls;       // uplink queue holding the last transmission, MSG_PRIO_COUNT if none
+    uint32_t tx_end;       // its 'queued' count once the transmission was queued
+    uint32_t sent;         // millis() of the last transmission
+    uint32_t start;        // millis() when the message was stored
+} mesh_qos_entry_t;
+
+// A fragmented message being received.  buf is only leased when the whole message is needed at once
+typedef struct {
+    mesh_origin_t origin;
+    uint32_t total;        // 0 if the slot is unused
+    uint32_t have;         // bytes received so far, i.e. the offset of the next fragment
+    uint32_t seen;         // millis() of the last fragment
+    char     *buf;         // receive buffers holding the message
+} mesh_frag_rx_t;
+
+// How far a fragmented message passing through has got.  Once complete it joins the other messages in origin_seen
+typedef struct {
+    mesh_origin_t origin;
+    uint32_t next;         // offset following the last fragment, 0 if unused
+} mesh_frag_seen_t;
+
+// A fragmented message passing down to children of which some missed a fragment.  They can't finish it, so they get none
+// of the rest
+typedef struct {
+    mesh_origin_t origin;
+    uint32_t links;        // bitmask of the child links which missed a fragment, 0 if unused
+} mesh_frag_fail_t;
+
+// A message published by this node which is being sent in fragments as the uplink queue drains
+typedef struct {
+    const char *msg;       // payload from offset 'base' on
+    char     *lease;       // receive buffers holding what the uplink queue could not take at once, NULL if none
+    uint32_t base;
+    char     topic[TOPIC_LEN];
+    uint8_t  topic_len;
+    uint8_t  prefix_len;
+    uint8_t  msgType;
+    uint8_t  prio;
+    uint32_t total;        // 0 if nothing is being sent
+    uint32_t offset;
+    mesh_origin_t origin;
+    uint32_t seen;         // when the last fragment was queued
+    bool     feeding;      // queueing fragments, which may flush the uplink and come back here
+} mesh_frag_tx_t;
+
+// Record header of a message in the offline store or held for the broker, followed by its topic and payload
+typedef struct __attribute__((packed)) {
+    uint16_t payload_len;
+    uint8_t  msgType;
+    uint8_t  topic_len;
+    uint8_t  prefix_len;
+    uint8_t  prio;         // MSG_PRIO_*
+    uint16_t id;           // ID publish() returned for a QoS message, reported to the delivery callback
+} mesh_store_rec_t;
+
+#define MESH_RX_POOL_MAX 32 //Reassembly buffers are tracked in a 32 bit mask
+
+// Receive state of a mesh link.  Frames which arrive complete in a single TCP segment are handled in
+// place; a reassembly buffer is only leased from the pool while a frame is split across segments.
+typedef struct {
+    char     *buf;         // leased reassembly buffer, NULL while none is needed
+    uint16_t have;         // bytes of the current frame received so far
+    uint16_t skip;         // bytes of a frame which could not be buffered, still to be discarded
+    char     hdr[sizeof(mesh_hdr_t)]; // header of the current frame until a buffer is leased
+} mesh_rx_t;
+
+// Stages on the way online.  A failure in one of them moves on to the next parent (SCANNING) rather than rebooting
+enum MESH_CONN_STATE {
+    MESH_STATE_SCANNING = 0,  // choosing a parent, scanning if no candidate is left
+    MESH_STATE_ASSOCIATING,   // associating with the parent's AP
+    MESH_STATE_DHCP,          // associated, waiting for an address
+    MESH_STATE_LINK,          // connecting to the parent node (P2P), or to the broker if connected to a WiFi network (MQTT)
+    MESH_STATE_ONLINE,
+};
+#define MESH_CONN_STAGES MESH_STATE_ONLINE //States timed on the way online
+
+typedef struct {
+    uint32_t tx_frames;    // frames queued on a mesh link
+    uint32_t tx_bytes;
+    uint32_t tx_dropped;   // frames which could not be queued
+    uint32_t heap_min;     // lowest free heap seen on the send path
+    uint32_t tx_zsaved;    // payload bytes saved by compression
+    uint32_t rx_dropped;   // frames dropped because no reassembly buffer was available
+    uint32_t qos_retries;  // QoS messages sent again because they were not acknowledged in time
+    uint32_t store_dropped; // messages discarded because the offline store was full or could not be written
+    uint32_t credit_stalls; // times the uplink had to ask its parent for credit
+    uint32_t rx_duplicates; // frames dropped because the same message had already been received
+    uint32_t scans;        // scans for a parent
+    uint32_t scans_full;   // ...of them across all channels
+    uint32_t scan_ms;      // duration of the last scan
+    uint32_t parent_switches; // parents changed to after a background scan
+    uint32_t conn_timeouts; // connection states which timed out
+    uint32_t online_ms;    // time it last took to get online
+    uint32_t store_errors; // writes to the offline store which failed
+} mesh_stats_t;
+
 #if ASYNC_TCP_SSL_ENABLED
     typedef struct {
         const uint8_t *cert;
@@ -89,13 +496,28 @@ enum MSG_TYPE {
     } ota_info_t;
 #endif
 
-typedef struct ap_t {
-    struct ap_t *next;
-    int32_t rssi;
+// A possible parent.  Kept across scans, so that its history counts when candidates are ranked
+typedef struct {
+    int32_t cost;          // from the parent cost function plus MESH_COST_FAIL per failure, lowest is tried first
     uint8_t bssid[6];
+    uint8_t channel;
+    int8_t  rssi;          // averaged over the scans which found it
     int16_t ssid_idx;
+    uint8_t failures;      // attempts to connect through it which failed since it last worked
+    bool    seen;          // found by the latest scan
 } ap_t;
 
+// The last parent this node was online through.  Kept in RTC memory, and in the offline store's filesystem if there is
+// one, so that after a reboot the node can associate with it straight away instead of scanning
+typedef struct {
+    uint32_t magic;        // MESH_PARENT_MAGIC ^ mesh_bssid_key, so that a cache written for another mesh is ignored
+    uint8_t  bssid[6];
+    uint8_t  channel;
+    int8_t   rssi;
+    int16_t  ssid_idx;     // index into the network list, or NETWORK_MESH_NODE
+    uint16_t unused;       // RTC memory is written in 4 byte blocks
+} mesh_parent_cache_t;
+
 typedef struct {
     const char *ssid;
     const char *password;
@@ -108,6 +530,7 @@ typedef struct {
 class ESP8266MQTTMesh {
 public:
     class Builder;
+    friend class ESP8266MQTTMeshSim; //The host simulations in test/host
 private:
     const unsigned int firmware_id;
     const char   *firmware_ver;
@@ -121,6 +544,23 @@ private:
     const int    mqtt_port;
     const int    mesh_port;
     uint32_t     mesh_bssid_key;
+    const uint16_t coalesce_ms;
+    const uint16_t coalesce_bytes;
+    const bool   compress;
+    uint8_t      uplink_caps = 0;  //Capabilities announced by our parent
+    uint8_t      mesh_depth = 0;   //Hops between this node and the access point, 0 while not connected
+    int8_t       path_rssi = 0;    //Weakest link between this node and the access point
+    uint8_t      *zbuf = NULL;     //Scratch space for (de)compressing payloads
+    const uint8_t  rx_pool_count;
+    const uint16_t rx_pool_size;
+    fs::FS         *const store_fs; //Offline store, NULL if disabled
+    const uint32_t store_size;      //Both log segments together
+    const uint8_t  store_policy;
+    const uint32_t backoff_base_ms; //Retries of failed connections wait a random time below base * 2^attempts
+    const uint32_t backoff_cap_ms;  //...and below this
+    uint32_t       backoff_seed = 1;
+    uint8_t        backoff_wifi = 0; //Failed attempts to get online since the node was last online
+    uint8_t        backoff_mqtt = 0; //Failed attempts to connect to the broker since the last success
 
     const char   *inTopic;
     const char   *outTopic;
@@ -144,22 +584,45 @@ private:
     AsyncMqttClient mqttClient;
 
     Ticker schedule;
+    Ticker txTimer;
+    bool txFlushScheduled = false;
+    uint8_t txHold = 0; //While set, queued frames are only flushed once the caller is done
 
     bool connectScheduled = false;
     bool alreaddyDisconnected = false;
     int retry_connect;
-    ap_t *ap = NULL;
-    ap_t *ap_ptr = NULL;
-    ap_t *ap_unused = NULL;
+    ap_t aps[MESH_AP_COUNT] = {}; //Sorted by cost once a scan is complete, the ones found by it first
+    uint8_t ap_count = 0;
+    ap_t *ap_ptr = NULL;          //The candidate being tried or connected to
+    bool parentCacheTried = false; //The cached parent was tried since the node was last online
     char myID[10];
-    char inbuffer[ESP8266_NUM_CLIENTS+1][MQTT_MAX_PACKET_SIZE]; //Buffer for storing Fragmented Packages between Calls
-    char *bufptr[ESP8266_NUM_CLIENTS+1]; //Pointer to inbuffer for handling fragmented Packages
+    mesh_rx_t rx[ESP8266_NUM_CLIENTS+1] = {}; //Partial frame state per link
+    char *rx_pool = NULL;          //rx_pool_count buffers of rx_pool_size bytes, allocated in begin()
+    uint32_t rx_pool_used = 0;     //Bitmask of leased buffers
+    uint32_t rx_pool_span = 0;     //Bitmask of leased buffers which continue the one before them
+    char *mqtt_rx = NULL;          //Receive buffer collecting a message from the broker which arrives in pieces but fits in a frame
 
     bool meshConnect = false; //If Node is connected over the Mesh or directly to the Router
     bool wasConnected = false; //is true if Node was connected and lost connection, false if restarted and hasn't had a connection
     bool p2pConnected = false; //when connected over Mesh, a peer to peer Connection gets established with the connected Node, variable shows if this Connection is ok.
     bool scanning = 0; //if scanning is in progress
+    uint16_t scan_channels = 0; //Channels (bit n for channel n) where parents were found, 0 if none are known
+    uint16_t scan_pending = 0;  //Channels still to be scanned, 0 for a scan of all channels
+    uint16_t scan_seen = 0;     //Channels where the current scan found a parent
+    uint8_t scan_misses = 0;    //Consecutive scans of the known channels which found nothing
+    uint32_t scan_start = 0;
+    bool bgScanning = false;    //A background scan for a better parent is in progress
+    bool switching = false;     //Moving to a new parent while keeping our AP up
+    Ticker bgTimer;
+    uint8_t conn_state = MESH_STATE_SCANNING;
+    uint32_t conn_state_start = 0;
+    uint32_t conn_ms[MESH_CONN_STAGES] = {}; //Time spent in each state since the node was last online
+    uint32_t offline_start = 0;
+    uint8_t link_retries = 0;   //Connections to the current parent node retried, also their backoff attempts
+    bool linkRetryPending = false;
+    Ticker connTimer;
     bool AP_ready = false; //if own Acess point is setup or shutdown
+    uint8_t ap_subnet = 0; //Second octet of our AP's subnet, 0 while it is down
     
     bool blink_status = false; // if true the status_pin is blinked to show connection status
     unsigned long blinkInterval = 500;
@@ -168,6 +631,10 @@ private:
     int status_pin = LED_BUILTIN; // pin used to signal connection status
 
     std::function<void(const char *topic, const char *msg)> callback; //TODO: check out this syntax
+    std::function<void(int link, bool congested)> txWatermarkCallback;
+    std::function<void(uint16_t msgId, uint32_t latency)> deliveryCallback;
+    std::function<void(const char *topic, const char *payload, size_t len, size_t index, size_t total)> streamCallback;
+    std::function<int32_t(const mesh_parent_info_t &candidate)> parentCost;
 
     bool wifiConnected() { return (WiFi.status() == WL_CONNECTED); }
     void die() { ESP.restart(); while(1) {} }
@@ -179,35 +646,200 @@ private:
 
     int match_networks(const char *ssid, const char *bssid);
     void scan();
+    void scan_next();
+    void scan_channel(uint8_t channel);
+    bool scan_result(int i, ap_t *found, mesh_parent_info_t *info);
+    void bg_scan_schedule(uint32_t delay_ms);
+    void bg_scan();
+    static void bg_scan_static(ESP8266MQTTMesh *e) { e->bg_scan(); };
+    void switch_parent(const ap_t *next);
+    void switch_timeout();
+    static void switch_timeout_static(ESP8266MQTTMesh *e) { e->switch_timeout(); };
+    void switch_done();
+    void conn_state_set(uint8_t state);
+    void conn_timeout();
+    static void conn_timeout_static(ESP8266MQTTMesh *e) { e->conn_timeout(); };
+    void conn_fail();
+    void conn_online();
+    void link_connect();
+    static void link_connect_static(ESP8266MQTTMesh *e) { e->link_connect(); };
+    void link_retry();
+    int32_t parent_cost(const mesh_parent_info_t &info);
+    ap_t *ap_slot(const uint8_t *bssid);
+    void ap_update(const ap_t *found, mesh_parent_info_t *info);
+    ap_t *ap_use(const ap_t *found);
+    void ap_sort();
+    void ap_next();
+    void ap_clear();
+    bool parent_cache_load(mesh_parent_cache_t *cache);
+    void parent_cache_save();
+    bool parent_cache_use();
+    void advertise();
+    void set_depth(uint8_t depth, int8_t rssi);
+    void beacon_seen(const uint8_t *bssid, const uint8_t *ie, uint8_t len);
+    const mesh_beacon_ie_t *beacon_find(const uint8_t *bssid);
+    static void beacon_seen_static(user_ie_type type, const uint8_t sa[6], const uint8_t m_oui[3], uint8_t *ie, uint8_t ie_len, int32_t rssi);
     void connect();
     static void connect_static(ESP8266MQTTMesh *e) { e->connect(); };
     String mac_str(uint8_t *bssid);
     const char *build_mesh_ssid(char buf[32], uint8_t *mac);
-    void schedule_connect(float delay = 5.0);
+    uint32_t backoff(uint8_t *attempts);
+    void schedule_connect(uint32_t delay_ms);
     void connect_mqtt();
+    static void connect_mqtt_static(ESP8266MQTTMesh *e) { e->connect_mqtt(); };
     void shutdown_AP();
     void setup_AP();
-    void handle_client_data(int idx, char *data);
-    void HandleMessages(const char *topic, const char *msg);
-    void parse_message(const char *topic, const char *msg);
+    void handle_client_data(int idx, const mesh_hdr_t *hdr, const char *topic, const char *msg);
+    void dispatch_frame(int idx, const mesh_hdr_t *hdr, const char *frame);
+    void HandleMessages(const char *topic, const char *msg, size_t len);
+    void parse_message(const char *topic, const char *msg, size_t len);
     void mqtt_callback(const char* topic, const byte* payload, unsigned int length);
-    uint16_t mqtt_publish(const char *topic, const char *msg, uint8_t msgType);
-    void publish(const char *topicDirection, const char *baseTopic, const char *subTopic, const char *msg, uint8_t msgType);
-    bool send_message(int index, const char *topicOrMsg, const char *msg = NULL, uint8_t msgType = MSG_TYPE_NONE);
+    uint16_t mqtt_publish(const char *topic, const char *msg, size_t msg_len, uint8_t msgType);
+    bool broker_send(const char *topic, const char *msg, size_t msg_len, uint8_t msgType);
+    void broker_drain();
+    static void broker_drain_static(ESP8266MQTTMesh *e) { e->brokerDrainScheduled = false; e->broker_drain(); };
+    uint16_t publish(const char *topicDirection, const char *baseTopic, const char *subTopic, const char *msg, uint8_t msgType, uint8_t prio = MSG_PRIO_AUTO);
+    mesh_stats_t    stats = {0, 0, 0, UINT32_MAX, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    mesh_txq_t      txq[ESP8266_NUM_CLIENTS+1] = {};
+    mesh_alias_entry_t tx_alias[MESH_ALIAS_COUNT] = {};
+    mesh_alias_entry_t rx_alias[ESP8266_NUM_CLIENTS][MESH_ALIAS_COUNT];
+    uint8_t         tx_alias_next = 0;
+    mesh_route_t    routes[MESH_ROUTE_COUNT] = {};
+    bool            routeWildcard = false; //Subscribed to all of in_topic, since a node could not be subscribed by itself
+    mesh_credit_t   credits[ESP8266_NUM_CLIENTS] = {};
+    mesh_origin_t   origin_seen[MESH_DEDUP_COUNT] = {};
+    uint8_t         origin_seen_next = 0;
+    uint16_t        origin_seq = 0;
+    mesh_frag_rx_t  frag_rx[MESH_FRAG_SLOTS] = {};
+    mesh_frag_seen_t frag_seen[MESH_FRAG_TRACK] = {};
+    uint8_t         frag_seen_next = 0;
+    mesh_frag_fail_t frag_fail[MESH_FRAG_TRACK] = {};
+    uint8_t         frag_fail_next = 0;
+    mesh_frag_tx_t  frag_tx = {};
+    mesh_beacon_t   beacons[MESH_BEACON_COUNT] = {};
+    uint8_t         beacons_next = 0;
+    mesh_origin_t   mqtt_origin;             //Origin given to the message being received from the broker in pieces
+    uint8_t         credit_turn = 0;         //Child whose request is served first
+    uint16_t        uplink_credit = 0;       //Bytes we may send to our parent
+    bool            creditRequested = false;
+    bool            uplinkHello = false;     //HELLO received from the parent we are connected to now
+    uint32_t        uplink_since = 0;        //millis() when the uplink last changed
+    bool            txRelay = false;         //Queueing a child's frame, which may use the room granted to the child
+    mesh_ring_t     brokerq = {};            //Messages waiting for room on the connection to the broker
+    Ticker          brokerTimer;
+    bool            brokerDrainScheduled = false;
+    uint8_t         *qos_store = NULL;
+    uint16_t        qos_used = 0;
+    uint16_t        qos_next_id = 0;
+    uint16_t        qos_seen[ESP8266_NUM_CLIENTS][MESH_QOS_DEDUP];
+    uint8_t         qos_seen_next[ESP8266_NUM_CLIENTS] = {};
+    Ticker          qosTimer;
+    bool            qosRetryScheduled = false;
+    uint32_t        store_len[2] = {0, 0};   //Bytes in each log segment including its header, 0 if it does not exist
+    uint16_t        store_count[2] = {0, 0}; //Messages in each log segment (since boot)
+    uint32_t        store_gen = 0;           //Generation of the newest segment, so the oldest is known after a reboot
+    uint8_t         store_wr = 0;            //Segment messages are appended to
+    uint8_t         store_rd = 0;            //Segment being replayed
+    uint32_t        store_rd_pos = sizeof(uint32_t);
+    uint8_t         *store_batch = NULL;
+    uint16_t        store_batch_used = 0;
+    uint16_t        store_batch_count = 0;
+    Ticker          storeTimer;
+    Ticker          mqttTimer;
+    Ticker          replayTimer;
+    bool            storeFlushScheduled = false;
+    bool            storeReplayScheduled = false;
+
+    char *rx_lease(size_t len = 0);
+    bool rx_terminated(const char *msg, size_t len);
+    void rx_release(char *buf);
+    void rx_reset(int idx);
+    bool txq_alloc(int idx);
+    void txq_free(int idx);
+    void txq_drop_partial(int idx);
+    bool txq_start_frame(mesh_txq_t *q);
+    void txq_consume(mesh_txq_t *q, size_t len);
+    void check_watermark(int idx);
+    void flush_tx(int idx);
+    void flush_all();
+    static void flush_uplink_static(ESP8266MQTTMesh *e) { e->txFlushScheduled = false; e->flush_tx(0); };
+    int client_index(AsyncClient *c);
+    void init_hdr(mesh_hdr_t *hdr, uint8_t msgType, size_t topic_len, size_t msg_len);
+    bool write_frame(int index, const mesh_hdr_t *hdr, const char *topic, const char *msg);
+    bool send_frame(int index, uint8_t msgType, const char *topic, size_t topic_len, const char *msg, size_t msg_len, size_t prefix_len, size_t raw_len = 0, uint16_t msg_id = 0, uint8_t prio = MSG_PRIO_AUTO, const mesh_origin_t *origin = NULL, const mesh_frag_t *frag = NULL);
+    bool send_message(int index, const char *topic, const char *msg, uint8_t msgType = MSG_TYPE_NONE, size_t prefix_len = 0);
+    bool send_aliases();
+    uint8_t topic_prio(uint8_t msgType, const char *topic, size_t topic_len);
+    bool decode_topic(int idx, const mesh_hdr_t *hdr, const char *wire, char *topic);
+    const char *expand_payload(const char *msg, size_t msg_len, size_t raw_len, size_t *len);
+    void send_hello(int idx);
+    void handle_control(int idx, const mesh_hdr_t *hdr, const char *topic, const char *msg);
     void send_messages();
     void send_connected_msg();
-    void broadcast_message(const char *topicOrMsg, const char *msg = NULL);
+    void forward_downstream(const char *topic, const char *msg, size_t msg_len, uint8_t prio, const mesh_origin_t *origin, const mesh_frag_t *frag = NULL);
+    void frag_downstream(const char *topic, const char *msg, size_t msg_len, uint8_t prio, const mesh_origin_t *origin, const mesh_frag_t *frag);
+    mesh_frag_rx_t *frag_slot(const mesh_origin_t *origin, const mesh_frag_t *frag, size_t len, bool need_buf);
+    void frag_release(mesh_frag_rx_t *slot);
+    bool frag_needs_whole(const char *topic);
+    void frag_deliver(const char *topic, const char *msg, size_t len, const mesh_origin_t *origin, const mesh_frag_t *frag);
+    void frag_reassemble(const char *topic, const char *msg, size_t len, uint8_t msgType, const mesh_origin_t *origin, const mesh_frag_t *frag);
+    bool frag_send(const char *topic, const char *msg, size_t msg_len, uint8_t msgType, size_t prefix_len, uint8_t prio);
+    void frag_feed();
+    size_t frag_room();
+    void frag_done();
+    const char *local_subtopic(const char *topic);
+    int route_topic(const char *topic);
+    void route_learn(int link, const char *topic, const char *msg, size_t msg_len, size_t raw_len);
+    void route_add(int link, uint32_t id);
+    void route_drop(int link, uint32_t id);
+    void route_drop_link(int link);
+    void route_announce();
+    void route_subscribe(uint32_t id, bool subscribe);
+    void route_subscribe_all(bool subscribe);
+    void route_wildcard();
+    void route_peer(int from, const char *topic, const char *msg, size_t msg_len, const mesh_origin_t *origin = NULL);
+    void origin_new(mesh_origin_t *origin);
+    bool origin_is_dup(const mesh_origin_t *origin);
+    void origin_mark_seen(const mesh_origin_t *origin);
+    bool frag_is_dup(const mesh_origin_t *origin, const mesh_frag_t *frag, size_t len);
+    void credit_request(size_t need);
+    void uplink_reset();
+    void credit_service();
+    uint32_t credit_granted();
+    uint16_t qos_new_id();
+    bool qos_add(int from_link, uint16_t from_id, uint8_t msgType, const char *topic, const char *msg, size_t msg_len, size_t prefix_len, size_t raw_len, uint8_t prio, const mesh_origin_t *origin = NULL);
+    void qos_transmit(mesh_qos_entry_t *e);
+    void qos_complete(uint16_t id);
+    void qos_resend_all();
+    void qos_retry();
+    static void qos_retry_static(ESP8266MQTTMesh *e) { e->qosRetryScheduled = false; e->qos_retry(); };
+    void qos_schedule();
+    void qos_orphan(int link);
+    bool qos_pending(int link, uint16_t id);
+    bool qos_queued(const mesh_qos_entry_t *e);
+    bool qos_is_dup(int link, uint16_t id);
+    void qos_mark_seen(int link, uint16_t id);
+    void send_ack(int link, uint16_t id);
+    uint16_t publish_now(const char *topic, const char *msg, uint8_t msgType, size_t prefix_len, uint8_t prio = MSG_PRIO_AUTO, uint16_t id = 0);
+    bool store_backlog() { return store_batch_used || store_len[0] || store_len[1]; }
+    void store_init();
+    bool store_append(const char *topic, const char *msg, uint8_t msgType, size_t prefix_len, uint8_t prio, uint16_t id);
+    int  store_segment(size_t len);
+    bool store_write(const uint8_t *data, size_t len);
+    void store_flush();
+    static void store_flush_static(ESP8266MQTTMesh *e) { e->storeFlushScheduled = false; e->store_flush(); };
+    void store_remove(int seg);
+    void store_replay();
+    static void store_replay_static(ESP8266MQTTMesh *e) { e->storeReplayScheduled = false; e->store_replay(); };
+    void store_schedule_replay();
+    void subscribe_topic(const char *subtopic, bool subscribe = true);
     void get_fw_string(char *msg, int len, const char *prefix);
     void handle_fw(const char *cmd);
-    void handle_ota(const char *cmd, const char *msg);
+    void handle_ota(const char *cmd, const char *msg, size_t len);
     void parse_ota_info(const char *str);
     char * md5(const uint8_t *msg, int len);
     bool check_ota_md5();
     void assign_subdomain();
-    static void checkConnectionEstablished(ESP8266MQTTMesh *e);
-
-    void checkConnectionEstablished();
-    static void checkConnectionEstablished_static(ESP8266MQTTMesh *e) { e->checkConnectionEstablished(); };
 
     static void assign_subdomain(ESP8266MQTTMesh *e) { e->assign_subdomain(); };
     void erase_sector();
@@ -216,12 +848,14 @@ private:
     void connectWiFiEvents();
 
 #ifndef USE_WIFI_ONEVENT
+    WiFiEventHandler wifiAssocHandler;
     WiFiEventHandler wifiConnectHandler;
     WiFiEventHandler wifiDisconnectHandler;
     WiFiEventHandler wifiAPConnectHandler;
     WiFiEventHandler wifiAPDisconnectHandler;
 #endif
 
+    void onWifiAssociated(const WiFiEventStationModeConnected& event);
     void onWifiConnect(const WiFiEventStationModeGotIP& event);
     void onWifiDisconnect(const WiFiEventStationModeDisconnected& event);
     //void onDHCPTimeout();
@@ -242,24 +876,35 @@ private:
     void onError(AsyncClient* c, int8_t error);
     void onAck(AsyncClient* c, size_t len, uint32_t time);
     void onTimeout(AsyncClient* c, uint32_t time);
-    void onData(AsyncClient* c, void* data, size_t len);
+    void onData(int idx, AsyncClient* c, void* data, size_t len);
 
     ESP8266MQTTMesh(const wifi_conn *networks,
                     const char *mqtt_server, int mqtt_port,
                     const char *mqtt_username, const char *mqtt_password,
                     const char *firmware_ver, int firmware_id,
                     const char *mesh_ssid, const char *mesh_password, int mesh_port,
+                    uint16_t coalesce_ms, uint16_t coalesce_bytes, bool compress,
+                    uint8_t rx_buffers, uint16_t rx_buffer_size,
+                    fs::FS *store_fs, uint32_t store_size, uint8_t store_policy,
+                    uint32_t backoff_base_ms, uint32_t backoff_cap_ms,
 #if ASYNC_TCP_SSL_ENABLED
                     bool mqtt_secure, const uint8_t *mqtt_fingerprint, ssl_cert_t mesh_secure,
 #endif
                     const char *inTopic, const char *outTopic);
 public:
     void setCallback(std::function<void(const char *topic, const char *msg)> _callback);
+    void setTxWatermarkCallback(std::function<void(int link, bool congested)> _callback);
+    void setDeliveryCallback(std::function<void(uint16_t msgId, uint32_t latency)> _callback);
+    void setStreamCallback(std::function<void(const char *topic, const char *payload, size_t len, size_t index, size_t total)> _callback);
+    void setParentCostCallback(std::function<int32_t(const mesh_parent_info_t &candidate)> _callback);
+    static int32_t defaultParentCost(const mesh_parent_info_t &candidate);
     void setType(uint32_t type);
     void begin();
-    void publish(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd = MSG_TYPE_NONE);
-    void publish_node(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd = MSG_TYPE_NONE);
+    uint16_t publish(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd = MSG_TYPE_NONE, enum MSG_PRIO prio = MSG_PRIO_AUTO);
+    uint16_t publish_node(const char *subtopic, const char *msg, enum MSG_TYPE msgCmd = MSG_TYPE_NONE, enum MSG_PRIO prio = MSG_PRIO_AUTO);
+    void sendToNode(const char *id, const char *subtopic, const char *msg);
     bool connected();
+    const mesh_stats_t &getStats() { return stats; }
     static bool keyValue(const char *data, char separator, char *key, int keylen, const char **value);
 #ifdef USE_WIFI_ONEVENT
 #ifdef ESP32
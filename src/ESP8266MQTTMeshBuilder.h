@@ -13,6 +13,16 @@ private:
     const char   *mesh_ssid;
     const char   *mesh_password;
     int          mesh_port;
+    uint16_t     coalesce_ms;
+    uint16_t     coalesce_bytes;
+    bool         compress;
+    uint8_t      rx_buffers;
+    uint16_t     rx_buffer_size;
+    fs::FS       *store_fs;
+    uint32_t     store_size;
+    uint8_t      store_policy;
+    uint32_t     backoff_base_ms;
+    uint32_t     backoff_cap_ms;
 
     unsigned int firmware_id;
     const char   *firmware_ver;
@@ -40,6 +50,16 @@ public:
        mesh_ssid("esp8266_mqtt_mesh"),
        mesh_password("ESP8266MQTTMesh"),
        mesh_port(1884),
+       coalesce_ms(0),
+       coalesce_bytes(1024),
+       compress(false),
+       rx_buffers(2),
+       rx_buffer_size(MQTT_MAX_PACKET_SIZE),
+       store_fs(NULL),
+       store_size(0),
+       store_policy(MESH_STORE_DROP_OLDEST),
+       backoff_base_ms(MESH_BACKOFF_BASE_MS),
+       backoff_cap_ms(MESH_BACKOFF_CAP_MS),
        firmware_id(0),
        firmware_ver(NULL),
 #if ASYNC_TCP_SSL_ENABLED
@@ -64,6 +84,28 @@ public:
     Builder& setMeshSSID(const char *ssid) { this->mesh_ssid = ssid; return *this; }
     Builder& setMeshPassword(const char *password) { this->mesh_password = password; return *this; }
     Builder& setMeshPort(int port) { this->mesh_port = port; return *this; }
+    Builder& setCoalescing(uint16_t window_ms, uint16_t max_bytes = 1024) {
+        this->coalesce_ms = window_ms;
+        this->coalesce_bytes = max_bytes;
+        return *this;
+    }
+    Builder& setCompression(bool enable) { this->compress = enable; return *this; }
+    Builder& setRxBuffers(uint8_t count, uint16_t size = MQTT_MAX_PACKET_SIZE) {
+        this->rx_buffers = count;
+        this->rx_buffer_size = size;
+        return *this;
+    }
+    Builder& setOfflineStore(fs::FS *fs, uint32_t max_bytes = 16384, enum MESH_STORE_POLICY policy = MESH_STORE_DROP_OLDEST) {
+        this->store_fs = fs;
+        this->store_size = max_bytes;
+        this->store_policy = policy;
+        return *this;
+    }
+    Builder& setBackoff(uint32_t base_ms, uint32_t cap_ms = MESH_BACKOFF_CAP_MS) {
+        this->backoff_base_ms = base_ms;
+        this->backoff_cap_ms = cap_ms;
+        return *this;
+    }
     Builder& setTopic(const char *inTopic, const char *outTopic) {
         this->inTopic = inTopic;
         this->outTopic = outTopic;
@@ -103,6 +145,17 @@ public:
             mesh_password,
             mesh_port,
 
+            coalesce_ms,
+            coalesce_bytes,
+            compress,
+            rx_buffers,
+            rx_buffer_size,
+            store_fs,
+            store_size,
+            store_policy,
+            backoff_base_ms,
+            backoff_cap_ms,
+
 #if ASYNC_TCP_SSL_ENABLED
             mqtt_secure,
             mqtt_fingerprint,
@@ -129,6 +182,17 @@ public:
             mesh_password,
             mesh_port,
 
+            coalesce_ms,
+            coalesce_bytes,
+            compress,
+            rx_buffers,
+            rx_buffer_size,
+            store_fs,
+            store_size,
+            store_policy,
+            backoff_base_ms,
+            backoff_cap_ms,
+
 #if ASYNC_TCP_SSL_ENABLED
             mqtt_secure,
             mqtt_fingerprint,
@@ -0,0 +1,122 @@
+/*
+ *  Copyright (C) 2016 PhracturedBlue
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MeshLZ.h"
+#include <string.h>
+
+#define HASH_BITS 8
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    return ((uint32_t)((p[0] << 16) | (p[1] << 8) | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t mesh_lz_compress(uint8_t *output, size_t outLen, const uint8_t *input, size_t inLen) {
+    uint16_t table[1 << HASH_BITS]; //Last position (+1) at which each hash was seen
+    size_t ip = 0;
+    size_t op = 0;
+    size_t ctrl = 0;
+    uint8_t bit = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip < inLen) {
+        if (! bit) {
+            if (op >= outLen) {
+                return 0;
+            }
+            ctrl = op++;
+            output[ctrl] = 0;
+            bit = 1;
+        }
+        size_t len = 0;
+        size_t dist = 0;
+        if (ip + MESH_LZ_MIN_MATCH <= inLen) {
+            uint32_t h = lz_hash(input + ip);
+            size_t cand = table[h];
+            table[h] = ip + 1;
+            if (cand) {
+                dist = ip - (cand - 1);
+                if (dist <= MESH_LZ_MAX_DIST) {
+                    while (len < MESH_LZ_MAX_MATCH && ip + len < inLen && input[cand - 1 + len] == input[ip + len]) {
+                        len++;
+                    }
+                }
+            }
+        }
+        if (len >= MESH_LZ_MIN_MATCH) {
+            if (op + 2 > outLen) {
+                return 0;
+            }
+            uint16_t token = ((dist - 1) << 4) | (len - MESH_LZ_MIN_MATCH);
+            output[ctrl] |= bit;
+            output[op++] = token >> 8;
+            output[op++] = token & 0xff;
+            //Remember the positions inside the match too, repeated keys are often only a few bytes apart
+            size_t end = ip + len;
+            for (ip++; ip < end; ip++) {
+                if (ip + MESH_LZ_MIN_MATCH <= inLen) {
+                    table[lz_hash(input + ip)] = ip + 1;
+                }
+            }
+        } else {
+            if (op >= outLen) {
+                return 0;
+            }
+            output[op++] = input[ip++];
+        }
+        bit <<= 1;
+    }
+    return op;
+}
+
+int mesh_lz_decompress(uint8_t *output, size_t outLen, const uint8_t *input, size_t inLen) {
+    size_t ip = 0;
+    size_t op = 0;
+    uint8_t ctrl = 0;
+    uint8_t bit = 0;
+
+    while (ip < inLen) {
+        if (! bit) {
+            ctrl = input[ip++];
+            bit = 1;
+            if (ip == inLen) {
+                return -1;
+            }
+        }
+        if (ctrl & bit) {
+            if (ip + 2 > inLen) {
+                return -1;
+            }
+            uint16_t token = (input[ip] << 8) | input[ip + 1];
+            size_t dist = (token >> 4) + 1;
+            size_t len = (token & 0x0f) + MESH_LZ_MIN_MATCH;
+            ip += 2;
+            if (dist > op || op + len > outLen) {
+                return -1;
+            }
+            for (size_t i = 0; i < len; i++, op++) {
+                output[op] = output[op - dist];
+            }
+        } else {
+            if (op >= outLen) {
+                return -1;
+            }
+            output[op++] = input[ip++];
+        }
+        bit <<= 1;
+    }
+    return op;
+}
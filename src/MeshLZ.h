@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2016 PhracturedBlue
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _MESHLZ_H
+#define _MESHLZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Small LZSS codec used for mesh payloads.
+ *
+ * The stream is a sequence of groups, each made of a control byte followed by up to 8 items.
+ * Bit n (LSB first) of the control byte selects the type of item n:
+ *   0: a literal byte
+ *   1: a 2 byte big-endian match token: 12 bits (distance - 1), 4 bits (length - MESH_LZ_MIN_MATCH)
+ * Matches may overlap the bytes they produce.
+ */
+#define MESH_LZ_MIN_MATCH 3
+#define MESH_LZ_MAX_MATCH (MESH_LZ_MIN_MATCH + 15)
+#define MESH_LZ_MAX_DIST  4096
+
+/* mesh_lz_compress:
+ *      Compress inLen bytes from input into output.  Needs ~512 bytes of stack
+ *      Returns the compressed length, or 0 if the result would not fit in outLen bytes
+ */
+size_t mesh_lz_compress(uint8_t *output, size_t outLen, const uint8_t *input, size_t inLen);
+
+/* mesh_lz_decompress:
+ *      Decompress inLen bytes from input into output.  Needs no memory beyond output
+ *      Returns the decompressed length, or -1 if the stream is corrupt or does not fit in outLen bytes
+ */
+int mesh_lz_decompress(uint8_t *output, size_t outLen, const uint8_t *input, size_t inLen);
+
+#endif // _MESHLZ_H
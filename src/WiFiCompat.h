@@ -4,6 +4,7 @@
 
 #include <WiFi.h>
 #include "esp_mac.h"
+#include "esp_wifi.h"
 
 typedef enum {
     STATION_IF = 0, /**< ESP32 station interface */
@@ -19,7 +20,57 @@ static bool wifi_set_macaddr(WIFI_INTERFACE if_index, uint8_t *macaddr) {
     return true;
 }
 
+typedef enum {
+    USER_IE_BEACON = 0,
+    USER_IE_PROBE_REQ,
+    USER_IE_PROBE_RESP,
+    USER_IE_ASSOC_REQ,
+    USER_IE_ASSOC_RESP,
+    USER_IE_MAX
+} user_ie_type;
+
+typedef void (*user_ie_manufacturer_recv_cb_t)(user_ie_type type, const uint8_t sa[6], const uint8_t m_oui[3], uint8_t *ie, uint8_t ie_len, int32_t rssi);
+
+/* Vendor specific elements as on the ESP8266: user_ie is everything after the OUI */
+static bool wifi_set_user_ie(bool enable, uint8_t *m_oui, user_ie_type type, uint8_t *user_ie, uint8_t len) {
+    uint8_t buf[sizeof(vendor_ie_data_t) + 255];
+    vendor_ie_data_t *vnd_ie = (vendor_ie_data_t *)buf;
+    if (len < 1 || len > 252) {
+        return false;
+    }
+    vnd_ie->element_id = WIFI_VENDOR_IE_ELEMENT_ID;
+    vnd_ie->length = 3 + len;
+    memcpy(vnd_ie->vendor_oui, m_oui, 3);
+    vnd_ie->vendor_oui_type = user_ie[0];
+    memcpy(vnd_ie->payload, user_ie + 1, len - 1);
+    wifi_vendor_ie_type_t vnd_type = type == USER_IE_PROBE_RESP ? WIFI_VND_IE_TYPE_PROBE_RESP : WIFI_VND_IE_TYPE_BEACON;
+    //Replacing an element requires removing the old one first
+    esp_wifi_set_vendor_ie(false, vnd_type, WIFI_VND_IE_ID_0, vnd_ie);
+    return ! enable || esp_wifi_set_vendor_ie(true, vnd_type, WIFI_VND_IE_ID_0, vnd_ie) == ESP_OK;
+}
+
+static user_ie_manufacturer_recv_cb_t user_ie_recv_cb;
+
+static void user_ie_recv(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi) {
+    if (user_ie_recv_cb && vnd_ie->length >= 4) {
+        user_ie_recv_cb(type == WIFI_VND_IE_TYPE_PROBE_RESP ? USER_IE_PROBE_RESP : USER_IE_BEACON, sa, vnd_ie->vendor_oui,
+                        (uint8_t *)&vnd_ie->vendor_oui_type, vnd_ie->length - 3, rssi);
+    }
+}
+
+static int wifi_register_user_ie_manufacturer_recv_cb(user_ie_manufacturer_recv_cb_t cb) {
+    user_ie_recv_cb = cb;
+    return esp_wifi_set_vendor_ie_cb(user_ie_recv, NULL) == ESP_OK ? 0 : -1;
+}
+
 #define WIFI_DISCONNECT_REASON_ASSOC_TOOMANY WIFI_REASON_ASSOC_TOOMANY 
+struct WiFiEventStationModeConnected
+{
+    String ssid;
+    uint8_t bssid[6];
+    uint8_t channel;
+};
+
 struct WiFiEventStationModeGotIP
 {
     IPAddress ip;
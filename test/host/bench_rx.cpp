@@ -0,0 +1,273 @@
+// Measures how fast a gateway's receive path takes frames from a child.  A leaf publishes a mix of short messages and
+// messages long enough to be split into mesh fragments, and the byte stream its parent receives is recorded.  The
+// stream is then fed to the onData() of fresh gateways, cut into TCP segments in several ways: at frame boundaries,
+// so every frame can be handled where it lies, and at fixed or random sizes, so frames are split across segments and
+// have to be copied.  Only the time spent in onData() is counted.  Every message must still reach the broker intact,
+// the short and the long ones each in order, and the cuts meant to split frames must split some
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include <Arduino.h>
+#include "mesh_sim.h"
+
+#define MESH_RATE    1000    //Bytes per ms between nodes while recording
+#define BROKER_RATE  0       //The broker takes messages as fast as they come
+#define STREAM_BYTES 2000000 //Bytes of frames to record
+#define LONG_EVERY   4       //Every this many messages is a long one
+#define REPEAT       5       //Each cut is fed this many times, the fastest run counts
+
+static const wifi_conn networks[] = {
+    WIFI_CONN("sim", "sim", NULL, 0),
+    WIFI_CONN(NULL, NULL, NULL, 0)
+};
+
+static uint32_t leaf_id = 0xA101;
+static uint32_t published = 0;
+static uint32_t received = 0;
+static int64_t last[2];        //Sequence number of the last short and long message the broker got
+static uint32_t misordered = 0;
+static uint32_t corrupt = 0;   //Messages whose payload is not the one published
+static bool congested = false;
+static std::string stream;
+static std::vector<std::pair<size_t, uint64_t> > arrivals; //Recorded length of the stream at each simulated time
+
+static size_t make_msg(uint32_t seq, char *msg, size_t size) {
+    //Repetitive readings led by the sequence number, 20 to 300 bytes or, every LONG_EVERY messages, 1200 to 1800
+    static const char reading[] = "temperature=21.5;humidity=40;";
+    int len = snprintf(msg, size, "%u:", (unsigned)seq);
+    int want = seq % LONG_EVERY ? 20 + (seq * 37) % 280 : 1200 + (seq * 37) % 600;
+    while (len < want) {
+        int c = want - len < (int)sizeof(reading) - 1 ? want - len : (int)sizeof(reading) - 1;
+        memcpy(msg + len, reading, c);
+        len += c;
+    }
+    msg[len] = '\0';
+    return len;
+}
+
+static void broker_received(const std::string &topic, const std::string &payload) {
+    unsigned id;
+    int end = 0;
+    if (sscanf(topic.c_str(), "esp8266-out/%x/seq%n", &id, &end) != 1 || (size_t)end != topic.size() || id != leaf_id) {
+        return;
+    }
+    //Long messages go out fragment by fragment as the uplink drains, so later short ones may overtake them
+    uint32_t seq = strtoul(payload.c_str(), NULL, 10);
+    static char expect[2048];
+    size_t len = make_msg(seq, expect, sizeof(expect));
+    if (payload.size() != len || memcmp(payload.data(), expect, len) != 0) {
+        corrupt++;
+    }
+    int64_t *prev = &last[seq % LONG_EVERY == 0];
+    if (seq <= *prev) {
+        misordered++;
+    }
+    *prev = seq;
+    received++;
+}
+
+static ESP8266MQTTMesh *make_node(uint32_t id) {
+    SimContext ctx(id);
+    ESP8266MQTTMesh *mesh = ESP8266MQTTMesh::Builder(networks, "broker", 1883)
+        .setVersion("sim", 1)
+        .setCompression(true)
+        .setRxBuffers(4)
+        .buildptr();
+    mesh->begin();
+    //The links are made by the test, not by scanning for parents
+    sim_cancel_node(id);
+    return mesh;
+}
+
+static void publish_one(ESP8266MQTTMesh *mesh) {
+    static char msg[2048];
+    make_msg(published, msg, sizeof(msg));
+    mesh->publish("seq", msg);
+    published++;
+}
+
+static void leaf_publish(ESP8266MQTTMesh *mesh) {
+    if (stream.size() >= STREAM_BYTES) {
+        return;
+    }
+    for (int i = 0; i < 4 && ! congested; i++) {
+        publish_one(mesh);
+    }
+    sim_schedule(mesh, 1, [mesh]() { leaf_publish(mesh); });
+}
+
+static size_t frame_len(const char *p) {
+    const mesh_hdr_t *hdr = (const mesh_hdr_t *)p;
+    return hdr->hdr_len + hdr->topic_len + hdr->payload_len;
+}
+
+static void record() {
+    //A leaf publishing through a gateway, recording everything the gateway receives from it
+    ESP8266MQTTMesh *gw = make_node(0xA000);
+    ESP8266MQTTMesh *leaf = make_node(leaf_id);
+    {
+        SimContext ctx(0xA000);
+        ESP8266MQTTMeshSim::mqtt(gw).sim_connect(BROKER_RATE, broker_received);
+    }
+    {
+        SimContext ctx(leaf_id);
+        ESP8266MQTTMeshSim::mesh_connect(leaf);
+        leaf->setTxWatermarkCallback([](int link, bool c) {
+            if (link == 0) {
+                congested = c;
+            }
+        });
+    }
+    AsyncClient::sim_connect(ESP8266MQTTMeshSim::client(leaf, 0), ESP8266MQTTMeshSim::server(gw), MESH_RATE);
+    AsyncClient *c = ESP8266MQTTMeshSim::client(gw, 1);
+    AcDataHandler handler = c->sim_data_handler();
+    c->onData([handler](void *arg, AsyncClient *c, void *data, size_t len) {
+        {
+            SimContext ctx(0);
+            stream.append((const char *)data, len);
+            arrivals.push_back(std::make_pair(stream.size(), sim_now));
+        }
+        handler(arg, c, data, len);
+    }, gw);
+    {
+        SimContext ctx(leaf_id);
+        leaf_publish(leaf);
+    }
+    sim_run(sim_now + 600000);
+}
+
+static std::vector<size_t> cut_frames() {
+    //As many whole frames as fit in a 1460 byte segment
+    std::vector<size_t> cuts;
+    size_t start = 0;
+    for (size_t pos = 0; pos < stream.size(); pos += frame_len(&stream[pos])) {
+        if (pos - start + frame_len(&stream[pos]) > 1460 && pos > start) {
+            cuts.push_back(pos - start);
+            start = pos;
+        }
+    }
+    cuts.push_back(stream.size() - start);
+    return cuts;
+}
+
+static std::vector<size_t> cut_fixed(size_t seg) {
+    std::vector<size_t> cuts;
+    for (size_t pos = 0; pos < stream.size(); pos += seg) {
+        cuts.push_back(stream.size() - pos < seg ? stream.size() - pos : seg);
+    }
+    return cuts;
+}
+
+static std::vector<size_t> cut_random() {
+    std::vector<size_t> cuts;
+    uint32_t seed = 1;
+    for (size_t pos = 0; pos < stream.size(); ) {
+        seed = seed * 1103515245 + 12345;
+        size_t seg = 1 + (seed >> 8) % 1460;
+        if (seg > stream.size() - pos) {
+            seg = stream.size() - pos;
+        }
+        cuts.push_back(seg);
+        pos += seg;
+    }
+    return cuts;
+}
+
+static size_t split_frames(const std::vector<size_t> &cuts) {
+    //Frames which do not lie whole in one segment
+    size_t split = 0, pos = 0, seg_end = 0, seg = 0;
+    for (; pos < stream.size(); pos += frame_len(&stream[pos])) {
+        while (seg_end <= pos) {
+            seg_end += cuts[seg++];
+        }
+        if (pos + frame_len(&stream[pos]) > seg_end) {
+            split++;
+        }
+    }
+    return split;
+}
+
+static bool feed(const char *name, const std::vector<size_t> &cuts, bool split, uint32_t id) {
+    //Feeds the recorded stream to a fresh gateway, as if it came from the child on its first link.  'split' says
+    //whether the cuts are meant to split frames across segments
+    double best = 0;
+    bool ok = true;
+    for (int run = 0; run < REPEAT; run++, id++) {
+        ESP8266MQTTMesh *gw = make_node(id);
+        {
+            SimContext ctx(id);
+            ESP8266MQTTMeshSim::mqtt(gw).sim_connect(BROKER_RATE, broker_received);
+        }
+        //What the gateway sends back to the child is thrown away
+        AsyncClient *sink = new AsyncClient();
+        AsyncClient::sim_connect(sink, ESP8266MQTTMeshSim::server(gw), MESH_RATE);
+        AsyncClient *c = ESP8266MQTTMeshSim::client(gw, 1);
+        received = misordered = corrupt = 0;
+        last[0] = last[1] = -1;
+        std::vector<char> seg(1460);
+        std::chrono::nanoseconds spent(0);
+        size_t pos = 0;
+        uint64_t base = sim_now;
+        for (size_t i = 0, a = 0; i < cuts.size(); i++) {
+            //lwIP hands over a buffer the receiver may write to
+            memcpy(&seg[0], &stream[pos], cuts[i]);
+            pos += cuts[i];
+            //A segment arrives no sooner than the recorded gateway had all of it, so the broker keeps up as it did then
+            while (arrivals[a].first < pos) {
+                a++;
+            }
+            sim_run(base + arrivals[a].second);
+            {
+                SimContext ctx(id);
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                ESP8266MQTTMeshSim::on_data(gw, 1, c, &seg[0], cuts[i]);
+                spent += std::chrono::steady_clock::now() - start;
+            }
+        }
+        sim_run(sim_now + 1000);
+        double rate = stream.size() / (spent.count() / 1e9);
+        if (rate > best) {
+            best = rate;
+        }
+        const mesh_stats_t &s = gw->getStats();
+        if (received != published || misordered || corrupt || s.rx_dropped || s.tx_dropped) {
+            printf("%s: broker received %u of %u messages, %u out of order, %u corrupt, rx_dropped %u, tx_dropped %u\n", name,
+                   (unsigned)received, (unsigned)published, (unsigned)misordered, (unsigned)corrupt,
+                   (unsigned)s.rx_dropped, (unsigned)s.tx_dropped);
+            ok = false;
+        }
+    }
+    size_t splits = split_frames(cuts);
+    printf("%-8s %9u  %13u  %10.1f\n", name, (unsigned)cuts.size(), (unsigned)splits, best / 1e6);
+    if ((splits != 0) != split) {
+        printf("%s: %u frames split across segments\n", name, (unsigned)splits);
+        ok = false;
+    }
+    return ok;
+}
+
+int main() {
+    last[0] = last[1] = -1;
+    record();
+    if (received != published || misordered || corrupt) {
+        printf("recording: broker received %u of %u messages, %u out of order, %u corrupt\n",
+               (unsigned)received, (unsigned)published, (unsigned)misordered, (unsigned)corrupt);
+        printf("FAIL\n");
+        return 1;
+    }
+    size_t frames = 0;
+    for (size_t pos = 0; pos < stream.size(); pos += frame_len(&stream[pos])) {
+        frames++;
+    }
+    printf("%u bytes in %u frames carrying %u messages, one in %u of them fragmented\n",
+           (unsigned)stream.size(), (unsigned)frames, (unsigned)published, LONG_EVERY);
+    printf("cut      segments  split frames  MB/s\n");
+    bool ok = true;
+    ok &= feed("frames", cut_frames(), false, 0xB000);
+    ok &= feed("1460", cut_fixed(1460), true, 0xB100);
+    ok &= feed("536", cut_fixed(536), true, 0xB200);
+    ok &= feed("random", cut_random(), true, 0xB300);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
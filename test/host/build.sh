@@ -0,0 +1,13 @@
+#!/bin/sh
+# Builds the host simulations and runs them.  For the library's debug output set SIM_DEBUG=1 and e.g. EMMDBG_LEVEL=EMMDBG_ALL
+set -e
+cd "$(dirname "$0")"
+SRC=../../src
+CXX=${CXX:-g++}
+FLAGS="-std=gnu++11 -O2 -g -Istubs -I$SRC -DESP8266MESHMQTT_DISABLE_OTA -DEMMDBG_LEVEL=${EMMDBG_LEVEL:-EMMDBG_NONE} -Wall -Wextra"
+mkdir -p out
+for t in sim_credit sim_broker_rx bench_rx; do
+    $CXX $FLAGS -o out/$t $t.cpp sim.cpp $SRC/ESP8266MQTTMesh.cpp $SRC/MeshLZ.cpp $SRC/Base64.cpp
+    echo "== $t"
+    ./out/$t
+done
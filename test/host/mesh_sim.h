@@ -0,0 +1,23 @@
+// What the host simulations reach inside ESP8266MQTTMesh: the links and broker connection the simulated network plugs
+// into, and the few internals a test drives directly
+#ifndef _SIM_MESH_SIM_H_
+#define _SIM_MESH_SIM_H_
+#include "ESP8266MQTTMesh.h"
+#include "ESP8266MQTTMeshBuilder.h"
+
+class ESP8266MQTTMeshSim {
+public:
+    static AsyncClient *&client(ESP8266MQTTMesh *mesh, int idx) { return mesh->espClient[idx]; }
+    static AsyncServer *server(ESP8266MQTTMesh *mesh) { return &mesh->espServer; }
+    static AsyncMqttClient &mqtt(ESP8266MQTTMesh *mesh) { return mesh->mqttClient; }
+    // As connect() does when it picks a mesh node for a parent
+    static void mesh_connect(ESP8266MQTTMesh *mesh) {
+        mesh->meshConnect = true;
+        mesh->txq_alloc(0);
+    }
+    static void on_data(ESP8266MQTTMesh *mesh, int idx, AsyncClient *c, void *data, size_t len) { mesh->onData(idx, c, data, len); }
+    static char *rx_lease(ESP8266MQTTMesh *mesh) { return mesh->rx_lease(); }
+    static void rx_release(ESP8266MQTTMesh *mesh, char *buf) { mesh->rx_release(buf); }
+};
+
+#endif
@@ -0,0 +1,337 @@
+// Simulated clock, timers, heap accounting and network for running the library on a host
+#include <map>
+#include <new>
+#include <utility>
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESPAsyncTCP.h>
+#include <AsyncMqttClient.h>
+
+uint64_t sim_now = 0;
+uint32_t sim_node = 0;
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+
+/* Heap accounting */
+
+typedef struct {
+    uint32_t node;
+    size_t   used;
+    size_t   peak;
+} sim_heap_t;
+
+static sim_heap_t sim_heap[SIM_MAX_NODES];
+
+static sim_heap_t *heap_of(uint32_t node) {
+    for (int i = 0; i < SIM_MAX_NODES; i++) {
+        if (sim_heap[i].node == node) {
+            return &sim_heap[i];
+        }
+    }
+    for (int i = 1; i < SIM_MAX_NODES; i++) {
+        if (! sim_heap[i].node) {
+            sim_heap[i].node = node;
+            return &sim_heap[i];
+        }
+    }
+    return &sim_heap[0];
+}
+
+// Every block starts with its size and the node it is charged to
+typedef struct {
+    size_t     size;
+    sim_heap_t *heap;
+} sim_block_t;
+
+void *operator new(size_t size) {
+    sim_block_t *b = (sim_block_t *)malloc(sizeof(sim_block_t) + size + 16);
+    if (! b) {
+        throw std::bad_alloc();
+    }
+    b->size = size;
+    b->heap = heap_of(sim_node);
+    b->heap->used += size;
+    if (b->heap->used > b->heap->peak) {
+        b->heap->peak = b->heap->used;
+    }
+    return (uint8_t *)b + 16;
+}
+
+void operator delete(void *p) noexcept {
+    if (! p) {
+        return;
+    }
+    sim_block_t *b = (sim_block_t *)((uint8_t *)p - 16);
+    b->heap->used -= b->size;
+    free(b);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+size_t sim_heap_used(uint32_t node) { return heap_of(node)->used; }
+size_t sim_heap_peak(uint32_t node) { return heap_of(node)->peak; }
+void sim_heap_reset_peak(uint32_t node) { sim_heap_t *h = heap_of(node); h->peak = h->used; }
+
+/* Events */
+
+typedef struct {
+    const void *owner;
+    uint32_t   node;
+    std::function<void()> fn;
+} sim_event_t;
+
+static std::multimap<std::pair<uint64_t, uint64_t>, sim_event_t> *sim_events;
+static uint64_t sim_seq = 0;
+
+void sim_schedule(const void *owner, uint32_t delay_ms, std::function<void()> fn) {
+    uint32_t node = sim_node;
+    SimContext ctx(0);
+    if (! sim_events) {
+        sim_events = new std::multimap<std::pair<uint64_t, uint64_t>, sim_event_t>();
+    }
+    sim_event_t ev = { owner, node, fn };
+    sim_events->insert(std::make_pair(std::make_pair(sim_now + delay_ms, sim_seq++), ev));
+}
+
+void sim_cancel(const void *owner) {
+    if (! sim_events) {
+        return;
+    }
+    for (auto it = sim_events->begin(); it != sim_events->end(); ) {
+        it = it->second.owner == owner ? sim_events->erase(it) : std::next(it);
+    }
+}
+
+bool sim_pending(const void *owner) {
+    if (! sim_events) {
+        return false;
+    }
+    for (auto it = sim_events->begin(); it != sim_events->end(); ++it) {
+        if (it->second.owner == owner) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void sim_cancel_node(uint32_t node) {
+    if (! sim_events) {
+        return;
+    }
+    for (auto it = sim_events->begin(); it != sim_events->end(); ) {
+        it = it->second.node == node ? sim_events->erase(it) : std::next(it);
+    }
+}
+
+bool sim_run(uint64_t until_ms) {
+    while (sim_events && ! sim_events->empty()) {
+        auto it = sim_events->begin();
+        if (it->first.first > until_ms) {
+            sim_now = until_ms;
+            return true;
+        }
+        sim_now = it->first.first;
+        sim_event_t ev = it->second;
+        sim_events->erase(it);
+        SimContext ctx(ev.node);
+        ev.fn();
+    }
+    sim_now = until_ms;
+    return false;
+}
+
+/* Serial */
+
+bool HardwareSerial::enabled() {
+    static int on = -1;
+    if (on < 0) {
+        on = getenv("SIM_DEBUG") ? 1 : 0;
+    }
+    return on;
+}
+
+size_t HardwareSerial::printf(const char *fmt, ...) {
+    if (! enabled()) {
+        return 0;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    ::printf("[%06x %8lu] ", sim_node, millis());
+    int len = vprintf(fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+/* Mesh links */
+
+AsyncClient::AsyncClient() : node(sim_node) {}
+
+AsyncClient::~AsyncClient() {
+    sim_cancel(this);
+    if (peer) {
+        peer->peer = NULL;
+    }
+}
+
+void AsyncClient::sim_connect(AsyncClient *client, AsyncServer *server, uint32_t rate) {
+    AsyncClient *c;
+    {
+        SimContext ctx(server->node);
+        c = new AsyncClient();
+    }
+    client->peer = c;
+    c->peer = client;
+    client->rate = c->rate = rate;
+    {
+        SimContext ctx(server->node);
+        server->sim_accept(c);
+    }
+    SimContext ctx(client->node);
+    if (client->connect_cb) {
+        client->connect_cb(client->cb_arg, client);
+    }
+}
+
+void AsyncClient::close(bool) {
+    AsyncClient *p = peer;
+    if (! p) {
+        return;
+    }
+    peer = NULL;
+    p->peer = NULL;
+    sim_cancel(this);
+    sim_cancel(p);
+    {
+        SimContext ctx(p->node);
+        if (p->disconnect_cb) {
+            p->disconnect_cb(p->cb_arg, p);
+        }
+    }
+    if (disconnect_cb) {
+        disconnect_cb(cb_arg, this);
+    }
+}
+
+size_t AsyncClient::add(const char *data, size_t len, uint8_t) {
+    if (len > space()) {
+        len = space();
+    }
+    out.append(data, len);
+    unacked += len;
+    return len;
+}
+
+bool AsyncClient::send() {
+    if (! peer || sending || out.empty()) {
+        return false;
+    }
+    sending = true;
+    size_t seg = out.size() < SIM_TCP_MSS ? out.size() : SIM_TCP_MSS;
+    sim_schedule(this, (seg + rate - 1) / rate, [this]() { transmit(); });
+    return true;
+}
+
+void AsyncClient::transmit() {
+    sending = false;
+    size_t seg = out.size() < SIM_TCP_MSS ? out.size() : SIM_TCP_MSS;
+    std::string data;
+    {
+        SimContext ctx(0);
+        data = out.substr(0, seg);
+    }
+    out.erase(0, seg);
+    if (peer && peer->data_cb) {
+        SimContext ctx(peer->node);
+        peer->data_cb(peer->cb_arg, peer, &data[0], seg);
+    }
+    unacked -= seg;
+    if (ack_cb) {
+        ack_cb(cb_arg, this, seg, 1);
+    }
+    send();
+}
+
+/* Broker */
+
+void AsyncMqttClient::sim_connect(uint32_t rate, std::function<void(const std::string &, const std::string &)> received) {
+    this->rate = rate;
+    this->received = received;
+    is_connected = true;
+    if (connect_cb) {
+        connect_cb(false);
+    }
+}
+
+uint16_t AsyncMqttClient::publish(const char *topic, uint8_t qos, bool /*retain*/, const char *payload, size_t len, bool /*dup*/, uint16_t /*id*/) {
+    if (! is_connected) {
+        return 0;
+    }
+    if (payload && ! len) {
+        len = strlen(payload);
+    }
+    size_t size = 5 + 2 + strlen(topic) + len + (qos ? 2 : 0);
+    if (! rate) {
+        //An unlimited connection hands every packet to the broker straight away
+        uint16_t id = qos ? (++packet_id ? packet_id : ++packet_id) : 0;
+        {
+            SimContext ctx(0);
+            received(std::string(topic), std::string(payload ? payload : "", len));
+        }
+        if (id && publish_cb) {
+            sim_schedule(this, 0, [this, id]() { publish_cb(id); });
+        }
+        return qos ? id : 1;
+    }
+    if (used + size > SIM_MQTT_BUF) {
+        return 0;
+    }
+    if (qos && ! ++packet_id) {
+        packet_id = 1;
+    }
+    packet p = { std::string(topic), std::string(payload ? payload : "", len), (uint16_t)(qos ? packet_id : 0), size };
+    out.push_back(p);
+    used += size;
+    if (! draining) {
+        draining = true;
+        sim_schedule(this, (size + rate - 1) / rate, [this]() { drain(); });
+    }
+    return qos ? packet_id : 1;
+}
+
+void AsyncMqttClient::sim_deliver(const char *topic, const std::string &payload, size_t chunk) {
+    std::string t(topic), p(payload);
+    AsyncMqttClientMessageProperties props = { 0, false, false };
+    if (! chunk) {
+        chunk = p.size() ? p.size() : 1;
+    }
+    for (size_t off = 0; off == 0 || off < p.size(); off += chunk) {
+        size_t n = p.size() - off < chunk ? p.size() - off : chunk;
+        message_cb(&t[0], &p[0] + off, props, n, off, p.size());
+    }
+}
+
+void AsyncMqttClient::drain() {
+    //Packets shorter than a millisecond's worth of bytes go out together
+    draining = false;
+    do {
+        packet p = out.front();
+        out.pop_front();
+        used -= p.size;
+        {
+            SimContext ctx(0);
+            received(p.topic, p.payload);
+        }
+        if (p.id && publish_cb) {
+            publish_cb(p.id);
+        }
+    } while (! out.empty() && out.front().size < rate);
+    if (! out.empty()) {
+        draining = true;
+        sim_schedule(this, (out.front().size + rate - 1) / rate, [this]() { drain(); });
+    }
+}
@@ -0,0 +1,36 @@
+// Simulated clock, timers and heap accounting shared by the host stubs and test programs
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+#define SIM_MAX_NODES 16
+
+extern uint64_t sim_now;      // simulated millis()
+extern uint32_t sim_node;     // chip ID of the node whose code is running, 0 for the test itself
+
+// Runs fn as 'node' after 'delay_ms'.  Events with the same owner can be cancelled together
+void sim_schedule(const void *owner, uint32_t delay_ms, std::function<void()> fn);
+void sim_cancel(const void *owner);
+bool sim_pending(const void *owner);
+void sim_cancel_node(uint32_t node);
+// Runs events until 'until_ms' or until there are none left.  Returns false if there were none left
+bool sim_run(uint64_t until_ms);
+
+// Runs the enclosed code as another node
+class SimContext {
+public:
+    SimContext(uint32_t node) : saved(sim_node) { sim_node = node; }
+    ~SimContext() { sim_node = saved; }
+private:
+    uint32_t saved;
+};
+
+// Heap in use by each node, counted by the global operator new and delete
+size_t sim_heap_used(uint32_t node);
+size_t sim_heap_peak(uint32_t node);
+void sim_heap_reset_peak(uint32_t node);
+
+#endif
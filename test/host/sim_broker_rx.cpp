@@ -0,0 +1,112 @@
+// A gateway passes messages from the broker on to its child: short ones that arrive whole, short ones split over
+// several TCP segments and ones too long for a frame.  It does so once with its receive buffers free and once with
+// all of them leased, as they are while its links, the broker queue and the QoS store are busy.  The child must get
+// every message intact either way
+#include <string>
+#include <vector>
+#include <Arduino.h>
+#include "mesh_sim.h"
+
+#define MESH_RATE 100 //Bytes per ms between nodes
+#define GW_RX     2   //Receive buffers on the gateway, shared by its links, broker queue and MQTT client
+#define LEAF_RX   4   //Receive buffers on the child, enough to put the long message back together
+
+static const wifi_conn networks[] = {
+    WIFI_CONN("sim", "sim", NULL, 0),
+    WIFI_CONN(NULL, NULL, NULL, 0)
+};
+
+typedef struct {
+    const char *name;
+    size_t     len;
+    size_t     chunk;   //Size of the pieces it reaches the gateway in, 0 for whole
+} case_t;
+
+static const case_t cases[] = {
+    { "whole",  200,  0 },
+    { "pieces", 200,  64 },
+    { "long",   1500, 500 },
+};
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+static std::vector<std::string> delivered;
+
+static ESP8266MQTTMesh *make_node(uint32_t id, uint8_t rx_buffers) {
+    SimContext ctx(id);
+    ESP8266MQTTMesh *mesh = ESP8266MQTTMesh::Builder(networks, "broker", 1883)
+        .setVersion("sim", 1)
+        .setRxBuffers(rx_buffers)
+        .buildptr();
+    mesh->begin();
+    //The links are made by the test, not by scanning for parents
+    sim_cancel_node(id);
+    return mesh;
+}
+
+static std::string make_payload(const case_t *c, int round) {
+    std::string p;
+    for (size_t i = 0; i < c->len; i++) {
+        p += (char)('a' + (i * 7 + round) % 26);
+    }
+    return p;
+}
+
+static bool run(ESP8266MQTTMesh *gw, int round, bool full) {
+    std::vector<char *> leased;
+    if (full) {
+        SimContext ctx(0xA000);
+        for (char *buf; (buf = ESP8266MQTTMeshSim::rx_lease(gw)); ) {
+            leased.push_back(buf);
+        }
+    }
+    bool ok = true;
+    for (size_t i = 0; i < CASE_COUNT; i++) {
+        const case_t *c = &cases[i];
+        std::string payload = make_payload(c, round);
+        delivered.clear();
+        {
+            SimContext ctx(0xA000);
+            ESP8266MQTTMeshSim::mqtt(gw).sim_deliver("esp8266-in/00A101/cmd", payload, c->chunk);
+        }
+        sim_run(sim_now + 1000);
+        bool intact = delivered.size() == 1 && delivered[0] == payload;
+        printf("%-8s %-6s %5u  %s\n", full ? "leased" : "free", c->name, (unsigned)c->len, intact ? "ok" : "lost");
+        ok &= intact;
+    }
+    SimContext ctx(0xA000);
+    for (size_t i = 0; i < leased.size(); i++) {
+        ESP8266MQTTMeshSim::rx_release(gw, leased[i]);
+    }
+    return ok;
+}
+
+int main() {
+    ESP8266MQTTMesh *gw = make_node(0xA000, GW_RX);
+    ESP8266MQTTMesh *leaf = make_node(0xA101, LEAF_RX);
+    {
+        SimContext ctx(0xA000);
+        ESP8266MQTTMeshSim::mqtt(gw).sim_connect(0, [](const std::string &, const std::string &) {});
+    }
+    {
+        SimContext ctx(0xA101);
+        ESP8266MQTTMeshSim::mesh_connect(leaf);
+        leaf->setCallback([](const char *topic, const char *msg) {
+            if (! strcmp(topic, "cmd")) {
+                delivered.push_back(msg);
+            }
+        });
+    }
+    AsyncClient::sim_connect(ESP8266MQTTMeshSim::client(leaf, 0), ESP8266MQTTMeshSim::server(gw), MESH_RATE);
+    sim_run(sim_now + 1000);
+
+    printf("buffers  case     len  child\n");
+    bool ok = true;
+    ok &= run(gw, 0, false);
+    ok &= run(gw, 1, true);
+    printf("gateway rx_dropped %u, tx_dropped %u\n", (unsigned)gw->getStats().rx_dropped, (unsigned)gw->getStats().tx_dropped);
+    if (gw->getStats().rx_dropped || gw->getStats().tx_dropped) {
+        ok = false;
+    }
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
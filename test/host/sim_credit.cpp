@@ -0,0 +1,181 @@
+// Four leaves publish as fast as their uplink takes messages, through two relays, to a gateway whose connection
+// to the broker is far slower than the mesh.  The relays and the gateway publish readings of their own now and then.
+// Credit has to slow the leaves down to the broker's pace without any node dropping a message or needing more
+// memory the longer it runs
+#include <map>
+#include <string>
+#include <vector>
+#include <Arduino.h>
+#include "mesh_sim.h"
+
+#define MESH_RATE   100   //Bytes per ms between nodes
+#define BROKER_RATE 8     //Bytes per ms from the gateway to the broker
+#define RUN_MS      30000 //Leaves publish this long...
+#define DRAIN_MS    60000 //...and everything has reached the broker this much later
+#define HEAP_LIMIT  36864 //Most heap any node may use, well within what an ESP8266 has free
+#define OWN_MS      200   //Relays and the gateway publish this often, whether or not their uplink is congested
+
+typedef struct {
+    uint32_t        id;
+    const char      *role;
+    ESP8266MQTTMesh *mesh;
+    bool            leaf;
+    bool            congested;
+    uint32_t        published;
+    uint32_t        received;
+    uint32_t        next;        //Sequence number the broker should get next
+    uint32_t        misordered;
+    size_t          heap_half;   //Peak heap in the first half of the run
+} node_t;
+
+static const wifi_conn networks[] = {
+    WIFI_CONN("sim", "sim", NULL, 0),
+    WIFI_CONN(NULL, NULL, NULL, 0)
+};
+
+#define NODE(id, role) { id, role, NULL, false, false, 0, 0, 0, 0, 0 }
+
+static node_t nodes[] = {
+    NODE(0xA000, "gateway"),
+    NODE(0xA100, "relay"),
+    NODE(0xA200, "relay"),
+    NODE(0xA101, "leaf"),
+    NODE(0xA102, "leaf"),
+    NODE(0xA201, "leaf"),
+    NODE(0xA202, "leaf"),
+};
+#define NODE_COUNT (sizeof(nodes) / sizeof(nodes[0]))
+
+static uint64_t broker_bytes = 0;
+static uint64_t broker_last = 0;
+
+static node_t *find_node(uint32_t id) {
+    for (size_t i = 0; i < NODE_COUNT; i++) {
+        if (nodes[i].id == id) {
+            return &nodes[i];
+        }
+    }
+    return NULL;
+}
+
+static void broker_received(const std::string &topic, const std::string &payload) {
+    //Leaves publish esp8266-out/<id>/seq with the sequence number leading the payload
+    broker_bytes += topic.size() + payload.size();
+    broker_last = sim_now;
+    unsigned id;
+    int end = 0;
+    if (sscanf(topic.c_str(), "esp8266-out/%x/seq%n", &id, &end) != 1 || (size_t)end != topic.size()) {
+        return;
+    }
+    node_t *n = find_node(id);
+    if (! n) {
+        return;
+    }
+    uint32_t seq = strtoul(payload.c_str(), NULL, 10);
+    if (seq != n->next && n->misordered++ < 10) {
+        printf("%06x: got message %u, expected %u\n", n->id, (unsigned)seq, (unsigned)n->next);
+    }
+    n->next = seq + 1;
+    n->received++;
+}
+
+static void make_node(node_t *n) {
+    SimContext ctx(n->id);
+    n->mesh = ESP8266MQTTMesh::Builder(networks, "broker", 1883)
+        .setVersion("sim", 1)
+        .setCompression(true)
+        .setRxBuffers(4)
+        .buildptr();
+    n->mesh->begin();
+    //The links are made by the test, not by scanning for parents
+    sim_cancel_node(n->id);
+    n->mesh->setTxWatermarkCallback([n](int link, bool congested) {
+        if (link == 0) {
+            n->congested = congested;
+        }
+    });
+}
+
+static void join(node_t *child, node_t *parent) {
+    {
+        SimContext ctx(child->id);
+        ESP8266MQTTMeshSim::mesh_connect(child->mesh);
+    }
+    AsyncClient::sim_connect(ESP8266MQTTMeshSim::client(child->mesh, 0), ESP8266MQTTMeshSim::server(parent->mesh), MESH_RATE);
+}
+
+static void publish_one(node_t *n, int max_len) {
+    //Repetitive readings of 20 bytes up to max_len, led by the sequence number
+    static const char reading[] = "temperature=21.5;humidity=40;";
+    char msg[320];
+    int len = snprintf(msg, sizeof(msg), "%u:", (unsigned)n->published);
+    int want = 20 + (n->published * 37) % (max_len - 20);
+    while (len < want) {
+        int c = want - len < (int)sizeof(reading) - 1 ? want - len : (int)sizeof(reading) - 1;
+        memcpy(msg + len, reading, c);
+        len += c;
+    }
+    msg[len] = '\0';
+    n->mesh->publish("seq", msg);
+    n->published++;
+}
+
+static void node_publish(node_t *n) {
+    //Leaves publish as many messages as their uplink takes, the others one small message every OWN_MS
+    if (sim_now >= RUN_MS) {
+        return;
+    }
+    if (n->leaf) {
+        for (int i = 0; i < 4 && ! n->congested; i++) {
+            publish_one(n, 300);
+        }
+    } else {
+        publish_one(n, 80);
+    }
+    sim_schedule(n, n->leaf ? 1 : OWN_MS, [n]() { node_publish(n); });
+}
+
+int main() {
+    for (size_t i = 0; i < NODE_COUNT; i++) {
+        make_node(&nodes[i]);
+        nodes[i].leaf = ! strcmp(nodes[i].role, "leaf");
+    }
+    {
+        SimContext ctx(nodes[0].id);
+        ESP8266MQTTMeshSim::mqtt(nodes[0].mesh).sim_connect(BROKER_RATE, broker_received);
+    }
+    join(&nodes[1], &nodes[0]);
+    join(&nodes[2], &nodes[0]);
+    join(&nodes[3], &nodes[1]);
+    join(&nodes[4], &nodes[1]);
+    join(&nodes[5], &nodes[2]);
+    join(&nodes[6], &nodes[2]);
+    for (size_t i = 0; i < NODE_COUNT; i++) {
+        SimContext ctx(nodes[i].id);
+        node_publish(&nodes[i]);
+    }
+    sim_run(RUN_MS / 2);
+    for (size_t i = 0; i < NODE_COUNT; i++) {
+        nodes[i].heap_half = sim_heap_peak(nodes[i].id);
+        sim_heap_reset_peak(nodes[i].id);
+    }
+    sim_run(RUN_MS + DRAIN_MS);
+
+    bool ok = true;
+    printf("node    role     published  received  tx_dropped  rx_dropped  credit_stalls  heap (1st half/2nd half)\n");
+    for (size_t i = 0; i < NODE_COUNT; i++) {
+        node_t *n = &nodes[i];
+        const mesh_stats_t &s = n->mesh->getStats();
+        size_t heap = sim_heap_peak(n->id);
+        printf("%06x  %-7s  %9u  %8u  %10u  %10u  %13u  %6u / %6u\n", n->id, n->role, (unsigned)n->published, (unsigned)n->received,
+               (unsigned)s.tx_dropped, (unsigned)s.rx_dropped, (unsigned)s.credit_stalls, (unsigned)n->heap_half, (unsigned)heap);
+        if (! n->published || n->received != n->published || n->misordered || s.tx_dropped || s.rx_dropped
+            || n->heap_half > HEAP_LIMIT || heap > n->heap_half) {
+            ok = false;
+        }
+    }
+    printf("broker received %.1f kB/s until %.1f s, its connection takes %u kB/s\n",
+           broker_bytes / (double)broker_last, broker_last / 1000.0, BROKER_RATE);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+// Just enough of the Arduino core to run the library on a host
+#ifndef _SIM_ARDUINO_H_
+#define _SIM_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include "../sim.h"
+
+typedef uint8_t byte;
+typedef unsigned int uint;
+typedef uint8_t uint8;
+typedef int32_t sint32;
+#define LED_BUILTIN 2
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define HEX 16
+#define DEC 10
+#define PROGMEM
+#define pgm_read_byte(x) (*(const uint8_t *)(x))
+#define pgm_read_with_offset(a, b) 0
+#define FLASH_SECTOR_SIZE 4096
+#define ICACHE_RAM_ATTR
+#define os_sprintf sprintf
+
+inline unsigned long millis() { return (unsigned long)sim_now; }
+inline unsigned long micros() { return (unsigned long)(sim_now * 1000); }
+inline void delay(unsigned long) {}
+inline void yield() {}
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+inline int digitalRead(int) { return 0; }
+inline long random(long max) { return max > 0 ? rand() % max : 0; }
+inline long random(long min, long max) { return max > min ? min + rand() % (max - min) : min; }
+inline void randomSeed(unsigned long seed) { srand(seed); }
+
+inline char *itoa(int val, char *buf, int base) {
+    snprintf(buf, 34, base == 16 ? "%x" : "%d", val);
+    return buf;
+}
+
+inline size_t strlcpy(char *dst, const char *src, size_t len) {
+    size_t n = strlen(src);
+    if (len) {
+        size_t c = n < len - 1 ? n : len - 1;
+        memcpy(dst, src, c);
+        dst[c] = '\0';
+    }
+    return n;
+}
+
+class String {
+public:
+    String(const char *s = "") : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    String(char c) : s(1, c) {}
+    String(int v, int base = 10) : s(fmt(v, base)) {}
+    String(unsigned int v, int base = 10) : s(fmt(v, base)) {}
+    String(long v, int base = 10) : s(fmt(v, base)) {}
+    String(unsigned long v, int base = 10) : s(fmt(v, base)) {}
+    String(double v, int digits = 2) { char b[32]; snprintf(b, sizeof(b), "%.*f", digits, v); s = b; }
+    String(float v, int digits = 2) { char b[32]; snprintf(b, sizeof(b), "%.*f", digits, (double)v); s = b; }
+    String operator+(const String &o) const { return String(s + o.s); }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    friend String operator+(const char *a, const String &b) { return String(std::string(a) + b.s); }
+    const char *c_str() const { return s.c_str(); }
+    unsigned length() const { return s.size(); }
+    void toUpperCase() { for (size_t i = 0; i < s.size(); i++) s[i] = toupper(s[i]); }
+    void reserve(unsigned n) { s.reserve(n); }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator==(const String &o) const { return s == o.s; }
+private:
+    std::string s;
+    static std::string fmt(unsigned long v, int base) { char b[24]; snprintf(b, sizeof(b), base == 16 ? "%lx" : "%lu", v); return b; }
+    static std::string fmt(long v, int base) { char b[24]; snprintf(b, sizeof(b), base == 16 ? "%lx" : "%ld", v); return b; }
+    static std::string fmt(int v, int base) { return fmt((long)v, base); }
+    static std::string fmt(unsigned int v, int base) { return fmt((unsigned long)v, base); }
+};
+
+// Prints only when SIM_DEBUG is set in the environment
+class HardwareSerial {
+public:
+    void begin(unsigned long) {}
+    size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    void println(const String &s) { if (enabled()) ::printf("[%06x %8lu] %s\n", sim_node, millis(), s.c_str()); }
+    void println(int v) { println(String(v)); }
+    void print(const String &s) { if (enabled()) ::printf("%s", s.c_str()); }
+    void print(int v) { print(String(v)); }
+    static bool enabled();
+};
+extern HardwareSerial Serial;
+
+class MD5Builder {
+public:
+    void begin() {}
+    void add(const uint8_t *, int) {}
+    void calculate() {}
+    void getBytes(uint8_t *out) { memset(out, 0, 16); }
+    void getChars(char *out) { memset(out, '0', 32); out[32] = '\0'; }
+};
+
+class IPAddress {
+public:
+    IPAddress() : addr{0, 0, 0, 0} {}
+    IPAddress(uint32_t a) { memcpy(addr, &a, 4); }
+    IPAddress(int a, int b, int c, int d) : addr{(uint8_t)a, (uint8_t)b, (uint8_t)c, (uint8_t)d} {}
+    uint8_t operator[](int i) const { return addr[i]; }
+    String toString() const { char b[16]; snprintf(b, sizeof(b), "%u.%u.%u.%u", addr[0], addr[1], addr[2], addr[3]); return String(b); }
+private:
+    uint8_t addr[4];
+};
+
+// The chip ID is that of the node whose code is running, the free heap what it has left of SIM_HEAP_SIZE
+#define SIM_HEAP_SIZE 45000
+class EspClass {
+public:
+    void restart() { ::printf("node %06x restarted\n", sim_node); abort(); }
+    uint32_t getChipId() { return sim_node; }
+    uint32_t getSketchSize() { return 0; }
+    uint32_t getFreeSketchSpace() { return 0; }
+    bool flashRead(uint32_t, uint32_t *, size_t) { return false; }
+    bool flashWrite(uint32_t, uint32_t *, size_t) { return false; }
+    bool flashEraseSector(uint32_t) { return false; }
+    String getResetReason() { return String("Power on"); }
+    uint32_t getFreeHeap() { size_t used = sim_heap_used(sim_node); return used < SIM_HEAP_SIZE ? SIM_HEAP_SIZE - used : 0; }
+    bool rtcUserMemoryRead(uint32_t, uint32_t *, size_t) { return false; }
+    bool rtcUserMemoryWrite(uint32_t, uint32_t *, size_t) { return true; }
+};
+extern EspClass ESP;
+
+#endif
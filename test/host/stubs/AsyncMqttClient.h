@@ -0,0 +1,54 @@
+// A broker connection with room for SIM_MQTT_BUF bytes of outgoing packets, which it sends at sim_rate bytes per
+// millisecond.  Like AsyncMqttClient 0.8, publish() returns 0 when the packet does not fit
+#ifndef _SIM_ASYNCMQTTCLIENT_H_
+#define _SIM_ASYNCMQTTCLIENT_H_
+#include <Arduino.h>
+#include <deque>
+
+#define SIM_MQTT_BUF 2920
+
+enum class AsyncMqttClientDisconnectReason : int8_t { TCP_DISCONNECTED = 0, TLS_BAD_FINGERPRINT = 7 };
+struct AsyncMqttClientMessageProperties { uint8_t qos; bool dup; bool retain; };
+
+class AsyncMqttClient {
+public:
+    ~AsyncMqttClient() { sim_cancel(this); }
+    AsyncMqttClient &onConnect(std::function<void(bool)> cb) { connect_cb = cb; return *this; }
+    AsyncMqttClient &onDisconnect(std::function<void(AsyncMqttClientDisconnectReason)> cb) { disconnect_cb = cb; return *this; }
+    AsyncMqttClient &onSubscribe(std::function<void(uint16_t, uint8_t)>) { return *this; }
+    AsyncMqttClient &onUnsubscribe(std::function<void(uint16_t)>) { return *this; }
+    AsyncMqttClient &onMessage(std::function<void(char *, char *, AsyncMqttClientMessageProperties, size_t, size_t, size_t)> cb) { message_cb = cb; return *this; }
+    AsyncMqttClient &onPublish(std::function<void(uint16_t)> cb) { publish_cb = cb; return *this; }
+    AsyncMqttClient &setServer(const char *, uint16_t) { return *this; }
+    AsyncMqttClient &setCredentials(const char *, const char *) { return *this; }
+    AsyncMqttClient &setWill(const char *, uint8_t, bool, const char *, size_t = 0) { return *this; }
+    void connect() {}
+    void disconnect(bool = false) {}
+    bool connected() { return is_connected; }
+    uint16_t subscribe(const char *, uint8_t) { return ++packet_id; }
+    uint16_t unsubscribe(const char *) { return ++packet_id; }
+    uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t len = 0, bool dup = false, uint16_t id = 0);
+
+    // Connects to the simulated broker, which hands every message it receives to 'received'.  A rate of 0 is unlimited
+    void sim_connect(uint32_t rate, std::function<void(const std::string &topic, const std::string &payload)> received);
+    size_t sim_queued() { return used; }
+    // Hands the client a message from the broker, in pieces of at most 'chunk' bytes as AsyncMqttClient does when a
+    // message spans several TCP segments.  A chunk of 0 delivers it whole
+    void sim_deliver(const char *topic, const std::string &payload, size_t chunk = 0);
+private:
+    struct packet { std::string topic, payload; uint16_t id; size_t size; };
+    void drain();
+    bool is_connected = false;
+    uint32_t rate = 0;
+    size_t used = 0;
+    bool draining = false;
+    uint16_t packet_id = 0;
+    std::deque<packet> out;
+    std::function<void(const std::string &, const std::string &)> received;
+    std::function<void(bool)> connect_cb;
+    std::function<void(AsyncMqttClientDisconnectReason)> disconnect_cb;
+    std::function<void(char *, char *, AsyncMqttClientMessageProperties, size_t, size_t, size_t)> message_cb;
+    std::function<void(uint16_t)> publish_cb;
+};
+
+#endif
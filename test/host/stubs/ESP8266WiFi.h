@@ -0,0 +1,60 @@
+// A station which is always connected and never finds another network.  The tests wire the mesh links themselves
+#ifndef _SIM_ESP8266WIFI_H_
+#define _SIM_ESP8266WIFI_H_
+#include <Arduino.h>
+#include <user_interface.h>
+
+enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3 };
+enum WiFiMode_t { WIFI_OFF = 0, WIFI_STA = 1, WIFI_AP = 2, WIFI_AP_STA = 3 };
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+#define WIFI_DISCONNECT_REASON_ASSOC_TOOMANY 17
+
+struct WiFiEventStationModeGotIP { IPAddress ip, mask, gw; };
+struct WiFiEventStationModeConnected { String ssid; uint8_t bssid[6]; uint8_t channel; };
+struct WiFiEventStationModeDisconnected { String ssid; uint8_t bssid[6]; unsigned reason; };
+struct WiFiEventSoftAPModeStationConnected { uint8_t mac[6]; uint8_t aid; };
+struct WiFiEventSoftAPModeStationDisconnected { uint8_t mac[6]; uint8_t aid; };
+struct WiFiEventHandlerOpaque {};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+class ESP8266WiFiClass {
+public:
+    int status() { return WL_CONNECTED; }
+    bool isConnected() { return true; }
+    bool disconnect(bool = false) { return true; }
+    bool mode(WiFiMode_t m) { _mode = m; return true; }
+    WiFiMode_t getMode() { return _mode; }
+    int8_t scanNetworks(bool async = false, bool = false, uint8 = 0, uint8 * = NULL) { return async ? WIFI_SCAN_RUNNING : 0; }
+    int8_t scanComplete() { return 0; }
+    void scanDelete() {}
+    int32_t RSSI(uint8_t) { return -50; }
+    int32_t RSSI() { return -50; }
+    String SSID(uint8_t) { return String(""); }
+    uint8_t *BSSID(uint8_t) { return bssid; }
+    uint8_t *BSSID() { return bssid; }
+    String BSSIDstr(uint8_t) { return String("00:00:00:00:00:00"); }
+    int32_t channel(uint8_t) { return 1; }
+    int32_t channel() { return 1; }
+    int begin(const char *, const char *, int32_t = 0, const uint8_t * = NULL, bool = true) { return WL_CONNECTED; }
+    String macAddress() { return String("00:00:00:00:00:00"); }
+    String softAPmacAddress() { return String("00:00:00:00:00:00"); }
+    uint8_t *softAPmacAddress(uint8_t *mac) { memset(mac, 0, 6); return mac; }
+    IPAddress gatewayIP() { return IPAddress(10, 0, 0, 1); }
+    IPAddress localIP() { return IPAddress(10, 0, 0, 2); }
+    bool softAPdisconnect(bool) { return true; }
+    bool softAPConfig(IPAddress, IPAddress, IPAddress) { return true; }
+    bool softAP(const char *, const char *, int = 1, int = 0, int = 4) { return true; }
+    uint8_t softAPgetStationNum() { return 0; }
+    WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)>) { return WiFiEventHandler(); }
+    WiFiEventHandler onStationModeConnected(std::function<void(const WiFiEventStationModeConnected &)>) { return WiFiEventHandler(); }
+    WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)>) { return WiFiEventHandler(); }
+    WiFiEventHandler onSoftAPModeStationConnected(std::function<void(const WiFiEventSoftAPModeStationConnected &)>) { return WiFiEventHandler(); }
+    WiFiEventHandler onSoftAPModeStationDisconnected(std::function<void(const WiFiEventSoftAPModeStationDisconnected &)>) { return WiFiEventHandler(); }
+private:
+    WiFiMode_t _mode = WIFI_STA;
+    uint8_t bssid[6] = {};
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif
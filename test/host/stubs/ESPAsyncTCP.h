@@ -0,0 +1,83 @@
+// Connections are pipes between two simulated nodes.  A sender may have SIM_TCP_WND bytes unacknowledged, and
+// segments of up to SIM_TCP_MSS bytes arrive at the link's rate.  Each is acknowledged as it is delivered
+#ifndef _SIM_ESPASYNCTCP_H_
+#define _SIM_ESPASYNCTCP_H_
+#include <Arduino.h>
+
+#define SIM_TCP_WND 2920
+#define SIM_TCP_MSS 1460
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+class AsyncClient;
+class AsyncServer;
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, size_t, uint32_t)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, int8_t)> AcErrorHandler;
+typedef std::function<void(void *, AsyncClient *, void *, size_t)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t)> AcTimeoutHandler;
+
+class AsyncClient {
+public:
+    AsyncClient();
+    ~AsyncClient();
+    bool connect(IPAddress, uint16_t) { return false; }
+    bool connected() { return peer != NULL; }
+    void close(bool now = false);
+    void stop() { close(); }
+    void abort() { close(); }
+    size_t space() { return peer ? SIM_TCP_WND - unacked : 0; }
+    bool canSend() { return peer != NULL; }
+    size_t add(const char *data, size_t len, uint8_t flags = ASYNC_WRITE_FLAG_COPY);
+    bool send();
+    size_t write(const char *data) { return write(data, strlen(data)); }
+    size_t write(const char *data, size_t len, uint8_t flags = ASYNC_WRITE_FLAG_COPY) { len = add(data, len, flags); send(); return len; }
+    void setNoDelay(bool) {}
+    IPAddress remoteIP() { return IPAddress(10, 0, 0, 1); }
+    void setRxTimeout(uint32_t) {}
+    void ackLater() {}
+    void ack(size_t) {}
+    void onConnect(AcConnectHandler cb, void *arg = 0) { connect_cb = cb; cb_arg = arg; }
+    void onDisconnect(AcConnectHandler cb, void *arg = 0) { disconnect_cb = cb; cb_arg = arg; }
+    void onAck(AcAckHandler cb, void *arg = 0) { ack_cb = cb; cb_arg = arg; }
+    void onError(AcErrorHandler cb, void *arg = 0) { error_cb = cb; cb_arg = arg; }
+    void onData(AcDataHandler cb, void *arg = 0) { data_cb = cb; cb_arg = arg; }
+    void onTimeout(AcTimeoutHandler cb, void *arg = 0) { timeout_cb = cb; cb_arg = arg; }
+
+    // Connects 'client' to 'server' with a pipe carrying 'rate' bytes per millisecond each way
+    static void sim_connect(AsyncClient *client, AsyncServer *server, uint32_t rate);
+    // The handler given to onData(), so a test can wrap it
+    AcDataHandler sim_data_handler() { return data_cb; }
+
+    uint32_t node;         // node which owns this end
+private:
+    void transmit();
+    AsyncClient *peer = NULL;
+    uint32_t rate = 0;
+    std::string out;       // added, not yet delivered
+    size_t unacked = 0;
+    bool sending = false;
+    void *cb_arg = NULL;
+    AcConnectHandler connect_cb, disconnect_cb;
+    AcAckHandler ack_cb;
+    AcErrorHandler error_cb;
+    AcDataHandler data_cb;
+    AcTimeoutHandler timeout_cb;
+};
+
+class AsyncServer {
+public:
+    AsyncServer(uint16_t) : node(sim_node) {}
+    void onClient(AcConnectHandler cb, void *arg) { client_cb = cb; cb_arg = arg; }
+    void setNoDelay(bool) {}
+    void begin() {}
+    void end() {}
+    // A client connected to this server
+    void sim_accept(AsyncClient *c) { if (client_cb) client_cb(cb_arg, c); }
+    uint32_t node;
+private:
+    AcConnectHandler client_cb;
+    void *cb_arg = NULL;
+};
+
+#endif
@@ -0,0 +1,30 @@
+// The tests run without the offline store
+#ifndef _SIM_FS_H_
+#define _SIM_FS_H_
+#include <Arduino.h>
+
+namespace fs {
+class File {
+public:
+    size_t write(const uint8_t *, size_t) { return 0; }
+    size_t read(uint8_t *, size_t) { return 0; }
+    bool seek(uint32_t) { return false; }
+    size_t position() const { return 0; }
+    size_t size() const { return 0; }
+    void close() {}
+    void flush() {}
+    int available() { return 0; }
+    operator bool() const { return false; }
+};
+class FS {
+public:
+    File open(const char *, const char *) { return File(); }
+    bool exists(const char *) { return false; }
+    bool remove(const char *) { return false; }
+    bool rename(const char *, const char *) { return false; }
+};
+}
+using fs::FS;
+using fs::File;
+
+#endif
@@ -0,0 +1,27 @@
+// Timers run on the simulated clock, as the node which set them
+#ifndef _SIM_TICKER_H_
+#define _SIM_TICKER_H_
+#include <Arduino.h>
+
+class Ticker {
+public:
+    ~Ticker() { detach(); }
+    template<typename TCb, typename TArg> void once(float s, TCb cb, TArg arg) { once_ms((uint32_t)(s * 1000), cb, arg); }
+    template<typename TCb, typename TArg> void once_ms(uint32_t ms, TCb cb, TArg arg) {
+        detach();
+        sim_schedule(this, ms, [cb, arg]() { cb(arg); });
+    }
+    template<typename TCb, typename TArg> void attach(float s, TCb cb, TArg arg) { attach_ms((uint32_t)(s * 1000), cb, arg); }
+    template<typename TCb, typename TArg> void attach_ms(uint32_t ms, TCb cb, TArg arg) {
+        detach();
+        repeat(ms, [cb, arg]() { cb(arg); });
+    }
+    void detach() { sim_cancel(this); }
+    bool active() { return sim_pending(this); }
+private:
+    void repeat(uint32_t ms, std::function<void()> fn) {
+        sim_schedule(this, ms, [this, ms, fn]() { repeat(ms, fn); fn(); });
+    }
+};
+
+#endif
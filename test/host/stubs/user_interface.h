@@ -0,0 +1,14 @@
+#ifndef _SIM_USER_INTERFACE_H_
+#define _SIM_USER_INTERFACE_H_
+#include <stdint.h>
+
+#define SOFTAP_IF 1
+#define STATION_IF 0
+typedef enum { USER_IE_BEACON = 0, USER_IE_PROBE_REQ, USER_IE_PROBE_RESP, USER_IE_ASSOC_REQ, USER_IE_ASSOC_RESP, USER_IE_MAX } user_ie_type;
+typedef void (*user_ie_manufacturer_recv_cb_t)(user_ie_type type, const uint8_t sa[6], const uint8_t m_oui[3], uint8_t *ie, uint8_t ie_len, int32_t rssi);
+inline bool wifi_set_macaddr(uint8_t, uint8_t *) { return true; }
+inline bool wifi_set_user_ie(bool, uint8_t *, user_ie_type, uint8_t *, uint8_t) { return true; }
+inline int wifi_register_user_ie_manufacturer_recv_cb(user_ie_manufacturer_recv_cb_t) { return 0; }
+inline void wifi_unregister_user_ie_manufacturer_recv_cb() {}
+
+#endif